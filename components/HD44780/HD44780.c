@@ -24,23 +24,23 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include "sdkconfig.h"
 #include "HD44780.h"
-#include "soc/gpio_reg.h"
-#include "driver/gpio.h"
+#include "HD44780_bus.h"
+#include "esp_log.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "rom/ets_sys.h"
 
-/* Helper functions */
-static void setup_LCD_pins();
-static void set_data_pin_direction(int direction);
-static void set_data_pins(uint8_t data);
-static uint8_t read_data_pins();
-static void set_enable(int level);
-static void set_rw(int level);
-static void set_rs(int level);
-static bool lcd_busy();
-static void execute_instruction();
+static const char *TAG = "HD44780";
+
+static const lcd_bus_t* s_bus = NULL;
+
+#define LINE_0_START 0x00
+#define LINE_0_END 0x27
+#define LINE_1_START 0x40
+#define LINE_1_END 0x67
 
 /* LCD instructions */
 static void return_home();
@@ -50,13 +50,20 @@ static void cursor_or_display_shift(int display_or_cursor, int right_or_left);
 static void function_set(int data_length, int number_of_display_lines, int font);
 static bool set_cgram_address(uint8_t address);
 static bool set_ddram_address(uint8_t address);
-static void write_to_ram(uint8_t data);
 static uint8_t read_from_ram();
 
+static const lcd_bus_t* default_bus(){
+#if CONFIG_HD44780_BUS_PCF8574
+    return &lcd_bus_pcf8574;
+#else
+    return &lcd_bus_gpio;
+#endif
+}
+
 /* Public API */
 
 /**
- * @brief Initializes the LCD display. 
+ * @brief Initializes the LCD display on the bus selected in menuconfig. 
  * 
  * @param lines 0 for 1 line, and 1 for 2 lines. 
  * @param cursor_on_off 0 for off, 1 for on.
@@ -64,24 +71,64 @@ static uint8_t read_from_ram();
  * @return int error code
  */
 int lcd_init(int lines, int cursor_on_off, int cursor_blink){
-    setup_LCD_pins();
+    int err = lcd_init_with_bus(default_bus(), lines, cursor_on_off, cursor_blink);
 
-    set_enable(1);
+#if CONFIG_HD44780_REPORT_THROUGHPUT
+    if(!err){
+        ESP_LOGI(TAG, "%s bus: %d chars/s", s_bus->name, lcd_measure_chars_per_second(LCD_LINE_LENGTH * 4));
+    }
+#endif
+
+    return err;
+}
 
-    // Wait for the busy flag to be equal to zero before attempting to perform any operations.
-    ets_delay_us(5);
-    while(read_data_pins() >= 128){
-        printf("waiting\n");
+/**
+ * @brief   Takes over an LCD that is already initialized, for example after an ESP32 reset that did not power
+ *          cycle the LCD. Only the bus is set up; the display mode and DDRAM contents are left as they are. 
+ * 
+ * @return int error code
+ */
+int lcd_attach(){
+    s_bus = default_bus();
+    s_bus->init();
+
+    return 0;
+}
+
+/**
+ * @brief Initializes the LCD display on a specific bus. 
+ * 
+ * @param bus The bus backend, &lcd_bus_gpio or &lcd_bus_pcf8574, whichever is selected in menuconfig.
+ * @param lines 0 for 1 line, and 1 for 2 lines. 
+ * @param cursor_on_off 0 for off, 1 for on.
+ * @param cursor_blink 0 for off, 1 for on.
+ * @return int error code
+ */
+int lcd_init_with_bus(const lcd_bus_t* bus, int lines, int cursor_on_off, int cursor_blink){
+    if(bus == NULL || (bus->four_bit && bus->write_init_nibble == NULL)){
+        return 1;
     }
 
-    set_enable(0);
+    s_bus = bus;
+    s_bus->init();
+
+    if(s_bus->four_bit){
+        // Without a busy flag the controller has to be walked into 4-bit mode by timing (datasheet figure 24).
+        vTaskDelay(pdMS_TO_TICKS(50));
+        s_bus->write_init_nibble(0x30);
+        ets_delay_us(4100);
+        s_bus->write_init_nibble(0x30);
+        ets_delay_us(100);
+        s_bus->write_init_nibble(0x30);
+        ets_delay_us(100);
+        s_bus->write_init_nibble(0x20);
+        ets_delay_us(100);
+    }
 
-    ets_delay_us(5);
+    function_set(!s_bus->four_bit, lines, 0);
 
     lcd_clear_display();
 
-    function_set(1, lines, 0);
-
     display_on_off_control(1, cursor_on_off, cursor_blink);
     
     entry_mode_set(1, 0);
@@ -89,17 +136,48 @@ int lcd_init(int lines, int cursor_on_off, int cursor_blink){
     return 0;
 }
 
+/**
+ * @brief   Measures how many characters per second the current bus can write, by filling the first line
+ *          repeatedly. Overwrites and then clears the display. 
+ * 
+ * @param count Number of characters to write. 
+ * @return int Characters per second. 
+ */
+int lcd_measure_chars_per_second(int count){
+    char line[LCD_LINE_LENGTH];
+    memset(line, '#', sizeof(line));
+
+    int64_t start = esp_timer_get_time();
+
+    for(int written = 0; written < count; written += LCD_LINE_LENGTH){
+        int length = count - written < LCD_LINE_LENGTH ? count - written : LCD_LINE_LENGTH;
+
+        set_ddram_address(LINE_0_START);
+        s_bus->write_data((const uint8_t*)line, length);
+    }
+
+    int64_t elapsed = esp_timer_get_time() - start;
+
+    lcd_clear_display();
+
+    return elapsed > 0 ? (int)(count * 1000000LL / elapsed) : 0;
+}
+
+/**
+ * @brief Name of the bus the LCD was initialized on. 
+ * 
+ * @return const char* The name, or NULL before lcd_init(). 
+ */
+const char* lcd_bus_name(){
+    return s_bus != NULL ? s_bus->name : NULL;
+}
+
 /**
  * @brief Clears the display and sets the DDRAM address to 0. Unshifts the display. Sets display to increment mode. 
  * 
  */
 void lcd_clear_display(){
-    set_rs(0);
-    set_rw(WRITE);
-    set_data_pin_direction(OUTPUT);
-    set_data_pins(0b00000001);
-
-    execute_instruction();
+    s_bus->write(false, 0b00000001);
 }
 
 /**
@@ -110,28 +188,21 @@ void lcd_clear_display(){
  */
 int lcd_print_string(char* string){
     int string_length = strlen(string);
-    if(string_length > 20 || string_length <= 0){
+    if(string_length > LCD_LINE_LENGTH || string_length <= 0){
         return INVALID_STRING;
     }
     
-    while((*string) != '\0'){
-        write_to_ram(*string);
-        string++;
-    }
+    s_bus->write_data((const uint8_t*)string, string_length);
 
     return 0;
 }
 
-#define LINE_0_START 0x00
-#define LINE_0_END 0x27
-#define LINE_1_START 0x40
-#define LINE_1_END 0x67
-
 /**
  * @brief Set the cursor location object
  * 
  * @param row The row that the cursor should go to. This can be 0-1 (lines 0 and 1).
- * @param column The column that the cursor should move to. This can be 0-15.
+ * @param column The column that the cursor should move to. This can be 0-39. Columns past 15 are off screen
+ *               unless the display is shifted.
  * @return int return code
  */
 int lcd_set_cursor_location(int row, int column){
@@ -139,7 +210,7 @@ int lcd_set_cursor_location(int row, int column){
         return 1;
     }
 
-    if(column > 15 || column < 0){
+    if(column >= LCD_LINE_LENGTH || column < 0){
         return 1;
     }
 
@@ -153,141 +224,48 @@ int lcd_set_cursor_location(int row, int column){
 }
 
 /**
- * @brief   Sets up all of the pins and sets a few defaults. The defaults are as follows:
- *          RW = READ, E = 0, RS = 0. These are set as output pins. D0-D7 are set as input pins. 
+ * @brief   Writes a whole DDRAM line, padding with spaces to all 40 columns. Together with lcd_shift_display() this
+ *          lets text longer than the screen be scrolled without rewriting it. 
  * 
+ * @param row The row to write (0-1).
+ * @param string At most 40 characters.
+ * @return int return code
  */
-static void setup_LCD_pins(){
-    gpio_reset_pin(LED_PIN);
-    gpio_reset_pin(RS);
-    gpio_reset_pin(RW);
-    gpio_reset_pin(E);
-
-    gpio_set_direction(LED_PIN, GPIO_MODE_OUTPUT);
-    gpio_set_direction(RS, GPIO_MODE_OUTPUT);
-    gpio_set_direction(RW, GPIO_MODE_OUTPUT);
-    gpio_set_direction(E, GPIO_MODE_OUTPUT);
-
-    // defaults
-    set_rw(READ);
-    set_enable(0);
-    set_rs(0);
-
-    // this works only if D0-D7 are contiguous
-    for(int i = D0; i <= D7; i++){ // start with D7 because D7 is the higher order bit. 
-        gpio_reset_pin(i);
-        gpio_set_direction(i, GPIO_MODE_INPUT);
+int lcd_write_line(int row, const char* string){
+    int string_length = strlen(string);
+    if(string_length > LCD_LINE_LENGTH){
+        return INVALID_STRING;
     }
-}
 
-
-/**
- * @brief Sets the direction of the data pins.
- * 
- * @param direction 0 for input and 1 for output. 
- */
-static void set_data_pin_direction(int direction){
-    if(direction){
-        REG_WRITE(GPIO_ENABLE_W1TS_REG, DATA_MASK);
-    }else{
-        REG_WRITE(GPIO_ENABLE_W1TC_REG, DATA_MASK);
+    if(lcd_set_cursor_location(row, 0)){
+        return 1;
     }
-}
 
-/**
- * @brief Sets the data gpio pins according to the parameter. 
- * 
- * @param data The 8 data pins will be set to the value of this byte of data. 
- */
-static void set_data_pins(uint8_t data){
-    uint32_t data_shifted = data << D0; // shift the data to begin at D7 which is BIT12
-
-    uint32_t output = (REG_READ(GPIO_OUT_REG) & ~(DATA_MASK)) | (data_shifted);
-
-    REG_WRITE(GPIO_OUT_REG, output);
-}
+    char line[LCD_LINE_LENGTH];
+    memcpy(line, string, string_length);
+    memset(line + string_length, ' ', LCD_LINE_LENGTH - string_length);
 
-/**
- * @brief Reads the data pins and returns it in a byte. 
- * 
- * @return uint8_t The data on the data gpio pins. 
- */
-static uint8_t read_data_pins(){
-    uint8_t input = (REG_READ(GPIO_IN_REG) & DATA_MASK) >> D0;
+    s_bus->write_data((const uint8_t*)line, LCD_LINE_LENGTH);
 
-    return input;
-}
-
-// 1 for enabled, 0 for not enabled. 
-
-/**
- * @brief Sets the enable pin. 
- * 
- * @param level 1 for enabled and 0 for not enabled. 
- */
-static void set_enable(int level){
-    gpio_set_level(E, level);
-}
-
-/**
- * @brief Sets the Read/Write pin. 
- * 
- * @param level 0 for write and 1 for read. 
- */
-static void set_rw(int level){
-    gpio_set_level(RW, level);
-}
-
-/**
- * @brief Sets the register select pin.
- * 
- * @param level 
- */
-static void set_rs(int level){
-    gpio_set_level(RS, level);
+    return 0;
 }
 
 /**
- * @brief Checks whether the LCD is busy with an internal operation. 
+ * @brief   Shifts the whole display (both lines) by one column without touching DDRAM. The lines wrap around at
+ *          40 columns. 
  * 
- * @return true if the LCD is currently busy (busy flag = 1).
- * @return false if the LCD is not busy (busy flag = 0).
+ * @param right_or_left 1 to shift right and 0 to shift left. 
  */
-static bool lcd_busy(){
-    // You can read the data pins when RW=1 and E=1. 
-    set_enable(1);
-    ets_delay_us(1);
-    uint8_t input = read_data_pins();
-    set_enable(0);
-
-    // The most significant bit should be the busy flag. So, any value over 127 would mean that BF = 1.
-    if(input >= 128){
-        return true;
-    }else{
-        return false;
-    }
+void lcd_shift_display(int right_or_left){
+    cursor_or_display_shift(1, right_or_left);
 }
 
 /**
- * @brief   After an instruction is setup by setting the data lines and other accompanying control pins, this
- *          function will execute the instruction on the LCD. On completion of this function, the LCD will be
- *          finished with any internal operations and another instruction can be executed. 
+ * @brief Undoes any display shift and moves the cursor to the start of the first line. 
  * 
  */
-static void execute_instruction(){
-    // Turn on the enable pin for 10us. 
-    set_enable(1);
-    ets_delay_us(1);
-    set_enable(0);
-
-    // After the enable pin falls, the execution in the LCD should have started. Keep checking BF (busy flag) until it isn't busy any longer. 
-    set_rs(0);
-    set_rw(READ);
-    set_data_pin_direction(INPUT);
-
-    while(lcd_busy()){
-        ets_delay_us(5);
-    }
+void lcd_return_home(){
+    return_home();
 }
 
 /**
@@ -295,12 +273,7 @@ static void execute_instruction(){
  * 
  */
 static void return_home(){
-    set_rs(0);
-    set_rw(WRITE);
-    set_data_pin_direction(OUTPUT);
-    set_data_pins(0b00000010);
-
-    execute_instruction();
+    s_bus->write(false, 0b00000010);
 }
 
 /**
@@ -318,14 +291,7 @@ static void entry_mode_set(int increment_decrement, int accompanies_display_shif
     if(increment_decrement) instruction |= 0b00000010;
     if(accompanies_display_shift) instruction |= 0b00000001;
 
-    set_rs(0);
-    set_rw(WRITE);
-
-    set_data_pin_direction(OUTPUT);
-
-    set_data_pins(instruction);
-
-    execute_instruction();
+    s_bus->write(false, instruction);
 }
 
 /**
@@ -342,14 +308,7 @@ static void display_on_off_control(int display, int cursor, int blink){
     if(cursor) instruction |= 0b00000010;
     if(blink) instruction |= 0b00000001;
 
-    set_rs(0);
-    set_rw(WRITE);
-
-    set_data_pin_direction(OUTPUT);
-
-    set_data_pins(instruction);
-
-    execute_instruction();
+    s_bus->write(false, instruction);
 }
 
 /**
@@ -364,14 +323,7 @@ static void cursor_or_display_shift(int display_or_cursor, int right_or_left){
     if(display_or_cursor) instruction |= 0b00001000;
     if(right_or_left) instruction |= 0b00000100;
 
-    set_rs(0);
-    set_rw(WRITE);
-
-    set_data_pin_direction(OUTPUT);
-
-    set_data_pins(instruction);
-
-    execute_instruction();
+    s_bus->write(false, instruction);
 }
 
 /**
@@ -388,15 +340,7 @@ static void function_set(int data_length, int number_of_display_lines, int font)
     if(number_of_display_lines) instruction |= 0b00001000;
     if(font) instruction |= 0b00000100;
 
-    set_rs(0);
-    set_rw(WRITE);
-
-    set_data_pin_direction(OUTPUT);
-
-    set_data_pins(instruction);
-
-    execute_instruction();
-
+    s_bus->write(false, instruction);
 }
 
 /**
@@ -421,33 +365,11 @@ static bool set_cgram_address(uint8_t address){
 static bool set_ddram_address(uint8_t address){
     uint8_t instruction = address | 128;
 
-    set_rs(0);
-    set_rw(WRITE);
-
-    set_data_pin_direction(OUTPUT);
-
-    set_data_pins(instruction);
-
-    execute_instruction();
+    s_bus->write(false, instruction);
 
     return true;
 }
 
-/**
- * @brief Write to either the CG or DDRAM depending on a previous CG or DDRAM address write. 
- * 
- * @param data The data that is to be written to the ram. 
- */
-static void write_to_ram(uint8_t data){
-    set_rs(1);
-    set_rw(0);
-    
-    set_data_pin_direction(OUTPUT);
-    set_data_pins(data);
-
-    execute_instruction();
-}
-
 /**
  * @brief Read from either the CG or DDRAM dependong on a previous CG or DDRAM address write. 
  * 
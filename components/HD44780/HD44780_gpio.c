@@ -0,0 +1,235 @@
+/**
+ * @file HD44780_gpio.c
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Parallel GPIO bus backend for the HD44780 driver. D0-D7, RS, RW and E are wired directly.
+ * @version 0.1
+ * @date 2026-10-19
+ * 
+ * @copyright Copyright (c) 2022
+ * 
+ *  This file is part of smart_lock.
+ *  
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the 
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of 
+ *  the License, or (at your option) any later version.
+ *  
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without 
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ *  General Public License for more details.
+ *  
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not, 
+ *  see <https://www.gnu.org/licenses/>. 
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include "HD44780.h"
+#include "HD44780_bus.h"
+#include "soc/gpio_reg.h"
+#include "driver/gpio.h"
+#include "rom/ets_sys.h"
+
+static void setup_LCD_pins();
+static void set_data_pin_direction(int direction);
+static void set_data_pins(uint8_t data);
+static uint8_t read_data_pins();
+static void set_enable(int level);
+static void set_rw(int level);
+static void set_rs(int level);
+static bool lcd_busy();
+static void execute_instruction();
+
+/**
+ * @brief Sets up the pins and waits for the LCD to finish its power on reset. 
+ * 
+ */
+static void gpio_bus_init(){
+    setup_LCD_pins();
+
+    set_enable(1);
+
+    // Wait for the busy flag to be equal to zero before attempting to perform any operations.
+    ets_delay_us(5);
+    while(read_data_pins() >= 128){
+        ets_delay_us(5);
+    }
+
+    set_enable(0);
+
+    ets_delay_us(5);
+}
+
+/**
+ * @brief Puts one byte on the data pins and executes it. 
+ * 
+ * @param rs false for an instruction and true for data. 
+ * @param byte The instruction or data. 
+ */
+static void gpio_bus_write(bool rs, uint8_t byte){
+    set_rs(rs);
+    set_rw(WRITE);
+
+    set_data_pin_direction(OUTPUT);
+    set_data_pins(byte);
+
+    execute_instruction();
+}
+
+/**
+ * @brief Writes a run of data bytes. Each byte still needs its own strobe and busy flag poll on this bus. 
+ * 
+ * @param data The bytes. 
+ * @param length Number of bytes. 
+ */
+static void gpio_bus_write_data(const uint8_t* data, size_t length){
+    for(size_t i = 0; i < length; i++){
+        gpio_bus_write(true, data[i]);
+    }
+}
+
+const lcd_bus_t lcd_bus_gpio = {
+    .name = "gpio8",
+    .four_bit = false,
+    .init = gpio_bus_init,
+    .write = gpio_bus_write,
+    .write_data = gpio_bus_write_data,
+    .write_init_nibble = NULL,
+};
+
+/**
+ * @brief   Sets up all of the pins and sets a few defaults. The defaults are as follows:
+ *          RW = READ, E = 0, RS = 0. These are set as output pins. D0-D7 are set as input pins. 
+ * 
+ */
+static void setup_LCD_pins(){
+    gpio_reset_pin(LED_PIN);
+    gpio_reset_pin(RS);
+    gpio_reset_pin(RW);
+    gpio_reset_pin(E);
+
+    gpio_set_direction(LED_PIN, GPIO_MODE_OUTPUT);
+    gpio_set_direction(RS, GPIO_MODE_OUTPUT);
+    gpio_set_direction(RW, GPIO_MODE_OUTPUT);
+    gpio_set_direction(E, GPIO_MODE_OUTPUT);
+
+    // defaults
+    set_rw(READ);
+    set_enable(0);
+    set_rs(0);
+
+    // this works only if D0-D7 are contiguous
+    for(int i = D0; i <= D7; i++){ // start with D7 because D7 is the higher order bit. 
+        gpio_reset_pin(i);
+        gpio_set_direction(i, GPIO_MODE_INPUT);
+    }
+}
+
+
+/**
+ * @brief Sets the direction of the data pins.
+ * 
+ * @param direction 0 for input and 1 for output. 
+ */
+static void set_data_pin_direction(int direction){
+    if(direction){
+        REG_WRITE(GPIO_ENABLE_W1TS_REG, DATA_MASK);
+    }else{
+        REG_WRITE(GPIO_ENABLE_W1TC_REG, DATA_MASK);
+    }
+}
+
+/**
+ * @brief Sets the data gpio pins according to the parameter. 
+ * 
+ * @param data The 8 data pins will be set to the value of this byte of data. 
+ */
+static void set_data_pins(uint8_t data){
+    uint32_t data_shifted = data << D0; // shift the data to begin at D7 which is BIT12
+
+    uint32_t output = (REG_READ(GPIO_OUT_REG) & ~(DATA_MASK)) | (data_shifted);
+
+    REG_WRITE(GPIO_OUT_REG, output);
+}
+
+/**
+ * @brief Reads the data pins and returns it in a byte. 
+ * 
+ * @return uint8_t The data on the data gpio pins. 
+ */
+static uint8_t read_data_pins(){
+    uint8_t input = (REG_READ(GPIO_IN_REG) & DATA_MASK) >> D0;
+
+    return input;
+}
+
+// 1 for enabled, 0 for not enabled. 
+
+/**
+ * @brief Sets the enable pin. 
+ * 
+ * @param level 1 for enabled and 0 for not enabled. 
+ */
+static void set_enable(int level){
+    gpio_set_level(E, level);
+}
+
+/**
+ * @brief Sets the Read/Write pin. 
+ * 
+ * @param level 0 for write and 1 for read. 
+ */
+static void set_rw(int level){
+    gpio_set_level(RW, level);
+}
+
+/**
+ * @brief Sets the register select pin.
+ * 
+ * @param level 
+ */
+static void set_rs(int level){
+    gpio_set_level(RS, level);
+}
+
+/**
+ * @brief Checks whether the LCD is busy with an internal operation. 
+ * 
+ * @return true if the LCD is currently busy (busy flag = 1).
+ * @return false if the LCD is not busy (busy flag = 0).
+ */
+static bool lcd_busy(){
+    // You can read the data pins when RW=1 and E=1. 
+    set_enable(1);
+    ets_delay_us(1);
+    uint8_t input = read_data_pins();
+    set_enable(0);
+
+    // The most significant bit should be the busy flag. So, any value over 127 would mean that BF = 1.
+    if(input >= 128){
+        return true;
+    }else{
+        return false;
+    }
+}
+
+/**
+ * @brief   After an instruction is setup by setting the data lines and other accompanying control pins, this
+ *          function will execute the instruction on the LCD. On completion of this function, the LCD will be
+ *          finished with any internal operations and another instruction can be executed. 
+ * 
+ */
+static void execute_instruction(){
+    // Turn on the enable pin for 10us. 
+    set_enable(1);
+    ets_delay_us(1);
+    set_enable(0);
+
+    // After the enable pin falls, the execution in the LCD should have started. Keep checking BF (busy flag) until it isn't busy any longer. 
+    set_rs(0);
+    set_rw(READ);
+    set_data_pin_direction(INPUT);
+
+    while(lcd_busy()){
+        ets_delay_us(5);
+    }
+}
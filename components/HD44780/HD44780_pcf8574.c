@@ -0,0 +1,185 @@
+/**
+ * @file HD44780_pcf8574.c
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief PCF8574 I2C backpack bus backend for the HD44780 driver.
+ * @version 0.1
+ * @date 2026-10-19
+ * 
+ * @copyright Copyright (c) 2022
+ * 
+ *  This file is part of smart_lock.
+ *  
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the 
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of 
+ *  the License, or (at your option) any later version.
+ *  
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without 
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ *  General Public License for more details.
+ *  
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not, 
+ *  see <https://www.gnu.org/licenses/>. 
+ *
+ *  The backpack drives the LCD in 4-bit mode: P0 = RS, P1 = RW, P2 = E, P3 = backlight, P4-P7 = D4-D7. Every
+ *  expander write is an I2C byte, so one LCD byte is four of them (high nibble with E up, then down, then the low
+ *  nibble the same way). A whole run of characters is queued into a single I2C transaction, so the per
+ *  transaction overhead (start, address, driver round trip) is paid once per string instead of once per E edge.
+ *
+ *  RW is never raised, so the busy flag cannot be read. At 100 kHz each expander byte takes about 90 us, which
+ *  already covers the 37 us most instructions need; only clear and return home get an explicit wait. That is why
+ *  CONFIG_HD44780_I2C_CLOCK_HZ stops at 100 kHz: at 400 kHz a byte takes about 22 us, less than an instruction.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+#include "HD44780.h"
+#include "HD44780_bus.h"
+#include "driver/i2c.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "rom/ets_sys.h"
+
+#define PCF_RS BIT0
+#define PCF_E BIT2
+#define PCF_BACKLIGHT BIT3
+
+#define PCF_BYTES_PER_CHAR 4
+#define PCF_CHARS_PER_TRANSACTION LCD_LINE_LENGTH
+#define PCF_CMD_LINK_SIZE I2C_LINK_RECOMMENDED_SIZE(1) // one write of the whole buffer per transaction
+
+#define SLOW_INSTRUCTION_US 1600 // clear display and return home take 1.52 ms
+
+_Static_assert(CONFIG_HD44780_I2C_CLOCK_HZ <= 100000, "expander bytes must outlast the 37 us instruction time");
+
+static const char *TAG = "HD44780_PCF8574";
+
+static uint8_t s_buffer[PCF_CHARS_PER_TRANSACTION * PCF_BYTES_PER_CHAR];
+static uint8_t s_cmd_link[PCF_CMD_LINK_SIZE];
+static bool s_failing = false;
+
+/**
+ * @brief Appends the two expander bytes that strobe one nibble into the LCD. 
+ * 
+ * @param out Where to write the two bytes. 
+ * @param nibble The nibble, in the upper four bits. 
+ * @param control RS and backlight bits. 
+ * @return uint8_t* Just past the written bytes. 
+ */
+static uint8_t* put_nibble(uint8_t* out, uint8_t nibble, uint8_t control){
+    out[0] = (nibble & 0xF0) | control | PCF_E;
+    out[1] = (nibble & 0xF0) | control;
+    return out + 2;
+}
+
+static uint8_t* put_byte(uint8_t* out, bool rs, uint8_t byte){
+    uint8_t control = PCF_BACKLIGHT | (rs ? PCF_RS : 0);
+
+    out = put_nibble(out, byte, control);
+    return put_nibble(out, byte << 4, control);
+}
+
+/**
+ * @brief   Sends the expander bytes as a single I2C transaction. A failure is logged when it starts and when it
+ *          ends rather than on every write, since the status screens keep writing to an LCD that is not there.
+ * 
+ * @param data The expander bytes. 
+ * @param length Number of bytes. 
+ * @return esp_err_t The result of the transaction.
+ */
+static esp_err_t transmit(const uint8_t* data, size_t length){
+    i2c_cmd_handle_t cmd = i2c_cmd_link_create_static(s_cmd_link, sizeof(s_cmd_link));
+
+    i2c_master_start(cmd);
+    i2c_master_write_byte(cmd, (CONFIG_HD44780_PCF8574_ADDRESS << 1) | I2C_MASTER_WRITE, true);
+    i2c_master_write(cmd, data, length, true);
+    i2c_master_stop(cmd);
+
+    esp_err_t err = i2c_master_cmd_begin(CONFIG_HD44780_I2C_PORT, cmd, pdMS_TO_TICKS(100));
+
+    i2c_cmd_link_delete_static(cmd);
+
+    if(err != ESP_OK && !s_failing){
+        ESP_LOGE(TAG, "no answer from 0x%02x: %s", CONFIG_HD44780_PCF8574_ADDRESS, esp_err_to_name(err));
+    }else if(err == ESP_OK && s_failing){
+        ESP_LOGI(TAG, "0x%02x answers again", CONFIG_HD44780_PCF8574_ADDRESS);
+    }
+    s_failing = err != ESP_OK;
+
+    return err;
+}
+
+static void pcf8574_bus_init(){
+    i2c_config_t config = {
+        .mode = I2C_MODE_MASTER,
+        .sda_io_num = CONFIG_HD44780_I2C_SDA,
+        .scl_io_num = CONFIG_HD44780_I2C_SCL,
+        .sda_pullup_en = GPIO_PULLUP_ENABLE,
+        .scl_pullup_en = GPIO_PULLUP_ENABLE,
+        .master.clk_speed = CONFIG_HD44780_I2C_CLOCK_HZ,
+    };
+
+    i2c_param_config(CONFIG_HD44780_I2C_PORT, &config);
+    i2c_driver_install(CONFIG_HD44780_I2C_PORT, I2C_MODE_MASTER, 0, 0, 0);
+
+    // All lines low with the backlight on.
+    uint8_t idle = PCF_BACKLIGHT;
+    transmit(&idle, 1);
+}
+
+/**
+ * @brief Sends one instruction or data byte. 
+ * 
+ * @param rs false for an instruction and true for data. 
+ * @param byte The instruction or data. 
+ */
+static void pcf8574_bus_write(bool rs, uint8_t byte){
+    put_byte(s_buffer, rs, byte);
+    transmit(s_buffer, PCF_BYTES_PER_CHAR);
+
+    if(!rs && byte <= 0x03){ // clear display or return home
+        ets_delay_us(SLOW_INSTRUCTION_US);
+    }
+}
+
+/**
+ * @brief Sends a run of data bytes, one I2C transaction per line's worth of characters. 
+ * 
+ * @param data The bytes. 
+ * @param length Number of bytes. 
+ */
+static void pcf8574_bus_write_data(const uint8_t* data, size_t length){
+    while(length > 0){
+        size_t count = length < PCF_CHARS_PER_TRANSACTION ? length : PCF_CHARS_PER_TRANSACTION;
+        uint8_t* out = s_buffer;
+
+        for(size_t i = 0; i < count; i++){
+            out = put_byte(out, true, data[i]);
+        }
+        if(transmit(s_buffer, out - s_buffer) != ESP_OK){
+            return; // the rest would fail the same way
+        }
+
+        data += count;
+        length -= count;
+    }
+}
+
+/**
+ * @brief Strobes only the upper nibble of an instruction, for the 4-bit init sequence. 
+ * 
+ * @param nibble The nibble, in the upper four bits. 
+ */
+static void pcf8574_bus_write_init_nibble(uint8_t nibble){
+    put_nibble(s_buffer, nibble, PCF_BACKLIGHT);
+    transmit(s_buffer, 2);
+}
+
+const lcd_bus_t lcd_bus_pcf8574 = {
+    .name = "pcf8574",
+    .four_bit = true,
+    .init = pcf8574_bus_init,
+    .write = pcf8574_bus_write,
+    .write_data = pcf8574_bus_write_data,
+    .write_init_nibble = pcf8574_bus_write_init_nibble,
+};
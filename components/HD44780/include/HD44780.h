@@ -24,6 +24,7 @@
 #pragma once
 
 #include<stdbool.h>
+#include "HD44780_bus.h"
 
 #define LED_PIN 23
 #define RS 21
@@ -49,9 +50,19 @@
 
 #define INVALID_STRING 1
 
+#define LCD_LINE_LENGTH 40 // DDRAM columns per line
+#define LCD_VISIBLE_COLUMNS 16
+
 /* Public API */
 void blink_bitbang();
 int lcd_init(int num_lines, int cursor_on_off, int cursor_blink);
+int lcd_attach();
+int lcd_init_with_bus(const lcd_bus_t* bus, int num_lines, int cursor_on_off, int cursor_blink);
 void lcd_clear_display();
 int lcd_print_string(char* string);
-int lcd_set_cursor_location(int row, int column);
\ No newline at end of file
+int lcd_set_cursor_location(int row, int column);
+int lcd_write_line(int row, const char* string);
+void lcd_shift_display(int right_or_left);
+void lcd_return_home();
+int lcd_measure_chars_per_second(int count);
+const char* lcd_bus_name();
\ No newline at end of file
@@ -0,0 +1,50 @@
+/**
+ * @file HD44780_bus.h
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Bus backends for the HD44780 driver.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief   How the instruction layer in HD44780.c reaches the LCD. A backend moves bytes to the controller and makes
+ *          sure each one has finished executing before the next is sent, either by polling the busy flag or by
+ *          waiting out the datasheet execution times.
+ */
+typedef struct{
+    const char* name;
+    bool four_bit;  // true if the bus only carries D4-D7, so bytes are sent as two nibbles
+
+    void (*init)(void);
+    // Sends one instruction (rs = false) or one data byte (rs = true).
+    void (*write)(bool rs, uint8_t byte);
+    // Sends a run of data bytes. Backends batch these as much as the bus allows.
+    void (*write_data)(const uint8_t* data, size_t length);
+    // Sends only the upper nibble of an instruction. Used by the 4-bit init sequence, before the controller has
+    // been switched to 4-bit mode. Unused on 8-bit buses.
+    void (*write_init_nibble)(uint8_t nibble);
+} lcd_bus_t;
+
+extern const lcd_bus_t lcd_bus_gpio;
+extern const lcd_bus_t lcd_bus_pcf8574;
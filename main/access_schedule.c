@@ -0,0 +1,677 @@
+/**
+ * @file access_schedule.c
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Weekly access schedules, compiled to slot bitmaps, and scheduled passage windows.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ *
+ *  Schedules arrive as JSON on SCHEDULE_TOPIC, signed and stamped with "boot" and "seq" like a command (see
+ *  command.c and tools/sign_message.py):
+ *
+ *      {"default": [{"days": "daily", "from": "06:00", "to": "22:00"}],
+ *       "groups": [{"id": 1, "rules": [{"days": "mon-fri", "from": "08:00", "to": "10:00"}]}],
+ *       "users": [{"id": 1042, "groups": [1]}, {"id": 7, "rules": [{"days": "daily"}]}],
+ *       "passage": [{"days": "mon-fri", "from": "09:00", "to": "17:00"}]}
+ *
+ *  and are compiled once into one bitmap of 15 minute slots per distinct schedule. A user's bitmap is the union of
+ *  its own rules and its groups' rules. The "user" of a signed command picks the bitmap (see command.c); users
+ *  that are not listed, unsigned commands and commands without a user get the default, which allows every slot
+ *  if it is not given. The button is never checked. So checking an unlock is a binary search through the sorted
+ *  users and a single bit test, however many rules there were.
+ *
+ *  "days" is a comma separated list of days or ranges of days ("mon-fri", "sat,sun", "fri-mon", "daily"). "from"
+ *  defaults to 00:00 and "to" to 24:00; a rule whose "to" is not after its "from" runs past midnight. Times are
+ *  rounded out to whole slots. An empty object removes every schedule.
+ *
+ *  Passage windows hold the lock open. A single timer is armed, for the next slot boundary at which the passage
+ *  bitmap changes. When it fires, the lock task applies the window it is now in and the timer is armed for the
+ *  change after that. Boundaries are worked out in local time (CONFIG_SMART_LOCK_TIMEZONE), so a daylight saving
+ *  change moves them with the wall clock, and they are worked out again whenever SNTP sets the clock.
+ *
+ *  Until the clock has been set, only schedules that allow every slot let anyone in, and passage windows are
+ *  not applied. The compiled table is kept in NVS, so schedules are enforced from boot, before the broker is
+ *  reachable.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "cJSON.h"
+#include "esp_crc.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "nvs.h"
+
+#include "timer_service.h"
+#include "lock_actuation.h"
+#include "time_sync.h"
+#include "access_schedule.h"
+
+#define NVS_NAMESPACE "smart_lock"
+#define NVS_SCHEDULE_KEY "schedule"
+
+/* Bump this whenever access_table_t changes. A stored table of another version is dropped until the schedules
+ * are published again. */
+#define ACCESS_TABLE_VERSION 1
+
+#define NO_WEEK 0xff
+#define CHECK_RETRY_US (1000 * 1000)
+#define BOUNDARY_MARGIN_US 1000         // fire just after a boundary rather than just before it
+
+typedef struct{
+    uint32_t user;
+    uint32_t week;      // index into weeks
+} access_user_t;
+
+/* The compiled schedules, as kept in RAM and in NVS. */
+typedef struct{
+    uint16_t version;
+    uint16_t user_count;
+    uint8_t week_count;
+    uint8_t default_week;
+    uint8_t passage_week;                       // NO_WEEK if there are no passage windows
+    uint8_t reserved;
+    uint32_t always;                            // bit n set if weeks[n] allows every slot
+    access_user_t users[ACCESS_MAX_USERS];      // sorted by user
+    access_week_t weeks[ACCESS_MAX_WEEKS];
+    uint32_t crc; // must stay last, covers everything before it
+} access_table_t;
+
+static const char *TAG = "SCHEDULE";
+
+static const char* const s_day_names[7] = {"mon", "tue", "wed", "thu", "fri", "sat", "sun"};
+
+/* Readers look things up in *s_current under s_table_lock. A new table is compiled into the other one, which no
+ * reader can be in, and swapped in under the lock. Only access_schedule_update_json() writes. */
+static access_table_t s_tables[2];
+static access_table_t* s_current = &s_tables[0];
+static portMUX_TYPE s_table_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static soft_timer_t s_action_timer;
+static bool s_started = false;
+
+/* Groups of the table being compiled. Only touched by access_schedule_update_json(). */
+static uint32_t s_group_ids[ACCESS_MAX_WEEKS];
+static access_week_t s_group_weeks[ACCESS_MAX_WEEKS];
+
+static inline bool week_has(const access_week_t* week, int slot){
+    return (week->bits[slot >> 5] >> (slot & 31)) & 1;
+}
+
+static void week_set(access_week_t* week, int slot){
+    week->bits[slot >> 5] |= 1u << (slot & 31);
+}
+
+static bool week_is_full(const access_week_t* week){
+    for(int i = 0; i < ACCESS_SLOTS_PER_WEEK / 32; i++){
+        if(week->bits[i] != UINT32_MAX){
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint32_t table_crc(const access_table_t* table){
+    return esp_crc32_le(0, (const uint8_t*)table, sizeof(access_table_t) - sizeof(uint32_t));
+}
+
+/**
+ * @brief No schedules: everyone is let in at any time and there are no passage windows.
+ *
+ * @param table The table.
+ */
+static void set_defaults(access_table_t* table){
+    memset(table, 0, sizeof(*table));
+
+    table->version = ACCESS_TABLE_VERSION;
+    table->week_count = 1;
+    table->default_week = 0;
+    table->passage_week = NO_WEEK;
+    table->always = 1;
+    memset(&table->weeks[0], 0xff, sizeof(access_week_t));
+    table->crc = table_crc(table);
+}
+
+/**
+ * @brief The slot of the week the local time is in.
+ *
+ * @param local Receives the local time.
+ * @return int The slot, or -1 if the clock has not been set.
+ */
+static int current_slot(struct tm* local){
+    time_t now = time(NULL);
+
+    if(!time_sync_is_set()){
+        return -1;
+    }
+    localtime_r(&now, local);
+
+    // tm_wday counts from Sunday; the week starts on Monday.
+    return ((local->tm_wday + 6) % 7) * ACCESS_SLOTS_PER_DAY +
+           (local->tm_hour * 60 + local->tm_min) / ACCESS_SLOT_MINUTES;
+}
+
+static int day_index(const char* name, int length){
+    for(int i = 0; i < 7; i++){
+        if(length == 3 && strncmp(name, s_day_names[i], 3) == 0){
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Parses a list of days, e.g. "mon-fri", "sat,sun", "fri-mon" or "daily".
+ *
+ * @param text The list.
+ * @param days Receives one bit per day, Monday in bit 0.
+ * @return true if the list was understood.
+ */
+static bool parse_days(const char* text, uint8_t* days){
+    *days = 0;
+
+    if(strcmp(text, "daily") == 0){
+        *days = 0x7f;
+        return true;
+    }
+
+    while(*text != '\0'){
+        const char* end = text + strcspn(text, ",");
+        const char* dash = memchr(text, '-', end - text);
+        int first = day_index(text, (dash != NULL ? dash : end) - text);
+        int last = dash != NULL ? day_index(dash + 1, end - dash - 1) : first;
+
+        if(first < 0 || last < 0){
+            return false;
+        }
+        // Ranges may wrap round the end of the week.
+        for(int day = first; ; day = (day + 1) % 7){
+            *days |= 1 << day;
+            if(day == last){
+                break;
+            }
+        }
+
+        text = *end == ',' ? end + 1 : end;
+    }
+
+    return *days != 0;
+}
+
+/**
+ * @brief Parses "HH:MM", 00:00 to 24:00.
+ *
+ * @param item The JSON string, or NULL to take the fallback.
+ * @param fallback Minutes to use if the item is missing.
+ * @param minutes Receives minutes since midnight.
+ * @return true if the time was understood.
+ */
+static bool parse_time(const cJSON* item, int fallback, int* minutes){
+    unsigned hours, mins;
+    char extra;
+
+    if(item == NULL){
+        *minutes = fallback;
+        return true;
+    }
+    if(!cJSON_IsString(item) || sscanf(item->valuestring, "%u:%u%c", &hours, &mins, &extra) != 2 ||
+       mins > 59 || hours * 60 + mins > 24 * 60){
+        return false;
+    }
+
+    *minutes = hours * 60 + mins;
+    return true;
+}
+
+/**
+ * @brief Adds the slots of a JSON array of rules to a week.
+ *
+ * @param rules The rules.
+ * @param week The week. Slots already set stay set.
+ * @return true if every rule was understood.
+ */
+static bool compile_rules(const cJSON* rules, access_week_t* week){
+    cJSON* rule;
+
+    if(!cJSON_IsArray(rules)){
+        return false;
+    }
+
+    cJSON_ArrayForEach(rule, rules){
+        cJSON* days_item = cJSON_GetObjectItem(rule, "days");
+        uint8_t days;
+        int from, to;
+
+        if(!cJSON_IsObject(rule) || !cJSON_IsString(days_item) || !parse_days(days_item->valuestring, &days) ||
+           !parse_time(cJSON_GetObjectItem(rule, "from"), 0, &from) ||
+           !parse_time(cJSON_GetObjectItem(rule, "to"), 24 * 60, &to)){
+            return false;
+        }
+
+        int first = from / ACCESS_SLOT_MINUTES;
+        int end = (to + ACCESS_SLOT_MINUTES - 1) / ACCESS_SLOT_MINUTES;
+        if(end <= first){
+            // Runs past midnight into the next day, and from Sunday into Monday.
+            end += ACCESS_SLOTS_PER_DAY;
+        }
+
+        for(int day = 0; day < 7; day++){
+            if(!(days & (1 << day))){
+                continue;
+            }
+            for(int slot = first; slot < end; slot++){
+                week_set(week, (day * ACCESS_SLOTS_PER_DAY + slot) % ACCESS_SLOTS_PER_WEEK);
+            }
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Adds a compiled week to a table. Users with the same schedule share one week.
+ *
+ * @param table The table.
+ * @param week The week.
+ * @return int Index of the week in the table, or -1 if the table is full.
+ */
+static int add_week(access_table_t* table, const access_week_t* week){
+    for(int i = 0; i < table->week_count; i++){
+        if(memcmp(&table->weeks[i], week, sizeof(*week)) == 0){
+            return i;
+        }
+    }
+    if(table->week_count >= ACCESS_MAX_WEEKS){
+        return -1;
+    }
+
+    table->weeks[table->week_count] = *week;
+    if(week_is_full(week)){
+        table->always |= 1u << table->week_count;
+    }
+
+    return table->week_count++;
+}
+
+static int compare_users(const void* a, const void* b){
+    uint32_t x = ((const access_user_t*)a)->user;
+    uint32_t y = ((const access_user_t*)b)->user;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Compiles JSON schedules into a table.
+ *
+ * @param root The JSON object.
+ * @param table Receives the table, without its CRC.
+ * @return const char* NULL if it compiled, otherwise what was wrong with it.
+ */
+static const char* compile(const cJSON* root, access_table_t* table){
+    access_week_t week;
+    cJSON* item;
+    cJSON* entry;
+    int group_count = 0;
+    int index;
+
+    memset(table, 0, sizeof(*table));
+    table->version = ACCESS_TABLE_VERSION;
+    table->passage_week = NO_WEEK;
+
+    item = cJSON_GetObjectItem(root, "default");
+    memset(&week, item != NULL ? 0 : 0xff, sizeof(week));
+    if(item != NULL && !compile_rules(item, &week)){
+        return "bad default";
+    }
+    table->default_week = add_week(table, &week);
+
+    item = cJSON_GetObjectItem(root, "passage");
+    if(item != NULL){
+        memset(&week, 0, sizeof(week));
+        if(!compile_rules(item, &week)){
+            return "bad passage";
+        }
+        if((index = add_week(table, &week)) < 0){
+            return "too many schedules";
+        }
+        table->passage_week = index;
+    }
+
+    item = cJSON_GetObjectItem(root, "groups");
+    if(item != NULL && !cJSON_IsArray(item)){
+        return "bad groups";
+    }
+    cJSON_ArrayForEach(entry, item){
+        cJSON* id = cJSON_GetObjectItem(entry, "id");
+
+        if(group_count >= ACCESS_MAX_WEEKS){
+            return "too many groups";
+        }
+        if(!cJSON_IsNumber(id)){
+            return "bad group";
+        }
+        s_group_ids[group_count] = id->valuedouble;
+        memset(&s_group_weeks[group_count], 0, sizeof(access_week_t));
+        if(!compile_rules(cJSON_GetObjectItem(entry, "rules"), &s_group_weeks[group_count])){
+            return "bad group rules";
+        }
+        group_count++;
+    }
+
+    item = cJSON_GetObjectItem(root, "users");
+    if(item != NULL && !cJSON_IsArray(item)){
+        return "bad users";
+    }
+    cJSON_ArrayForEach(entry, item){
+        cJSON* id = cJSON_GetObjectItem(entry, "id");
+        cJSON* rules = cJSON_GetObjectItem(entry, "rules");
+        cJSON* groups = cJSON_GetObjectItem(entry, "groups");
+        cJSON* group;
+
+        if(table->user_count >= ACCESS_MAX_USERS){
+            return "too many users";
+        }
+        // User 0 is what commands without a user get, so it cannot be given a schedule of its own.
+        if(!cJSON_IsNumber(id) || id->valuedouble < 1 || id->valuedouble > UINT32_MAX){
+            return "bad user";
+        }
+
+        memset(&week, 0, sizeof(week));
+        if(rules != NULL && !compile_rules(rules, &week)){
+            return "bad user rules";
+        }
+        if(groups != NULL && !cJSON_IsArray(groups)){
+            return "bad user groups";
+        }
+        cJSON_ArrayForEach(group, groups){
+            int g = 0;
+            while(g < group_count && !(cJSON_IsNumber(group) && s_group_ids[g] == group->valuedouble)){
+                g++;
+            }
+            if(g == group_count){
+                return "unknown group";
+            }
+            for(int i = 0; i < ACCESS_SLOTS_PER_WEEK / 32; i++){
+                week.bits[i] |= s_group_weeks[g].bits[i];
+            }
+        }
+
+        if((index = add_week(table, &week)) < 0){
+            return "too many schedules";
+        }
+        table->users[table->user_count].user = id->valuedouble;
+        table->users[table->user_count].week = index;
+        table->user_count++;
+    }
+
+    qsort(table->users, table->user_count, sizeof(access_user_t), compare_users);
+    for(int i = 1; i < table->user_count; i++){
+        if(table->users[i].user == table->users[i - 1].user){
+            return "duplicate user";
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Finds the week that applies to a user.
+ *
+ * @param table The table.
+ * @param user The user, 0 for none.
+ * @return int Index of the week.
+ */
+static int user_week(const access_table_t* table, uint32_t user){
+    int low = 0;
+    int high = table->user_count - 1;
+
+    while(low <= high){
+        int mid = (low + high) / 2;
+
+        if(table->users[mid].user == user){
+            return table->users[mid].week;
+        }
+        if(table->users[mid].user < user){
+            low = mid + 1;
+        }else{
+            high = mid - 1;
+        }
+    }
+
+    return table->default_week;
+}
+
+static void load(access_table_t* table){
+    nvs_handle_t handle;
+    size_t len = sizeof(*table);
+    bool loaded = false;
+
+    if(nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK){
+        loaded = nvs_get_blob(handle, NVS_SCHEDULE_KEY, table, &len) == ESP_OK && len == sizeof(*table) &&
+                 table->version == ACCESS_TABLE_VERSION && table->crc == table_crc(table);
+        nvs_close(handle);
+    }
+
+    if(!loaded){
+        set_defaults(table);
+    }
+}
+
+static esp_err_t store(const access_table_t* table){
+    nvs_handle_t handle;
+
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if(err != ESP_OK){
+        return err;
+    }
+
+    err = nvs_set_blob(handle, NVS_SCHEDULE_KEY, table, sizeof(*table));
+    if(err == ESP_OK){
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+
+    return err;
+}
+
+/**
+ * @brief Asks the lock task to apply the passage windows, or tries again shortly if its queue is full.
+ *
+ */
+static void check_soon(){
+    if(!request_schedule_check()){
+        soft_timer_start_once(&s_action_timer, CHECK_RETRY_US);
+    }
+}
+
+/**
+ * @brief Action timer callback. Runs on the timer service task, so it only hands the work to the lock task.
+ *
+ * @param arg unused
+ */
+static void action_timer_callback(void* arg){
+    check_soon();
+}
+
+/**
+ * @brief   Loads the compiled schedules from NVS and applies the passage window the lock is in, if the clock is
+ *          already set. NVS must already be initialized (lock_config_load()) and the lock task started.
+ *
+ */
+void access_schedule_start(){
+    setenv("TZ", CONFIG_SMART_LOCK_TIMEZONE, 1);
+    tzset();
+
+    load(&s_tables[0]);
+    s_current = &s_tables[0];
+
+    soft_timer_init(&s_action_timer, action_timer_callback, NULL);
+    s_started = true;
+
+    ESP_LOGI(TAG, "%u users, %u schedules", s_current->user_count, s_current->week_count);
+
+    check_soon();
+}
+
+/**
+ * @brief   Checks whether a user may unlock now: a binary search for the user and one bit test, whatever the rules
+ *          were.
+ *
+ * @param user The "user" of a signed command, 0 for commands without one.
+ * @return true if the user's schedule includes the current slot.
+ */
+bool access_schedule_allows(uint32_t user){
+    struct tm local;
+    // localtime_r() takes a lock of its own, so the slot is worked out before the table lock is taken.
+    int slot = current_slot(&local);
+    bool allowed;
+
+    portENTER_CRITICAL(&s_table_lock);
+    const access_table_t* table = s_current;
+    int week = user_week(table, user);
+    allowed = (table->always & (1u << week)) || (slot >= 0 && week_has(&table->weeks[week], slot));
+    portEXIT_CRITICAL(&s_table_lock);
+
+    return allowed;
+}
+
+/**
+ * @brief   Compiles and applies a new set of schedules, e.g. from SCHEDULE_TOPIC. Either the whole set is applied or
+ *          none of it. The compiled table is only written to NVS if it changed, so publishing the same set again
+ *          costs no flash writes. Keys other than the schedules themselves ("boot", "seq") are ignored.
+ *
+ * @param json The JSON text.
+ * @param len Length of the JSON text.
+ * @return esp_err_t ESP_ERR_INVALID_ARG if the schedules do not compile.
+ */
+esp_err_t access_schedule_update_json(const char* json, size_t len){
+    cJSON* root = cJSON_ParseWithLength(json, len);
+    if(root == NULL || !cJSON_IsObject(root)){
+        cJSON_Delete(root);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    access_table_t* next = (s_current == &s_tables[0]) ? &s_tables[1] : &s_tables[0];
+
+    int64_t start = esp_timer_get_time();
+    const char* error = compile(root, next);
+    uint32_t elapsed = esp_timer_get_time() - start;
+    cJSON_Delete(root);
+
+    if(error != NULL){
+        ESP_LOGE(TAG, "schedules rejected: %s", error);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    next->crc = table_crc(next);
+    if(memcmp(next, s_current, sizeof(*next)) == 0){
+        return ESP_OK;
+    }
+
+    esp_err_t err = store(next);
+    if(err != ESP_OK){
+        ESP_LOGE(TAG, "could not store schedules: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    portENTER_CRITICAL(&s_table_lock);
+    s_current = next;
+    portEXIT_CRITICAL(&s_table_lock);
+
+    ESP_LOGI(TAG, "%u users, %u schedules compiled in %u us", next->user_count, next->week_count, elapsed);
+
+    if(s_started){
+        check_soon();
+    }
+
+    return ESP_OK;
+}
+
+/**
+ * @brief Called when SNTP has set the clock. Passage windows are worked out again against the new time.
+ *
+ */
+void access_schedule_clock_changed(){
+    if(s_started){
+        check_soon();
+    }
+}
+
+/**
+ * @brief   Works out which passage window the lock is in and arms the action timer for the next slot boundary at
+ *          which that changes. Only called by the lock task, which then holds the lock open or releases it.
+ *
+ * @return access_passage_t What the lock should be doing now.
+ */
+access_passage_t access_schedule_evaluate(){
+    access_week_t passage_copy;
+    const access_week_t* passage = &passage_copy;
+    bool has_passage;
+    struct tm local;
+    int slot = current_slot(&local);
+
+    if(slot < 0){
+        // SNTP calls access_schedule_clock_changed() once it has the time.
+        return ACCESS_PASSAGE_UNKNOWN;
+    }
+
+    // Copied out, so the walk to the next boundary and the timer calls happen outside the lock.
+    portENTER_CRITICAL(&s_table_lock);
+    has_passage = s_current->passage_week != NO_WEEK;
+    if(has_passage){
+        passage_copy = s_current->weeks[s_current->passage_week];
+    }
+    portEXIT_CRITICAL(&s_table_lock);
+
+    if(!has_passage){
+        soft_timer_stop(&s_action_timer);
+        return ACCESS_PASSAGE_CLOSED;
+    }
+
+    bool open = week_has(passage, slot);
+    int steps = 1;
+
+    while(steps < ACCESS_SLOTS_PER_WEEK && week_has(passage, (slot + steps) % ACCESS_SLOTS_PER_WEEK) == open){
+        steps++;
+    }
+
+    if(steps == ACCESS_SLOTS_PER_WEEK){
+        // Open all week or never; nothing to wait for.
+        soft_timer_stop(&s_action_timer);
+    }else{
+        // mktime() normalizes the minutes into a date, in local time, so a daylight saving change is accounted for.
+        struct tm boundary = local;
+        struct timeval now;
+
+        boundary.tm_min = (local.tm_min / ACCESS_SLOT_MINUTES + steps) * ACCESS_SLOT_MINUTES;
+        boundary.tm_sec = 0;
+        boundary.tm_isdst = -1;
+        time_t deadline = mktime(&boundary);
+
+        gettimeofday(&now, NULL);
+        int64_t delay_us = (int64_t)(deadline - now.tv_sec) * 1000000 - now.tv_usec + BOUNDARY_MARGIN_US;
+        soft_timer_start_once(&s_action_timer, delay_us > BOUNDARY_MARGIN_US ? delay_us : BOUNDARY_MARGIN_US);
+    }
+
+    return open ? ACCESS_PASSAGE_OPEN : ACCESS_PASSAGE_CLOSED;
+}
@@ -0,0 +1,58 @@
+/**
+ * @file access_schedule.h
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Weekly access schedules, compiled to slot bitmaps, and scheduled passage windows.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+/* Rules in JSON, see access_schedule.c, signed like a command (see command_authenticate()). Not retained, since
+ * the signature is only good for one boot; the lock keeps the compiled table in NVS instead. */
+#define SCHEDULE_TOPIC "/mister_nolan/schedule"
+
+#define ACCESS_SLOT_MINUTES 15
+#define ACCESS_SLOTS_PER_DAY (24 * 60 / ACCESS_SLOT_MINUTES)
+#define ACCESS_SLOTS_PER_WEEK (7 * ACCESS_SLOTS_PER_DAY)
+
+#define ACCESS_MAX_USERS 64
+#define ACCESS_MAX_WEEKS 16     // distinct compiled schedules, including the default and the passage windows
+
+/* What the passage windows say the lock should be doing now. */
+typedef enum{
+    ACCESS_PASSAGE_UNKNOWN,     // the clock has not been set
+    ACCESS_PASSAGE_CLOSED,
+    ACCESS_PASSAGE_OPEN
+} access_passage_t;
+
+/* One bit per slot of the week, Monday 00:00 first. A day is exactly three words. */
+typedef struct{
+    uint32_t bits[ACCESS_SLOTS_PER_WEEK / 32];
+} access_week_t;
+
+void access_schedule_start();
+bool access_schedule_allows(uint32_t user);
+esp_err_t access_schedule_update_json(const char* json, size_t len);
+void access_schedule_clock_changed();
+access_passage_t access_schedule_evaluate();
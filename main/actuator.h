@@ -0,0 +1,71 @@
+/**
+ * @file actuator.h
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Lock actuator drivers: hobby servo, stepper deadbolt and solenoid strike.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "sdkconfig.h"
+#include "driver/gpio.h"
+
+#include "HD44780.h"
+#include "lock_config.h"
+#include "lock_actuation.h"
+
+#define ACTUATOR_SERVO_GPIO 33
+
+#if CONFIG_HD44780_BUS_PCF8574
+#define ACTUATOR_LCD_I2C_MASK (BIT64(CONFIG_HD44780_I2C_SDA) | BIT64(CONFIG_HD44780_I2C_SCL))
+#else
+#define ACTUATOR_LCD_I2C_MASK 0ULL
+#endif
+
+/* GPIOs the rest of the board is wired to: the parallel LCD and its LED (HD44780.h), the PCF8574 bus if that is
+ * selected, the servo and the default button. */
+#define ACTUATOR_RESERVED_GPIO_MASK (DATA_MASK | RS_MASK | RW_MASK | E_MASK | BIT64(LED_PIN) | ACTUATOR_LCD_I2C_MASK | \
+                                     BIT64(ACTUATOR_SERVO_GPIO) | BIT64(DEFAULT_BUTTON_PIN))
+
+/* True for a GPIO a backend can drive. GPIOs 6 to 11 are outputs on paper, but they are wired to the SPI flash. */
+#define ACTUATOR_GPIO_USABLE(gpio) (GPIO_IS_VALID_OUTPUT_GPIO(gpio) && ((gpio) < 6 || (gpio) > 11))
+/* True for a GPIO nothing else on the board uses. */
+#define ACTUATOR_GPIO_FREE(gpio) ((ACTUATOR_RESERVED_GPIO_MASK & BIT64(gpio)) == 0)
+
+/**
+ * @brief   What lock_actuation.c drives the bolt through. Backends are only called from the lock task, apart from
+ *          init, which runs once from app_main before the lock task starts.
+ */
+typedef struct{
+    const char* name;
+
+    // Takes over the hardware at boot and puts the bolt in state. warm is true after a reset that kept the
+    // warm boot snapshot; a backend that can tell the bolt is already there should not move it.
+    void (*init)(lock_state_t state, bool warm);
+    // Moves the bolt and returns once the backend considers the move done. The time spent in here is what
+    // lock_actuation.c reports as the actuation time, so a backend that can wait for the motion to finish should.
+    // Records the new state in the warm boot snapshot.
+    void (*set)(lock_state_t state);
+} lock_actuator_t;
+
+extern const lock_actuator_t lock_actuator_servo;
+extern const lock_actuator_t lock_actuator_stepper;    // only built with CONFIG_SMART_LOCK_ACTUATOR_STEPPER
+extern const lock_actuator_t lock_actuator_solenoid;   // only built with CONFIG_SMART_LOCK_ACTUATOR_SOLENOID
@@ -0,0 +1,80 @@
+/**
+ * @file actuator_servo.c
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Lock actuator backend for a hobby servo driven by MCPWM.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ *
+ *  A hobby servo on MCPWM at 50 Hz. Moving it is one duty update; the servo then travels on its own and nothing
+ *  reports when it gets there, so the actuation time for this backend is only the cost of the update.
+ */
+
+#include "driver/mcpwm.h"
+
+#include "lock_config.h"
+#include "warm_boot.h"
+#include "actuator.h"
+
+static float duty_for(lock_state_t state){
+    float duty;
+
+    if(state == OPEN){
+        LOCK_CONFIG_GET(duty, duty_cycle_open);
+    }else{
+        LOCK_CONFIG_GET(duty, duty_cycle_closed);
+    }
+
+    return duty;
+}
+
+/**
+ * @brief   Starts the servo PWM. After a warm boot the PWM starts at the duty the servo was left at, so the bolt
+ *          does not move.
+ *
+ * @param state Where the bolt should be.
+ * @param warm true to start at the duty in the warm boot snapshot.
+ */
+static void servo_init(lock_state_t state, bool warm){
+    const warm_boot_snapshot_t* restored = warm_boot_restored();
+    float duty = warm && restored != NULL ? restored->servo_duty : duty_for(state);
+
+    mcpwm_gpio_init(MCPWM_UNIT_0, MCPWM0A, ACTUATOR_SERVO_GPIO);
+    mcpwm_config_t config;
+    config.frequency = 50;
+    config.cmpr_a = duty;
+    config.cmpr_b = duty;
+    config.duty_mode = MCPWM_DUTY_MODE_0;
+    config.counter_mode = MCPWM_UP_COUNTER;
+
+    mcpwm_init(MCPWM_UNIT_0, MCPWM_TIMER_0, &config);
+
+    warm_boot_save_lock(state, duty);
+}
+
+static void servo_set(lock_state_t state){
+    float duty = duty_for(state);
+
+    mcpwm_set_duty(MCPWM_UNIT_0, MCPWM_TIMER_0, MCPWM_GEN_A, duty);
+    warm_boot_save_lock(state, duty);
+}
+
+const lock_actuator_t lock_actuator_servo = {
+    .name = "servo",
+    .init = servo_init,
+    .set = servo_set,
+};
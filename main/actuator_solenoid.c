@@ -0,0 +1,111 @@
+/**
+ * @file actuator_solenoid.c
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Lock actuator backend for a solenoid strike, with hit and hold PWM from LEDC.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ *
+ *  A solenoid strike (or magnetic bolt) switched by a logic level MOSFET on an LEDC PWM output. Pulling the
+ *  plunger in takes full current, but holding it in takes a fraction of that, so the coil gets 100% duty for the
+ *  hit time and then drops to the hold duty for as long as it stays energized. That keeps the coil cool and cuts
+ *  the supply current for strikes that are held open, or fail safe locks that are held shut.
+ *
+ *  set() returns at the end of the hit, once the plunger has pulled in, so the reported actuation time is the
+ *  hit time. Releasing is immediate.
+ */
+
+#include "sdkconfig.h"
+#include "driver/ledc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "warm_boot.h"
+#include "actuator.h"
+
+#define SOLENOID_LEDC_MODE LEDC_HIGH_SPEED_MODE
+#define SOLENOID_LEDC_TIMER LEDC_TIMER_0
+#define SOLENOID_LEDC_CHANNEL LEDC_CHANNEL_0
+#define SOLENOID_DUTY_BITS LEDC_TIMER_10_BIT
+#define SOLENOID_DUTY_MAX ((1 << 10) - 1)
+
+_Static_assert(ACTUATOR_GPIO_USABLE(CONFIG_SMART_LOCK_SOLENOID_GPIO), "solenoid GPIO cannot drive an output");
+_Static_assert(ACTUATOR_GPIO_FREE(CONFIG_SMART_LOCK_SOLENOID_GPIO), "solenoid GPIO is already in use");
+
+#if CONFIG_SMART_LOCK_SOLENOID_ENERGIZE_TO_OPEN
+#define SOLENOID_ENERGIZED OPEN
+#else
+#define SOLENOID_ENERGIZED CLOSED
+#endif
+
+static void set_duty(uint32_t duty){
+    ledc_set_duty(SOLENOID_LEDC_MODE, SOLENOID_LEDC_CHANNEL, duty);
+    ledc_update_duty(SOLENOID_LEDC_MODE, SOLENOID_LEDC_CHANNEL);
+}
+
+/**
+ * @brief Energizes the coil with hit and hold, or releases it.
+ *
+ * @param state Where to move the bolt.
+ */
+static void solenoid_set(lock_state_t state){
+    if(state == SOLENOID_ENERGIZED){
+        set_duty(SOLENOID_DUTY_MAX);
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_SMART_LOCK_SOLENOID_HIT_MS));
+        set_duty(SOLENOID_DUTY_MAX * CONFIG_SMART_LOCK_SOLENOID_HOLD_PERCENT / 100);
+    }else{
+        set_duty(0);
+    }
+
+    warm_boot_save_lock(state, 0);
+}
+
+/**
+ * @brief   Sets up the PWM output and applies state. The coil loses power over any reset, so it is hit again even
+ *          after a warm boot.
+ *
+ * @param state Where the bolt should be.
+ * @param warm unused
+ */
+static void solenoid_init(lock_state_t state, bool warm){
+    ledc_timer_config_t timer = {
+        .speed_mode = SOLENOID_LEDC_MODE,
+        .duty_resolution = SOLENOID_DUTY_BITS,
+        .timer_num = SOLENOID_LEDC_TIMER,
+        .freq_hz = CONFIG_SMART_LOCK_SOLENOID_PWM_HZ,
+        .clk_cfg = LEDC_AUTO_CLK,
+    };
+    ledc_timer_config(&timer);
+
+    ledc_channel_config_t channel = {
+        .gpio_num = CONFIG_SMART_LOCK_SOLENOID_GPIO,
+        .speed_mode = SOLENOID_LEDC_MODE,
+        .channel = SOLENOID_LEDC_CHANNEL,
+        .timer_sel = SOLENOID_LEDC_TIMER,
+        .duty = 0,
+        .hpoint = 0,
+    };
+    ledc_channel_config(&channel);
+
+    solenoid_set(state);
+}
+
+const lock_actuator_t lock_actuator_solenoid = {
+    .name = "solenoid",
+    .init = solenoid_init,
+    .set = solenoid_set,
+};
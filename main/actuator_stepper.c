@@ -0,0 +1,174 @@
+/**
+ * @file actuator_stepper.c
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Lock actuator backend for a stepper deadbolt, with the step pulses generated by RMT.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ *
+ *  A stepper deadbolt on a STEP/DIR driver (A4988, DRV8825, TMC2208 and the like). The step pulse train for a
+ *  full throw is built once at init as RMT items, accelerating from the start rate to the top rate and back down
+ *  again, and the RMT peripheral plays it out with 1 us resolution. The CPU only refills the RMT channel memory
+ *  from the driver's interrupt as it drains; it never times a pulse itself. Both directions use the same train,
+ *  with DIR chosen before it starts.
+ *
+ *  set() returns when the last step has gone out, so the reported actuation time is the real travel time. The
+ *  driver is disabled between moves; the bolt holds by friction.
+ *
+ *  There is no limit switch. After a cold boot the bolt is driven a full throw towards closed, stalling against
+ *  the end stop if it was already there, which puts it in a known position.
+ */
+
+#include <stdlib.h>
+
+#include "sdkconfig.h"
+#include "driver/rmt.h"
+#include "driver/gpio.h"
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "rom/ets_sys.h"
+
+#include "warm_boot.h"
+#include "actuator.h"
+
+#define STEPPER_RMT_CHANNEL RMT_CHANNEL_0
+#define STEPPER_RMT_CLK_DIV 80             // 80 MHz APB clock down to 1 MHz, one tick per microsecond
+#define STEPPER_PULSE_US 5                 // STEP high time, above the 1.9 us the slowest common drivers need
+#define STEPPER_DIR_SETUP_US 2             // DIR must be stable for at least 650 ns before the first STEP edge
+
+_Static_assert(ACTUATOR_GPIO_USABLE(CONFIG_SMART_LOCK_STEPPER_STEP_GPIO), "STEP GPIO cannot drive an output");
+_Static_assert(ACTUATOR_GPIO_USABLE(CONFIG_SMART_LOCK_STEPPER_DIR_GPIO), "DIR GPIO cannot drive an output");
+_Static_assert(CONFIG_SMART_LOCK_STEPPER_ENABLE_GPIO < 0 || ACTUATOR_GPIO_USABLE(CONFIG_SMART_LOCK_STEPPER_ENABLE_GPIO),
+               "ENABLE GPIO cannot drive an output");
+_Static_assert(ACTUATOR_GPIO_FREE(CONFIG_SMART_LOCK_STEPPER_STEP_GPIO), "STEP GPIO is already in use");
+_Static_assert(ACTUATOR_GPIO_FREE(CONFIG_SMART_LOCK_STEPPER_DIR_GPIO), "DIR GPIO is already in use");
+_Static_assert(CONFIG_SMART_LOCK_STEPPER_ENABLE_GPIO < 0 || ACTUATOR_GPIO_FREE(CONFIG_SMART_LOCK_STEPPER_ENABLE_GPIO),
+               "ENABLE GPIO is already in use");
+
+static const char *TAG = "STEPPER";
+
+static rmt_item32_t* s_items = NULL;
+static uint32_t s_travel_us = 0;
+static lock_state_t s_position = CLOSED;
+
+/**
+ * @brief Step period for step i of a throw, ramping linearly in rate over the first and last RAMP_STEPS steps.
+ *
+ * @param i The step.
+ * @return uint32_t The period in microseconds.
+ */
+static uint32_t step_period_us(int i){
+    int from_end = CONFIG_SMART_LOCK_STEPPER_STEPS - 1 - i;
+    int distance = i < from_end ? i : from_end;
+    uint32_t rate = CONFIG_SMART_LOCK_STEPPER_MAX_RATE_HZ;
+
+    if(distance < CONFIG_SMART_LOCK_STEPPER_RAMP_STEPS){
+        rate = CONFIG_SMART_LOCK_STEPPER_START_RATE_HZ +
+               (CONFIG_SMART_LOCK_STEPPER_MAX_RATE_HZ - CONFIG_SMART_LOCK_STEPPER_START_RATE_HZ) * distance /
+               CONFIG_SMART_LOCK_STEPPER_RAMP_STEPS;
+    }
+
+    return 1000000 / rate;
+}
+
+static void build_throw(){
+    s_items = malloc(sizeof(rmt_item32_t) * CONFIG_SMART_LOCK_STEPPER_STEPS);
+    s_travel_us = 0;
+
+    for(int i = 0; i < CONFIG_SMART_LOCK_STEPPER_STEPS; i++){
+        uint32_t period = step_period_us(i);
+
+        s_items[i].level0 = 1;
+        s_items[i].duration0 = STEPPER_PULSE_US;
+        s_items[i].level1 = 0;
+        s_items[i].duration1 = period - STEPPER_PULSE_US;
+        s_travel_us += period;
+    }
+}
+
+static void set_enabled(bool enabled){
+#if CONFIG_SMART_LOCK_STEPPER_ENABLE_GPIO >= 0
+    gpio_set_level(CONFIG_SMART_LOCK_STEPPER_ENABLE_GPIO, enabled ? 0 : 1); // active low on all common drivers
+#endif
+}
+
+/**
+ * @brief Plays one full throw towards state and waits for the last step to go out.
+ *
+ * @param state Where to move the bolt.
+ */
+static void stepper_set(lock_state_t state){
+    if(state == s_position){
+        return;
+    }
+
+    gpio_set_level(CONFIG_SMART_LOCK_STEPPER_DIR_GPIO, state == OPEN ? 1 : 0);
+    set_enabled(true);
+    ets_delay_us(STEPPER_DIR_SETUP_US);
+
+    // The throw is a few hundred milliseconds; give the wait some slack before calling it stuck.
+    rmt_write_items(STEPPER_RMT_CHANNEL, s_items, CONFIG_SMART_LOCK_STEPPER_STEPS, false);
+    if(rmt_wait_tx_done(STEPPER_RMT_CHANNEL, pdMS_TO_TICKS(s_travel_us / 1000 + 100)) != ESP_OK){
+        ESP_LOGE(TAG, "step train did not finish");
+    }
+
+    set_enabled(false);
+
+    s_position = state;
+    warm_boot_save_lock(state, 0);
+}
+
+/**
+ * @brief   Sets up the RMT channel and the driver pins. After a warm boot the bolt is where the snapshot says and is
+ *          not moved; after a cold boot it is driven to state against the end stop.
+ *
+ * @param state Where the bolt should be.
+ * @param warm true if the warm boot snapshot says where the bolt is.
+ */
+static void stepper_init(lock_state_t state, bool warm){
+    rmt_config_t config = RMT_DEFAULT_CONFIG_TX(CONFIG_SMART_LOCK_STEPPER_STEP_GPIO, STEPPER_RMT_CHANNEL);
+    config.clk_div = STEPPER_RMT_CLK_DIV;
+    config.mem_block_num = 2; // 128 steps per refill instead of 64
+
+    rmt_config(&config);
+    rmt_driver_install(STEPPER_RMT_CHANNEL, 0, 0);
+
+    gpio_reset_pin(CONFIG_SMART_LOCK_STEPPER_DIR_GPIO);
+    gpio_set_direction(CONFIG_SMART_LOCK_STEPPER_DIR_GPIO, GPIO_MODE_OUTPUT);
+#if CONFIG_SMART_LOCK_STEPPER_ENABLE_GPIO >= 0
+    gpio_reset_pin(CONFIG_SMART_LOCK_STEPPER_ENABLE_GPIO);
+    gpio_set_direction(CONFIG_SMART_LOCK_STEPPER_ENABLE_GPIO, GPIO_MODE_OUTPUT);
+#endif
+    set_enabled(false);
+
+    build_throw();
+    ESP_LOGI(TAG, "%d steps per throw, %u us", CONFIG_SMART_LOCK_STEPPER_STEPS, s_travel_us);
+
+    if(warm){
+        s_position = state;
+        warm_boot_save_lock(state, 0);
+    }else{
+        s_position = state == OPEN ? CLOSED : OPEN;
+        stepper_set(state);
+    }
+}
+
+const lock_actuator_t lock_actuator_stepper = {
+    .name = "stepper",
+    .init = stepper_init,
+    .set = stepper_set,
+};
@@ -0,0 +1,630 @@
+/**
+ * @file audit_log.c
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Append-only audit log of lock events in its own flash partition, with time range queries.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ *
+ *  The "audit" partition is a ring of 4 KB sectors holding fixed size records in append order. Records are
+ *  collected in RAM and written out by the audit task, one sector's worth at a time or once the oldest pending
+ *  record is CONFIG_SMART_LOCK_AUDIT_FLUSH_S old, whichever comes first. Flash is only erased a sector at a time
+ *  as the head reaches it, so every sector is erased once per trip round the ring and wear is spread evenly.
+ *  Once the ring is full the oldest sector is dropped to make room.
+ *
+ *  Each record carries a sequence number. At boot the newest sector is the one whose first record has the
+ *  highest sequence, and the head is the first erased record in it.
+ *
+ *  The index is sparse: one entry per sector with the sequence of its first record and the earliest and latest
+ *  time in it, 12 bytes a sector. A time range query only reads the sectors whose span overlaps the range. Spans
+ *  rather than a binary search, because times before the clock is set are seconds since boot and so do not
+ *  increase across reboots.
+ *
+ *  Flash erases and writes stall both cores' caches, the lock task's included, so they only happen on the audit
+ *  task and in batches, to keep the stalls few.
+ *
+ *  Requests that are turned away (malformed, unauthorized, replayed, rate limited or outside their schedule) cost
+ *  a sender nothing, so a flood of them could otherwise push real history out of the ring. Each source may record
+ *  AUDIT_REJECT_BURST of them, refilled at one a minute; the rest are only counted, and the next one recorded
+ *  from that source carries AUDIT_FLAG_AFTER_DROPS.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_partition.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "cJSON.h"
+
+#include "mqtt.h"
+#include "fast_log.h"
+#include "timer_service.h"
+#include "lock_actuation.h"
+#include "command.h"
+#include "audit_log.h"
+
+#define AUDIT_PARTITION_LABEL "audit"
+#define AUDIT_PARTITION_SUBTYPE 0x40
+#define AUDIT_SECTOR_SIZE 4096
+#define AUDIT_RECORDS_PER_SECTOR (AUDIT_SECTOR_SIZE / sizeof(audit_record_t))
+#define AUDIT_MAX_SECTORS 64
+#define AUDIT_BATCH_RECORDS AUDIT_RECORDS_PER_SECTOR
+#define AUDIT_READ_RECORDS 64               // records per flash read while scanning
+#define AUDIT_RECORDS_PER_MESSAGE 32
+#define AUDIT_DEFAULT_MAX 256
+#define AUDIT_QUERY_LIMIT 4096
+#define AUDIT_ERASED 0xffffffff
+#define AUDIT_CLOCK_SET_AFTER 1600000000    // 2020-09-13; anything earlier is time since boot
+#define AUDIT_REJECT_BURST 8                // rejections a source may record at once
+#define AUDIT_REJECT_REFILL_US 60000000LL   // and one more per minute after that
+
+typedef enum{
+    AUDIT_MSG_FLUSH,
+    AUDIT_MSG_QUERY
+} audit_msg_type_t;
+
+typedef struct{
+    audit_msg_type_t type;
+    uint32_t from;
+    uint32_t to;
+    uint32_t max;
+    char id[24];
+} audit_msg_t;
+
+/* How many more rejections a source may record. */
+typedef struct{
+    int tokens;
+    int64_t refilled_us;
+    bool dropped;
+} audit_reject_allowance_t;
+
+/* Sparse index entry for one sector. count == 0 means the sector holds nothing. */
+typedef struct{
+    uint32_t first_sequence;
+    uint32_t min_time;
+    uint32_t max_time;
+    uint16_t count;
+} audit_index_t;
+
+typedef bool (*audit_visit_t)(const audit_record_t* record, void* arg);
+
+static const char *TAG = "AUDIT_LOG";
+
+static const esp_partition_t* s_partition = NULL;
+static int s_sector_count = 0;
+static QueueHandle_t s_queue = NULL;
+static soft_timer_t s_flush_timer;
+
+/* Flash, index and head. Taken by the audit task and by audit_log_count(). */
+static SemaphoreHandle_t s_flash_mutex = NULL;
+static audit_index_t s_index[AUDIT_MAX_SECTORS];
+static uint32_t s_head = 0;                 // byte offset of the next record
+static uint32_t s_next_sequence = 0;
+
+/* Records not yet in flash. */
+static portMUX_TYPE s_pending_lock = portMUX_INITIALIZER_UNLOCKED;
+static audit_record_t s_pending[AUDIT_BATCH_RECORDS];
+static int s_pending_count = 0;
+static audit_reject_allowance_t s_allowances[LOCK_SOURCE_COUNT];   // also under s_pending_lock
+
+static audit_record_t s_batch[AUDIT_BATCH_RECORDS];   // only used by the audit task
+static audit_record_t s_read_buffer[AUDIT_READ_RECORDS];
+
+static portMUX_TYPE s_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static audit_stats_t s_stats;
+
+static void index_add(audit_index_t* entry, const audit_record_t* record){
+    if(entry->count == 0){
+        entry->first_sequence = record->sequence;
+        entry->min_time = entry->max_time = record->time;
+    }
+    if(record->time < entry->min_time) entry->min_time = record->time;
+    if(record->time > entry->max_time) entry->max_time = record->time;
+    entry->count++;
+}
+
+/**
+ * @brief   Reads one sector's records into the index and returns how many there are. Records are written in order
+ *          from the start of the sector, so the first erased one ends it.
+ *
+ * @param sector The sector.
+ * @return int Number of records in it.
+ */
+static int index_sector(int sector){
+    audit_index_t* entry = &s_index[sector];
+    int count = 0;
+
+    memset(entry, 0, sizeof(*entry));
+
+    for(int offset = 0; offset < AUDIT_RECORDS_PER_SECTOR; offset += AUDIT_READ_RECORDS){
+        esp_partition_read(s_partition, sector * AUDIT_SECTOR_SIZE + offset * sizeof(audit_record_t),
+                           s_read_buffer, sizeof(s_read_buffer));
+
+        for(int i = 0; i < AUDIT_READ_RECORDS; i++){
+            if(s_read_buffer[i].sequence == AUDIT_ERASED){
+                return count;
+            }
+            index_add(entry, &s_read_buffer[i]);
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/**
+ * @brief Builds the index and finds the head, in one pass over the partition.
+ *
+ */
+static void recover(){
+    int newest = -1;
+    int newest_count = 0;
+
+    for(int sector = 0; sector < s_sector_count; sector++){
+        int count = index_sector(sector);
+
+        if(count > 0 && (newest < 0 || s_index[sector].first_sequence > s_index[newest].first_sequence)){
+            newest = sector;
+            newest_count = count;
+        }
+    }
+
+    if(newest < 0){
+        s_head = 0;
+        s_next_sequence = 0;
+    }else{
+        s_head = (newest * AUDIT_SECTOR_SIZE + newest_count * sizeof(audit_record_t)) % (s_sector_count * AUDIT_SECTOR_SIZE);
+        s_next_sequence = s_index[newest].first_sequence + newest_count;
+    }
+
+    ESP_LOGI(TAG, "%d sectors, head at 0x%x, next record %u", s_sector_count, s_head, s_next_sequence);
+}
+
+/**
+ * @brief Writes pending records to flash, erasing each sector as the head enters it.
+ *
+ */
+static void flush(){
+    int count;
+
+    portENTER_CRITICAL(&s_pending_lock);
+    count = s_pending_count;
+    memcpy(s_batch, s_pending, count * sizeof(audit_record_t));
+    s_pending_count = 0;
+    portEXIT_CRITICAL(&s_pending_lock);
+
+    if(count == 0){
+        return;
+    }
+
+    xSemaphoreTake(s_flash_mutex, portMAX_DELAY);
+    int64_t start = esp_timer_get_time();
+
+    for(int i = 0; i < count; i++){
+        s_batch[i].sequence = s_next_sequence++;
+    }
+
+    for(int written = 0; written < count;){
+        int sector = s_head / AUDIT_SECTOR_SIZE;
+        int room = (AUDIT_SECTOR_SIZE - s_head % AUDIT_SECTOR_SIZE) / sizeof(audit_record_t);
+        int chunk = count - written < room ? count - written : room;
+
+        if(s_head % AUDIT_SECTOR_SIZE == 0){
+            // The ring has come round: this drops the oldest sector.
+            esp_partition_erase_range(s_partition, s_head, AUDIT_SECTOR_SIZE);
+            memset(&s_index[sector], 0, sizeof(s_index[sector]));
+        }
+
+        if(esp_partition_write(s_partition, s_head, &s_batch[written], chunk * sizeof(audit_record_t)) != ESP_OK){
+            ESP_LOGE(TAG, "write at 0x%x failed", s_head);
+        }
+        for(int i = 0; i < chunk; i++){
+            index_add(&s_index[sector], &s_batch[written + i]);
+        }
+
+        written += chunk;
+        s_head = (s_head + chunk * sizeof(audit_record_t)) % (s_sector_count * AUDIT_SECTOR_SIZE);
+    }
+
+    uint32_t elapsed = esp_timer_get_time() - start;
+    xSemaphoreGive(s_flash_mutex);
+
+    portENTER_CRITICAL(&s_stats_lock);
+    s_stats.records_written += count;
+    s_stats.flushes++;
+    s_stats.write_us += elapsed;
+    portEXIT_CRITICAL(&s_stats_lock);
+
+    FLOGD(TAG, "flushed %d records in %u us", count, elapsed);
+}
+
+/**
+ * @brief   Visits every record in flash with a time in [from, to], oldest first, reading only the sectors whose
+ *          span overlaps the range. Must be called with s_flash_mutex held.
+ *
+ * @param from Earliest time.
+ * @param to Latest time.
+ * @param visit Called for each match; returning false stops the scan.
+ * @param arg Passed to visit.
+ * @param scanned Receives the number of records read.
+ * @param sectors Receives the number of sectors read.
+ */
+static void scan(uint32_t from, uint32_t to, audit_visit_t visit, void* arg, uint32_t* scanned, uint32_t* sectors){
+    uint32_t size = s_sector_count * AUDIT_SECTOR_SIZE;
+    // The newest record is the one before the head. When the head sits at the start of a sector, that sector has
+    // not been erased yet and holds the oldest records, so the walk starts there.
+    int newest_sector = ((s_head + size - sizeof(audit_record_t)) % size) / AUDIT_SECTOR_SIZE;
+
+    *scanned = 0;
+    *sectors = 0;
+
+    // Oldest first: the sector after the newest record's, round to that one.
+    for(int n = 1; n <= s_sector_count; n++){
+        int sector = (newest_sector + n) % s_sector_count;
+        const audit_index_t* entry = &s_index[sector];
+
+        if(entry->count == 0 || entry->max_time < from || entry->min_time > to){
+            continue;
+        }
+
+        (*sectors)++;
+        for(int offset = 0; offset < entry->count; offset += AUDIT_READ_RECORDS){
+            int chunk = entry->count - offset < AUDIT_READ_RECORDS ? entry->count - offset : AUDIT_READ_RECORDS;
+
+            esp_partition_read(s_partition, sector * AUDIT_SECTOR_SIZE + offset * sizeof(audit_record_t),
+                               s_read_buffer, chunk * sizeof(audit_record_t));
+            *scanned += chunk;
+
+            for(int i = 0; i < chunk; i++){
+                const audit_record_t* record = &s_read_buffer[i];
+                if(record->time >= from && record->time <= to && !visit(record, arg)){
+                    return;
+                }
+            }
+        }
+    }
+}
+
+/* State of a query being published. */
+typedef struct{
+    const audit_msg_t* query;
+    char payload[1536];
+    int length;
+    int in_message;
+    uint32_t matched;
+} audit_reply_t;
+
+static void reply_begin(audit_reply_t* reply){
+    reply->length = snprintf(reply->payload, sizeof(reply->payload), "{\"id\":\"%s\",\"records\":[",
+                             reply->query->id);
+    reply->in_message = 0;
+}
+
+static void reply_send(audit_reply_t* reply, const char* tail){
+    snprintf(reply->payload + reply->length, sizeof(reply->payload) - reply->length, "],%s}", tail);
+    mqtt_publish(AUDIT_RESULT_TOPIC, reply->payload, 0, 1, 0);
+}
+
+static bool reply_record(const audit_record_t* record, void* arg){
+    audit_reply_t* reply = arg;
+
+    if(reply->matched >= reply->query->max){
+        return false;
+    }
+
+    reply->length += snprintf(reply->payload + reply->length, sizeof(reply->payload) - reply->length,
+                              "%s[%u,%u,%u,%u,%u,%u,%u]", reply->in_message > 0 ? "," : "",
+                              record->sequence, record->time, record->event, record->source, record->result,
+                              record->actor, record->flags);
+    reply->in_message++;
+    reply->matched++;
+
+    if(reply->in_message == AUDIT_RECORDS_PER_MESSAGE){
+        reply_send(reply, "\"done\":false");
+        reply_begin(reply);
+    }
+
+    return true;
+}
+
+/**
+ * @brief Answers a query: matching records in batches, then a summary with the scan cost.
+ *
+ * @param query The query.
+ */
+static void run_query(const audit_msg_t* query){
+    static audit_reply_t reply;
+    uint32_t scanned, sectors;
+    char tail[128];
+
+    // Pending records go out first, so the whole range is in flash.
+    flush();
+
+    reply.query = query;
+    reply.matched = 0;
+    reply_begin(&reply);
+
+    xSemaphoreTake(s_flash_mutex, portMAX_DELAY);
+    int64_t start = esp_timer_get_time();
+    scan(query->from, query->to, reply_record, &reply, &scanned, &sectors);
+    uint32_t elapsed = esp_timer_get_time() - start;
+    xSemaphoreGive(s_flash_mutex);
+
+    snprintf(tail, sizeof(tail), "\"done\":true,\"matched\":%u,\"scanned\":%u,\"sectors\":%u,\"scan_us\":%u",
+             reply.matched, scanned, sectors, elapsed);
+    reply_send(&reply, tail);
+
+    portENTER_CRITICAL(&s_stats_lock);
+    s_stats.queries++;
+    s_stats.sectors_read += sectors;
+    s_stats.records_scanned += scanned;
+    s_stats.query_us += elapsed;
+    portEXIT_CRITICAL(&s_stats_lock);
+}
+
+static void flush_timer_callback(void* arg){
+    audit_msg_t msg = {
+        .type = AUDIT_MSG_FLUSH,
+    };
+
+    xQueueSend(s_queue, &msg, 0);
+}
+
+static void audit_task(void* arg){
+    audit_msg_t msg;
+
+    xSemaphoreTake(s_flash_mutex, portMAX_DELAY);
+    recover();
+    xSemaphoreGive(s_flash_mutex);
+
+    for(;;){
+        if(xQueueReceive(s_queue, &msg, portMAX_DELAY) != pdTRUE){
+            continue;
+        }
+
+        if(msg.type == AUDIT_MSG_FLUSH){
+            flush();
+        }else if(msg.type == AUDIT_MSG_QUERY){
+            run_query(&msg);
+        }
+    }
+}
+
+/**
+ * @brief   Finds the audit partition, records the boot and starts the audit task, which recovers the head and
+ *          the index from flash.
+ *
+ */
+void audit_log_start(){
+    s_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, AUDIT_PARTITION_SUBTYPE, AUDIT_PARTITION_LABEL);
+    if(s_partition == NULL){
+        ESP_LOGE(TAG, "no audit partition");
+        return;
+    }
+
+    s_sector_count = s_partition->size / AUDIT_SECTOR_SIZE;
+    if(s_sector_count > AUDIT_MAX_SECTORS){
+        s_sector_count = AUDIT_MAX_SECTORS;
+    }
+
+    s_flash_mutex = xSemaphoreCreateMutex();
+    s_queue = xQueueCreate(4, sizeof(audit_msg_t));
+    soft_timer_init(&s_flush_timer, flush_timer_callback, NULL);
+
+    audit_log_append(AUDIT_EVENT_BOOT, AUDIT_SOURCE_SYSTEM, esp_reset_reason(), 0);
+
+    xTaskCreatePinnedToCore(audit_task, "audit", 4096, NULL, CONFIG_SMART_LOCK_AUDIT_TASK_PRIORITY,
+                            NULL, CONFIG_SMART_LOCK_NETWORK_CORE);
+}
+
+/**
+ * @brief Queues a record for the next batch.
+ *
+ * @param event What happened.
+ * @param source Who asked.
+ * @param result How it ended.
+ * @param actor User id from the command, 0 if none.
+ * @param flags AUDIT_FLAG_ values beyond AUDIT_FLAG_CLOCK_SET.
+ */
+static void append(audit_event_t event, uint8_t source, uint8_t result, uint32_t actor, uint8_t flags){
+    uint32_t now = time(NULL);
+    audit_record_t record = {
+        .time = now,
+        .actor = actor,
+        .event = event,
+        .source = source,
+        .result = result,
+        .flags = flags | (now >= AUDIT_CLOCK_SET_AFTER ? AUDIT_FLAG_CLOCK_SET : 0),
+    };
+    int count;
+
+    portENTER_CRITICAL(&s_pending_lock);
+    count = s_pending_count;
+    if(count < AUDIT_BATCH_RECORDS){
+        s_pending[s_pending_count++] = record;
+    }
+    portEXIT_CRITICAL(&s_pending_lock);
+
+    if(count == AUDIT_BATCH_RECORDS){
+        portENTER_CRITICAL(&s_stats_lock);
+        s_stats.dropped++;
+        portEXIT_CRITICAL(&s_stats_lock);
+        return;
+    }
+    if(s_queue == NULL){
+        return;
+    }
+
+    if(count + 1 == AUDIT_BATCH_RECORDS){
+        flush_timer_callback(NULL);
+    }else if(count == 0){
+        soft_timer_start_once(&s_flush_timer, CONFIG_SMART_LOCK_AUDIT_FLUSH_S * 1000000ULL);
+    }
+}
+
+/**
+ * @brief   Records a lock event. Does not block or touch flash; the record is written with the next batch. Safe
+ *          from any task.
+ *
+ * @param event What happened.
+ * @param source Who asked.
+ * @param result How it ended, see audit_event_t.
+ * @param actor User id from the command, 0 if none.
+ */
+void audit_log_append(audit_event_t event, uint8_t source, uint8_t result, uint32_t actor){
+    append(event, source, result, actor, 0);
+}
+
+/**
+ * @brief   Records a request that was turned away, within its source's allowance (see the top of this file).
+ *          Safe from any task.
+ *
+ * @param event What was asked for.
+ * @param source Who asked.
+ * @param result Why it was turned away.
+ * @param actor User id from the command, 0 if none.
+ */
+void audit_log_reject(audit_event_t event, uint8_t source, uint8_t result, uint32_t actor){
+    int64_t now_us = esp_timer_get_time();
+    uint8_t flags = 0;
+    bool record = true;
+
+    if(source < LOCK_SOURCE_COUNT){
+        audit_reject_allowance_t* allowance = &s_allowances[source];
+
+        portENTER_CRITICAL(&s_pending_lock);
+        if(allowance->refilled_us == 0){
+            allowance->tokens = AUDIT_REJECT_BURST;
+            allowance->refilled_us = now_us;
+        }
+        int refills = (now_us - allowance->refilled_us) / AUDIT_REJECT_REFILL_US;
+        if(refills > 0){
+            allowance->tokens = allowance->tokens + refills < AUDIT_REJECT_BURST ? allowance->tokens + refills
+                                                                                  : AUDIT_REJECT_BURST;
+            allowance->refilled_us += refills * AUDIT_REJECT_REFILL_US;
+        }
+        if(allowance->tokens > 0){
+            allowance->tokens--;
+            flags = allowance->dropped ? AUDIT_FLAG_AFTER_DROPS : 0;
+            allowance->dropped = false;
+        }else{
+            allowance->dropped = true;
+            record = false;
+        }
+        portEXIT_CRITICAL(&s_pending_lock);
+    }
+
+    if(!record){
+        portENTER_CRITICAL(&s_stats_lock);
+        s_stats.rejects_dropped++;
+        portEXIT_CRITICAL(&s_stats_lock);
+        return;
+    }
+
+    append(event, source, result, actor, flags);
+}
+
+/**
+ * @brief Handles a query on AUDIT_QUERY_TOPIC. The answer is published by the audit task.
+ *
+ * @param data The JSON query.
+ * @param len Length of the query.
+ */
+void audit_log_command(const char* data, int len){
+    audit_msg_t msg = {
+        .type = AUDIT_MSG_QUERY,
+        .from = 0,
+        .to = UINT32_MAX,
+        .max = AUDIT_DEFAULT_MAX,
+    };
+    cJSON* root = cJSON_ParseWithLength(data, len);
+
+    if(s_queue == NULL || root == NULL || !cJSON_IsObject(root)){
+        cJSON_Delete(root);
+        ESP_LOGW(TAG, "bad query");
+        return;
+    }
+
+    cJSON* from = cJSON_GetObjectItem(root, "from");
+    cJSON* to = cJSON_GetObjectItem(root, "to");
+    cJSON* max = cJSON_GetObjectItem(root, "max");
+    cJSON* id = cJSON_GetObjectItem(root, "id");
+
+    if(cJSON_IsNumber(from) && from->valuedouble >= 0) msg.from = from->valuedouble;
+    if(cJSON_IsNumber(to) && to->valuedouble >= 0 && to->valuedouble < UINT32_MAX) msg.to = to->valuedouble;
+    if(cJSON_IsNumber(max) && max->valuedouble >= 1){
+        msg.max = max->valuedouble < AUDIT_QUERY_LIMIT ? max->valuedouble : AUDIT_QUERY_LIMIT;
+    }
+    // The id is copied into the results as it is, so one that would need escaping is left out.
+    if(cJSON_IsString(id) && command_id_is_plain(id->valuestring)){
+        strlcpy(msg.id, id->valuestring, sizeof(msg.id));
+    }
+
+    cJSON_Delete(root);
+
+    if(xQueueSend(s_queue, &msg, 0) != pdTRUE){
+        ESP_LOGW(TAG, "query dropped, audit task busy");
+    }
+}
+
+static bool count_record(const audit_record_t* record, void* arg){
+    (*(uint32_t*)arg)++;
+    return true;
+}
+
+/**
+ * @brief   Counts the records in flash in a time range, the same way a query finds them, for measuring query
+ *          throughput. Blocks while the audit task is writing.
+ *
+ * @param from Earliest time.
+ * @param to Latest time.
+ * @param matched Receives the number of records in the range.
+ * @param scanned Receives the number of records read.
+ * @param sectors Receives the number of sectors read.
+ * @return true if the log is running.
+ */
+bool audit_log_count(uint32_t from, uint32_t to, uint32_t* matched, uint32_t* scanned, uint32_t* sectors){
+    if(s_flash_mutex == NULL){
+        return false;
+    }
+
+    *matched = 0;
+    xSemaphoreTake(s_flash_mutex, portMAX_DELAY);
+    scan(from, to, count_record, matched, scanned, sectors);
+    xSemaphoreGive(s_flash_mutex);
+
+    return true;
+}
+
+/**
+ * @brief Copies the write and query counters.
+ *
+ * @param stats Where to copy them.
+ */
+void audit_log_get_stats(audit_stats_t* stats){
+    portENTER_CRITICAL(&s_stats_lock);
+    *stats = s_stats;
+    portEXIT_CRITICAL(&s_stats_lock);
+}
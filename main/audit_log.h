@@ -0,0 +1,83 @@
+/**
+ * @file audit_log.h
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Append-only audit log of lock events in its own flash partition, with time range queries.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* {"from": T1, "to": T2, "max": N, "id": "...", "boot": ..., "seq": ...} with times in seconds, signed like a
+ * command (see command_authenticate()); results go to AUDIT_RESULT_TOPIC. */
+#define AUDIT_QUERY_TOPIC "/mister_nolan/audit"
+#define AUDIT_RESULT_TOPIC "/mister_nolan/audit/result"
+
+typedef enum{
+    AUDIT_EVENT_BOOT,       // result is the esp_reset_reason_t
+    AUDIT_EVENT_UNLOCK,     // result is the lock_admission_t
+    AUDIT_EVENT_RELOCK,
+    AUDIT_EVENT_REJECTED    // result is an audit_reject_t
+} audit_event_t;
+
+typedef enum{
+    AUDIT_REJECT_BAD_REQUEST,
+    AUDIT_REJECT_UNAUTHORIZED,
+    AUDIT_REJECT_REPLAYED
+} audit_reject_t;
+
+/* Sources beyond lock_source_t. */
+#define AUDIT_SOURCE_SCHEDULE 0xfd   // passage windows, see access_schedule.c
+#define AUDIT_SOURCE_AUTO 0xfe
+#define AUDIT_SOURCE_SYSTEM 0xff
+
+#define AUDIT_FLAG_CLOCK_SET 0x01   // time is seconds since the epoch rather than since boot
+#define AUDIT_FLAG_AFTER_DROPS 0x02 // rejections from this source were dropped since its last recorded one
+
+/* One record in flash, 16 bytes. Erased flash reads as sequence 0xffffffff. */
+typedef struct{
+    uint32_t sequence;
+    uint32_t time;
+    uint32_t actor;     // user id from the command, 0 if none
+    uint8_t event;      // audit_event_t
+    uint8_t source;     // lock_source_t or one of the AUDIT_SOURCE_ values
+    uint8_t result;
+    uint8_t flags;
+} audit_record_t;
+
+typedef struct{
+    uint32_t records_written;
+    uint32_t flushes;
+    uint32_t write_us;          // total time in flash erase and write
+    uint32_t dropped;           // records lost because the batch was full
+    uint32_t rejects_dropped;   // rejections not recorded because their source was over its allowance
+    uint32_t queries;
+    uint32_t sectors_read;
+    uint32_t records_scanned;
+    uint32_t query_us;          // total time reading flash for queries
+} audit_stats_t;
+
+void audit_log_start();
+void audit_log_append(audit_event_t event, uint8_t source, uint8_t result, uint32_t actor);
+void audit_log_reject(audit_event_t event, uint8_t source, uint8_t result, uint32_t actor);
+void audit_log_command(const char* data, int len);
+bool audit_log_count(uint32_t from, uint32_t to, uint32_t* matched, uint32_t* scanned, uint32_t* sectors);
+void audit_log_get_stats(audit_stats_t* stats);
@@ -0,0 +1,481 @@
+/**
+ * @file bench.c
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Self-benchmark console commands for characterizing a board in the field.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ *
+ *  Adds a "bench" command to the serial console:
+ *
+ *      bench lcd      [-n N] [-p]   HD44780 characters per second through the bus the LCD is on
+ *      bench pwm      [-n N] [-p]   set_lock_state() path: lock queue latency and time in the actuator driver
+ *      bench mqtt     [-n N] [-p]   publish to echo round trip through the current broker
+ *      bench wifi     [-n N] [-p]   time to reassociate and get an IP address after dropping the AP
+ *      bench audit    [-n N] [-p]   audit log query scan rate, and the write rate of the batches written so far
+ *      bench schedule [-n N] [-p]   cost of one access schedule permission check
+ *      bench all      [-n N] [-p]   all of the above
+ *
+ *  Results are printed, and with -p also published as JSON on BENCH_TOPIC. None of them move the bolt: the pwm
+ *  benchmark re-applies the state the lock is already in. The wifi benchmark really drops the connection, so MQTT
+ *  may reconnect each time. The audit benchmark only reads, so that the audit log holds nothing but real events; its
+ *  write rate comes from the batches the log has written on its own. The schedule benchmark checks made up users,
+ *  so it measures the search through the users as well as the bit test.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_console.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "esp_log.h"
+#include "argtable3/argtable3.h"
+
+#include "HD44780.h"
+#include "mqtt.h"
+#include "wifi.h"
+#include "lock_actuation.h"
+#include "status_display.h"
+#include "audit_log.h"
+#include "access_schedule.h"
+#include "bench.h"
+
+#if CONFIG_SMART_LOCK_BENCH
+
+#define BENCH_MAX_SAMPLES 64
+#define BENCH_DEFAULT_SAMPLES 10
+#define BENCH_LCD_CHARS_PER_SAMPLE (LCD_LINE_LENGTH * 4)
+#define BENCH_ECHO_TIMEOUT_MS 3000
+#define BENCH_WIFI_TIMEOUT_MS 20000
+#define BENCH_SCHEDULE_CHECKS 1000
+
+typedef struct{
+    uint32_t min;
+    uint32_t median;
+    uint32_t max;
+    uint32_t mean;
+} bench_summary_t;
+
+static const char *TAG = "BENCH";
+
+static struct{
+    struct arg_str* what;
+    struct arg_int* count;
+    struct arg_lit* publish;
+    struct arg_end* end;
+} s_args;
+
+/* Echo the mqtt benchmark is waiting for. Written by the console task, matched on the MQTT task. */
+static portMUX_TYPE s_echo_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t s_echo_waiter = NULL;
+static uint32_t s_echo_nonce;
+static uint32_t s_echo_sequence;
+static int64_t s_echo_received_us;
+
+static int compare_u32(const void* a, const void* b){
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Summarizes a set of samples. Sorts them in place.
+ *
+ * @param samples The samples.
+ * @param count Number of samples, at least one.
+ * @return bench_summary_t The summary.
+ */
+static bench_summary_t summarize(uint32_t* samples, int count){
+    bench_summary_t summary;
+    uint64_t total = 0;
+
+    qsort(samples, count, sizeof(uint32_t), compare_u32);
+    for(int i = 0; i < count; i++){
+        total += samples[i];
+    }
+
+    summary.min = samples[0];
+    summary.median = samples[count / 2];
+    summary.max = samples[count - 1];
+    summary.mean = total / count;
+
+    return summary;
+}
+
+static void print_summary(const char* name, const bench_summary_t* summary, const char* unit){
+    printf("  %-14s min %8u  median %8u  mean %8u  max %8u %s\n",
+           name, summary->min, summary->median, summary->mean, summary->max, unit);
+}
+
+static int append_summary(char* out, int size, const char* name, const bench_summary_t* summary){
+    return snprintf(out, size, ",\"%s\":{\"min\":%u,\"median\":%u,\"mean\":%u,\"max\":%u}",
+                    name, summary->min, summary->median, summary->mean, summary->max);
+}
+
+static void publish(const char* payload){
+    if(mqtt_publish(BENCH_TOPIC, payload, 0, 1, 0) < 0){
+        printf("  not published\n");
+    }
+}
+
+static int bench_lcd(int count, bool to_mqtt){
+    uint32_t samples[BENCH_MAX_SAMPLES];
+    int taken = 0;
+
+    for(int i = 0; i < count; i++){
+        int chars_per_second = status_display_benchmark(BENCH_LCD_CHARS_PER_SAMPLE);
+        if(chars_per_second < 0){
+            break;
+        }
+        samples[taken++] = chars_per_second;
+    }
+
+    if(taken == 0){
+        printf("lcd: display not running\n");
+        return 1;
+    }
+
+    bench_summary_t summary = summarize(samples, taken);
+    printf("lcd (%s bus, %d x %d chars):\n", lcd_bus_name(), taken, BENCH_LCD_CHARS_PER_SAMPLE);
+    print_summary("throughput", &summary, "chars/s");
+
+    if(to_mqtt){
+        char payload[192];
+        int length = snprintf(payload, sizeof(payload), "{\"bench\":\"lcd\",\"bus\":\"%s\",\"n\":%d",
+                              lcd_bus_name(), taken);
+        length += append_summary(payload + length, sizeof(payload) - length, "chars_per_s", &summary);
+        snprintf(payload + length, sizeof(payload) - length, "}");
+        publish(payload);
+    }
+
+    return 0;
+}
+
+static int bench_pwm(int count, bool to_mqtt){
+    uint32_t queue_samples[BENCH_MAX_SAMPLES];
+    uint32_t call_samples[BENCH_MAX_SAMPLES];
+    lock_actuation_timing_t timing;
+    int taken = 0;
+
+    for(int i = 0; i < count; i++){
+        if(!lock_actuation_benchmark(&queue_samples[taken], &call_samples[taken])){
+            break;
+        }
+        taken++;
+        vTaskDelay(pdMS_TO_TICKS(20)); // one servo PWM period, so each sample starts from a settled output
+    }
+
+    if(taken == 0){
+        printf("pwm: lock task did not answer\n");
+        return 1;
+    }
+
+    lock_actuation_get_timing(&timing);
+    bench_summary_t queue = summarize(queue_samples, taken);
+    bench_summary_t call = summarize(call_samples, taken);
+    printf("pwm (%s actuator, %d samples):\n", timing.actuator, taken);
+    print_summary("queue", &queue, "us");
+    print_summary("driver call", &call, "us");
+
+    if(to_mqtt){
+        char payload[256];
+        int length = snprintf(payload, sizeof(payload), "{\"bench\":\"pwm\",\"actuator\":\"%s\",\"n\":%d",
+                              timing.actuator, taken);
+        length += append_summary(payload + length, sizeof(payload) - length, "queue_us", &queue);
+        length += append_summary(payload + length, sizeof(payload) - length, "call_us", &call);
+        snprintf(payload + length, sizeof(payload) - length, "}");
+        publish(payload);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Called from the MQTT task for each message on BENCH_ECHO_TOPIC.
+ *
+ * @param data The payload, "<nonce> <sequence>".
+ * @param len Length of the payload.
+ * @param received_us When the message reached the MQTT event handler.
+ */
+void bench_echo_received(const char* data, int len, int64_t received_us){
+    char text[32];
+    unsigned nonce, sequence;
+
+    if(len <= 0 || len >= sizeof(text)){
+        return;
+    }
+    memcpy(text, data, len);
+    text[len] = '\0';
+    if(sscanf(text, "%x %u", &nonce, &sequence) != 2){
+        return;
+    }
+
+    portENTER_CRITICAL(&s_echo_lock);
+    TaskHandle_t waiter = s_echo_waiter;
+    bool match = waiter != NULL && nonce == s_echo_nonce && sequence == s_echo_sequence;
+    if(match){
+        s_echo_received_us = received_us;
+        s_echo_waiter = NULL;
+    }
+    portEXIT_CRITICAL(&s_echo_lock);
+
+    if(match){
+        xTaskNotifyGive(waiter);
+    }
+}
+
+static int bench_mqtt(int count, bool to_mqtt){
+    uint32_t samples[BENCH_MAX_SAMPLES];
+    uint32_t nonce = esp_random();
+    int taken = 0, lost = 0;
+
+    if(!mqtt_connected()){
+        printf("mqtt: not connected\n");
+        return 1;
+    }
+
+    for(int i = 0; i < count; i++){
+        char payload[32];
+        int length = snprintf(payload, sizeof(payload), "%08x %d", nonce, i);
+
+        xTaskNotifyStateClear(NULL);
+        portENTER_CRITICAL(&s_echo_lock);
+        s_echo_nonce = nonce;
+        s_echo_sequence = i;
+        s_echo_waiter = xTaskGetCurrentTaskHandle();
+        portEXIT_CRITICAL(&s_echo_lock);
+
+        int64_t sent_us = esp_timer_get_time();
+        bool echoed = mqtt_publish(BENCH_ECHO_TOPIC, payload, length, 0, 0) >= 0 &&
+                      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(BENCH_ECHO_TIMEOUT_MS)) != 0;
+
+        portENTER_CRITICAL(&s_echo_lock);
+        s_echo_waiter = NULL;
+        portEXIT_CRITICAL(&s_echo_lock);
+
+        if(echoed){
+            samples[taken++] = s_echo_received_us - sent_us;
+        }else{
+            lost++;
+        }
+    }
+
+    if(taken == 0){
+        printf("mqtt: no echoes from %s\n", BENCH_ECHO_TOPIC);
+        return 1;
+    }
+
+    bench_summary_t summary = summarize(samples, taken);
+    printf("mqtt (%d echoed, %d lost):\n", taken, lost);
+    print_summary("round trip", &summary, "us");
+
+    if(to_mqtt){
+        char payload[192];
+        int length = snprintf(payload, sizeof(payload), "{\"bench\":\"mqtt\",\"n\":%d,\"lost\":%d", taken, lost);
+        length += append_summary(payload + length, sizeof(payload) - length, "rtt_us", &summary);
+        snprintf(payload + length, sizeof(payload) - length, "}");
+        publish(payload);
+    }
+
+    return 0;
+}
+
+static int bench_wifi(int count, bool to_mqtt){
+    uint32_t associate_samples[BENCH_MAX_SAMPLES];
+    uint32_t ip_samples[BENCH_MAX_SAMPLES];
+    int taken = 0;
+
+    for(int i = 0; i < count; i++){
+        if(!wifi_measure_reconnect(&associate_samples[taken], &ip_samples[taken], BENCH_WIFI_TIMEOUT_MS)){
+            break;
+        }
+        taken++;
+        // Let MQTT reconnect, if it had to, before dropping the link again.
+        for(int wait = 0; wait < 100 && !mqtt_connected(); wait++){
+            vTaskDelay(pdMS_TO_TICKS(100));
+        }
+    }
+
+    if(taken == 0){
+        printf("wifi: not connected, or did not reconnect\n");
+        return 1;
+    }
+
+    bench_summary_t associate = summarize(associate_samples, taken);
+    bench_summary_t ip = summarize(ip_samples, taken);
+    printf("wifi (%d reconnects):\n", taken);
+    print_summary("associated", &associate, "us");
+    print_summary("got ip", &ip, "us");
+
+    if(to_mqtt){
+        char payload[256];
+        int length = snprintf(payload, sizeof(payload), "{\"bench\":\"wifi\",\"n\":%d", taken);
+        length += append_summary(payload + length, sizeof(payload) - length, "associate_us", &associate);
+        length += append_summary(payload + length, sizeof(payload) - length, "ip_us", &ip);
+        snprintf(payload + length, sizeof(payload) - length, "}");
+        publish(payload);
+    }
+
+    return 0;
+}
+
+static int bench_audit(int count, bool to_mqtt){
+    uint32_t samples[BENCH_MAX_SAMPLES];
+    uint32_t matched = 0, scanned = 0, sectors = 0;
+    audit_stats_t stats;
+    int taken = 0;
+
+    for(int i = 0; i < count; i++){
+        int64_t start = esp_timer_get_time();
+        if(!audit_log_count(0, UINT32_MAX, &matched, &scanned, &sectors)){
+            break;
+        }
+        samples[taken++] = esp_timer_get_time() - start;
+    }
+
+    if(taken == 0){
+        printf("audit: log not running\n");
+        return 1;
+    }
+
+    audit_log_get_stats(&stats);
+    bench_summary_t summary = summarize(samples, taken);
+    uint32_t scan_rate = summary.median > 0 ? (uint64_t)scanned * 1000000 / summary.median : 0;
+    uint32_t write_rate = stats.write_us > 0 ? (uint64_t)stats.records_written * 1000000 / stats.write_us : 0;
+
+    printf("audit (full scan of %u records in %u sectors, %d times):\n", scanned, sectors, taken);
+    print_summary("scan", &summary, "us");
+    printf("  scan rate      %u records/s\n", scan_rate);
+    printf("  write rate     %u records/s (%u records in %u batches, %u dropped)\n",
+           write_rate, stats.records_written, stats.flushes, stats.dropped);
+
+    if(to_mqtt){
+        char payload[256];
+        int length = snprintf(payload, sizeof(payload), "{\"bench\":\"audit\",\"n\":%d,\"records\":%u,\"sectors\":%u",
+                              taken, scanned, sectors);
+        length += append_summary(payload + length, sizeof(payload) - length, "scan_us", &summary);
+        snprintf(payload + length, sizeof(payload) - length,
+                 ",\"scan_per_s\":%u,\"write_per_s\":%u,\"written\":%u,\"batches\":%u}",
+                 scan_rate, write_rate, stats.records_written, stats.flushes);
+        publish(payload);
+    }
+
+    return 0;
+}
+
+static int bench_schedule(int count, bool to_mqtt){
+    uint32_t samples[BENCH_MAX_SAMPLES];
+    volatile bool allowed;
+
+    for(int i = 0; i < count; i++){
+        uint32_t user = esp_random();
+        int64_t start = esp_timer_get_time();
+        for(int j = 0; j < BENCH_SCHEDULE_CHECKS; j++){
+            allowed = access_schedule_allows(user + j);
+        }
+        samples[i] = (esp_timer_get_time() - start) * 1000 / BENCH_SCHEDULE_CHECKS;
+    }
+    (void)allowed;
+
+    bench_summary_t summary = summarize(samples, count);
+
+    printf("schedule (%d x %d permission checks):\n", count, BENCH_SCHEDULE_CHECKS);
+    print_summary("check", &summary, "ns");
+
+    if(to_mqtt){
+        char payload[192];
+        int length = snprintf(payload, sizeof(payload), "{\"bench\":\"schedule\",\"n\":%d,\"checks\":%d",
+                              count, BENCH_SCHEDULE_CHECKS);
+        length += append_summary(payload + length, sizeof(payload) - length, "check_ns", &summary);
+        snprintf(payload + length, sizeof(payload) - length, "}");
+        publish(payload);
+    }
+
+    return 0;
+}
+
+static int bench_command(int argc, char** argv){
+    if(arg_parse(argc, argv, (void**)&s_args) != 0){
+        arg_print_errors(stderr, s_args.end, argv[0]);
+        return 1;
+    }
+
+    const char* what = s_args.what->sval[0];
+    int count = s_args.count->count > 0 ? s_args.count->ival[0] : BENCH_DEFAULT_SAMPLES;
+    bool to_mqtt = s_args.publish->count > 0;
+    bool all = strcmp(what, "all") == 0;
+    int result = 0;
+
+    if(!all && strcmp(what, "lcd") != 0 && strcmp(what, "pwm") != 0 && strcmp(what, "mqtt") != 0 &&
+       strcmp(what, "wifi") != 0 && strcmp(what, "audit") != 0 && strcmp(what, "schedule") != 0){
+        printf("unknown benchmark %s\n", what);
+        return 1;
+    }
+    if(count < 1 || count > BENCH_MAX_SAMPLES){
+        printf("count must be 1 to %d\n", BENCH_MAX_SAMPLES);
+        return 1;
+    }
+
+    if(all || strcmp(what, "lcd") == 0) result |= bench_lcd(count, to_mqtt);
+    if(all || strcmp(what, "pwm") == 0) result |= bench_pwm(count, to_mqtt);
+    if(all || strcmp(what, "mqtt") == 0) result |= bench_mqtt(count, to_mqtt);
+    if(all || strcmp(what, "wifi") == 0) result |= bench_wifi(count, to_mqtt);
+    if(all || strcmp(what, "audit") == 0) result |= bench_audit(count, to_mqtt);
+    if(all || strcmp(what, "schedule") == 0) result |= bench_schedule(count, to_mqtt);
+
+    return result;
+}
+
+/**
+ * @brief Starts the console on the default UART with the bench command, and subscribes to the echo topic.
+ *
+ */
+void bench_start(){
+    esp_console_repl_t* repl = NULL;
+    esp_console_repl_config_t repl_config = ESP_CONSOLE_REPL_CONFIG_DEFAULT();
+    esp_console_dev_uart_config_t uart_config = ESP_CONSOLE_DEV_UART_CONFIG_DEFAULT();
+
+    s_args.what = arg_str1(NULL, NULL, "<lcd|pwm|mqtt|wifi|audit|schedule|all>", "what to measure");
+    s_args.count = arg_int0("n", "count", "<n>", "samples (default 10)");
+    s_args.publish = arg_lit0("p", "publish", "also publish the results as JSON on " BENCH_TOPIC);
+    s_args.end = arg_end(3);
+
+    const esp_console_cmd_t command = {
+        .command = "bench",
+        .help = "Run on-device micro-benchmarks. The wifi benchmark drops and rejoins the AP.",
+        .hint = NULL,
+        .func = bench_command,
+        .argtable = &s_args,
+    };
+
+    repl_config.prompt = "lock>";
+
+    if(esp_console_new_repl_uart(&uart_config, &repl_config, &repl) != ESP_OK ||
+       esp_console_cmd_register(&command) != ESP_OK ||
+       esp_console_start_repl(repl) != ESP_OK){
+        ESP_LOGE(TAG, "console not started");
+        return;
+    }
+
+    mqtt_subscribe(BENCH_ECHO_TOPIC, 0);
+}
+
+#endif
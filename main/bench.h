@@ -0,0 +1,44 @@
+/**
+ * @file bench.h
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Self-benchmark console commands for characterizing a board in the field.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "sdkconfig.h"
+
+/* Results of "bench ... -p" are published here as JSON. */
+#define BENCH_TOPIC "/mister_nolan/bench"
+/* "bench mqtt" publishes to this topic and times the broker echoing it back. */
+#define BENCH_ECHO_TOPIC "/mister_nolan/bench/echo"
+
+#if CONFIG_SMART_LOCK_BENCH
+
+void bench_start();
+void bench_echo_received(const char* data, int len, int64_t received_us);
+
+#else
+
+#define bench_start() do{ }while(0)
+#define bench_echo_received(data, len, received_us) do{ (void)(data); (void)(len); (void)(received_us); }while(0)
+
+#endif
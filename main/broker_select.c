@@ -0,0 +1,451 @@
+/**
+ * @file broker_select.c
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Picks the active MQTT broker from the configured list, using background latency probes.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ *
+ *  A probe task on the network core opens its own short MQTT session to every configured broker: TCP connect,
+ *  CONNECT, CONNACK, PINGREQ, PINGRESP, DISCONNECT. It uses a client id of its own so that probing the active
+ *  broker never kicks the lock's real session. A broker is healthy while its probes succeed within
+ *  CONFIG_SMART_LOCK_BROKER_MAX_RTT_MS. mqtts:// brokers are probed with a plain TCP connect only.
+ *
+ *  Failover: once the client has been disconnected for CONFIG_SMART_LOCK_BROKER_FAILOVER_MS, or the active
+ *  broker has failed two probes in a row, the client moves to the most preferred healthy broker. While
+ *  disconnected, probes run every second, so the switch happens at most one probe round after the deadline.
+ *
+ *  Switch back: a more preferred broker has to pass CONFIG_SMART_LOCK_BROKER_SWITCH_BACK_PROBES probes in a row
+ *  before the client moves back to it, so a flapping broker does not drag the lock back and forth.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_mac.h"
+#include "esp_log.h"
+
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+
+#include "mqtt.h"
+#include "fast_log.h"
+#include "lock_config.h"
+#include "broker_select.h"
+#include "warm_boot.h"
+
+#define FAST_PROBE_PERIOD_MS 1000
+#define ACTIVE_FAIL_LIMIT 2
+#define PROBE_KEEPALIVE_S 10
+
+static const char *TAG = "BROKER_SELECT";
+
+static TaskHandle_t s_probe_task = NULL;
+static char s_uris[LOCK_CONFIG_MAX_BROKERS][LOCK_CONFIG_URI_LENGTH];
+static int s_broker_count = 0;
+static volatile int s_active = 0;
+static volatile bool s_connected = false;
+static volatile int64_t s_disconnected_at_us = 0;
+static int64_t s_switched_at_us = 0;
+static char s_client_id[24];
+
+static portMUX_TYPE s_health_lock = portMUX_INITIALIZER_UNLOCKED;
+static broker_health_t s_health[LOCK_CONFIG_MAX_BROKERS];
+
+/**
+ * @brief Splits a broker URI into host and port. 
+ * 
+ * @param uri mqtt://host[:port][/path] or mqtts://...
+ * @param host Receives the host.
+ * @param host_len Size of host.
+ * @param port Receives the port as a string.
+ * @param tls Set if the URI is mqtts://.
+ * @return true if the URI was understood.
+ */
+static bool parse_uri(const char* uri, char* host, size_t host_len, char* port, bool* tls){
+    const char* start;
+
+    if(strncmp(uri, "mqtt://", 7) == 0){
+        start = uri + 7;
+        *tls = false;
+    }else if(strncmp(uri, "mqtts://", 8) == 0){
+        start = uri + 8;
+        *tls = true;
+    }else{
+        return false;
+    }
+
+    size_t length = strcspn(start, ":/");
+    if(length == 0 || length >= host_len){
+        return false;
+    }
+    memcpy(host, start, length);
+    host[length] = '\0';
+
+    if(start[length] == ':'){
+        size_t port_length = strcspn(start + length + 1, "/");
+        if(port_length == 0 || port_length > 5){
+            return false;
+        }
+        memcpy(port, start + length + 1, port_length);
+        port[port_length] = '\0';
+    }else{
+        strcpy(port, *tls ? "8883" : "1883");
+    }
+
+    return true;
+}
+
+static bool send_all(int sock, const uint8_t* data, size_t length){
+    while(length > 0){
+        int sent = send(sock, data, length, 0);
+        if(sent <= 0){
+            return false;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+static bool recv_all(int sock, uint8_t* data, size_t length){
+    while(length > 0){
+        int received = recv(sock, data, length, 0);
+        if(received <= 0){
+            return false;
+        }
+        data += received;
+        length -= received;
+    }
+    return true;
+}
+
+/**
+ * @brief Runs one probe session against a broker. 
+ * 
+ * @param uri The broker. 
+ * @param health Receives the round trip times. Streaks are left alone. 
+ * @return true if the broker answered in time and accepted the connection. 
+ */
+static bool probe(const char* uri, broker_health_t* health){
+    char host[LOCK_CONFIG_URI_LENGTH];
+    char port[6];
+    bool tls;
+
+    health->connect_rtt_us = 0;
+    health->ping_rtt_us = 0;
+
+    if(!parse_uri(uri, host, sizeof(host), port, &tls)){
+        return false;
+    }
+
+    struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo* address = NULL;
+    if(getaddrinfo(host, port, &hints, &address) != 0 || address == NULL){
+        return false;
+    }
+
+    int sock = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if(sock < 0){
+        freeaddrinfo(address);
+        return false;
+    }
+
+    struct timeval timeout = {
+        .tv_sec = CONFIG_SMART_LOCK_BROKER_PROBE_TIMEOUT_MS / 1000,
+        .tv_usec = (CONFIG_SMART_LOCK_BROKER_PROBE_TIMEOUT_MS % 1000) * 1000,
+    };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    bool ok = false;
+    int64_t start = esp_timer_get_time();
+
+    if(connect(sock, address->ai_addr, address->ai_addrlen) != 0){
+        goto done;
+    }
+
+    if(tls){
+        // Without a TLS session the TCP handshake is the best latency signal available.
+        health->connect_rtt_us = esp_timer_get_time() - start;
+        ok = true;
+        goto done;
+    }
+
+    // MQTT 3.1.1 CONNECT with a clean session.
+    uint8_t packet[14 + sizeof(s_client_id)];
+    size_t id_length = strlen(s_client_id);
+    size_t length = 0;
+    packet[length++] = 0x10;
+    packet[length++] = 12 + id_length;
+    memcpy(packet + length, "\x00\x04MQTT\x04\x02", 8);
+    length += 8;
+    packet[length++] = 0;
+    packet[length++] = PROBE_KEEPALIVE_S;
+    packet[length++] = 0;
+    packet[length++] = id_length;
+    memcpy(packet + length, s_client_id, id_length);
+    length += id_length;
+
+    uint8_t reply[4];
+    if(!send_all(sock, packet, length) || !recv_all(sock, reply, 4) || reply[0] != 0x20){
+        goto done;
+    }
+    health->connect_rtt_us = esp_timer_get_time() - start;
+
+    if(reply[3] != 0){
+        // Refused (e.g. needs credentials). The RTT is kept as a figure, but the lock could not use it either.
+        goto done;
+    }
+
+    static const uint8_t pingreq[2] = {0xC0, 0x00};
+    static const uint8_t disconnect[2] = {0xE0, 0x00};
+
+    int64_t ping_start = esp_timer_get_time();
+    if(!send_all(sock, pingreq, 2) || !recv_all(sock, reply, 2) || reply[0] != 0xD0){
+        goto done;
+    }
+    health->ping_rtt_us = esp_timer_get_time() - ping_start;
+    ok = true;
+
+    send_all(sock, disconnect, 2);
+
+done:
+    close(sock);
+    freeaddrinfo(address);
+
+    return ok;
+}
+
+/**
+ * @brief Probes every configured broker and updates the health table. 
+ * 
+ */
+static void probe_all(){
+    for(int i = 0; i < s_broker_count; i++){
+        broker_health_t result;
+        bool ok = probe(s_uris[i], &result);
+        uint32_t rtt = result.ping_rtt_us != 0 ? result.ping_rtt_us : result.connect_rtt_us;
+
+        if(ok && rtt > CONFIG_SMART_LOCK_BROKER_MAX_RTT_MS * 1000){
+            ok = false; // too slow to be useful
+        }
+
+        portENTER_CRITICAL(&s_health_lock);
+        broker_health_t* health = &s_health[i];
+        health->connect_rtt_us = result.connect_rtt_us;
+        health->ping_rtt_us = result.ping_rtt_us;
+        health->healthy = ok;
+        if(ok){
+            health->good_streak++;
+            health->fail_streak = 0;
+        }else{
+            health->fail_streak++;
+            health->good_streak = 0;
+        }
+        portEXIT_CRITICAL(&s_health_lock);
+
+        FLOGD(TAG, "broker %d: %s connect %uus ping %uus", i, ok ? "ok" : "down", result.connect_rtt_us,
+              result.ping_rtt_us);
+    }
+}
+
+/**
+ * @brief Decides whether the client should move to another broker. 
+ * 
+ * @return int The broker to switch to, or -1 to stay. 
+ */
+static int choose(){
+    int active = s_active;
+    int64_t now = esp_timer_get_time();
+    int target = -1;
+
+    portENTER_CRITICAL(&s_health_lock);
+
+    bool disconnected_too_long = !s_connected &&
+                                 now - s_disconnected_at_us >= CONFIG_SMART_LOCK_BROKER_FAILOVER_MS * 1000LL;
+    bool active_failing = s_health[active].fail_streak >= ACTIVE_FAIL_LIMIT;
+
+    if(disconnected_too_long || active_failing){
+        // Fail over to the most preferred broker that is answering.
+        for(int i = 0; i < s_broker_count; i++){
+            if(i != active && s_health[i].healthy){
+                target = i;
+                break;
+            }
+        }
+    }else{
+        // Switch back to a more preferred broker once it has stayed healthy for a while.
+        for(int i = 0; i < active; i++){
+            if(s_health[i].good_streak >= CONFIG_SMART_LOCK_BROKER_SWITCH_BACK_PROBES){
+                target = i;
+                break;
+            }
+        }
+    }
+
+    portEXIT_CRITICAL(&s_health_lock);
+
+    return target;
+}
+
+static void probe_task(void* arg){
+    for(;;){
+        probe_all();
+
+        int target = choose();
+        if(target >= 0){
+            int from = s_active;
+            bool failover = !s_connected;
+            int64_t down_us = esp_timer_get_time() - s_disconnected_at_us;
+
+            ESP_LOGW(TAG, "switching broker %d -> %d (%s)", from, target, s_uris[target]);
+            if(failover){
+                ESP_LOGW(TAG, "failover after %lld ms without a broker", down_us / 1000);
+            }
+
+            // The new broker gets the full failover time to accept the connection before it is given up on.
+            s_active = target;
+            s_connected = false;
+            s_switched_at_us = esp_timer_get_time();
+            s_disconnected_at_us = s_switched_at_us;
+            mqtt_switch_broker(s_uris[target]);
+        }
+
+        uint32_t period_ms = s_connected ? CONFIG_SMART_LOCK_BROKER_PROBE_PERIOD_S * 1000 : FAST_PROBE_PERIOD_MS;
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(period_ms));
+    }
+}
+
+/**
+ * @brief   Copies the broker list out of the configuration. Called before mqtt_app_start() so that
+ *          broker_select_active_uri() has something to return. 
+ * 
+ */
+static void load_brokers(){
+    if(s_broker_count > 0){
+        return;
+    }
+
+    char uris[LOCK_CONFIG_MAX_BROKERS][LOCK_CONFIG_URI_LENGTH];
+    LOCK_CONFIG_GET(uris, broker_uris);
+
+    for(int i = 0; i < LOCK_CONFIG_MAX_BROKERS; i++){
+        if(uris[i][0] != '\0'){
+            strlcpy(s_uris[s_broker_count], uris[i], sizeof(s_uris[0]));
+            s_broker_count++;
+        }
+    }
+
+    if(s_broker_count == 0){
+        strlcpy(s_uris[0], DEFAULT_BROKER_URI, sizeof(s_uris[0]));
+        s_broker_count = 1;
+    }
+
+    // Resume on the broker the session was on before a warm boot instead of rediscovering it.
+    const warm_boot_snapshot_t* restored = warm_boot_restored();
+    if(restored != NULL && restored->broker_index > 0 && restored->broker_index < s_broker_count){
+        s_active = restored->broker_index;
+    }
+}
+
+/**
+ * @brief Starts probing. Does nothing useful with a single broker, so no task is started then. 
+ * 
+ */
+void broker_select_start(){
+    load_brokers();
+
+    if(s_broker_count < 2){
+        return;
+    }
+
+    uint8_t mac[6];
+    esp_read_mac(mac, ESP_MAC_WIFI_STA);
+    snprintf(s_client_id, sizeof(s_client_id), "sl-probe-%02x%02x%02x", mac[3], mac[4], mac[5]);
+
+    if(!s_connected){
+        s_disconnected_at_us = esp_timer_get_time();
+    }
+
+    xTaskCreatePinnedToCore(probe_task, "broker_probe", 4096, NULL, CONFIG_SMART_LOCK_BROKER_PROBE_PRIORITY,
+                            &s_probe_task, CONFIG_SMART_LOCK_NETWORK_CORE);
+}
+
+/**
+ * @brief The broker the client should use now. Starts with the most preferred one, or after a warm boot the one
+ *        the session was on. 
+ * 
+ * @return const char* The URI. 
+ */
+const char* broker_select_active_uri(){
+    load_brokers();
+
+    return s_uris[s_active];
+}
+
+int broker_select_active_index(){
+    return s_active;
+}
+
+/**
+ * @brief Copies the latest probe results, one entry per configured broker. 
+ * 
+ * @param health Receives the results. 
+ */
+void broker_select_get_health(broker_health_t health[LOCK_CONFIG_MAX_BROKERS]){
+    portENTER_CRITICAL(&s_health_lock);
+    memcpy(health, s_health, sizeof(s_health));
+    portEXIT_CRITICAL(&s_health_lock);
+}
+
+/**
+ * @brief Called from the MQTT event handler on connect. 
+ * 
+ */
+void broker_select_on_connected(){
+    s_connected = true;
+
+    if(s_switched_at_us != 0){
+        FLOGI(TAG, "connected to broker %d, %u ms after the switch", s_active,
+              (uint32_t)((esp_timer_get_time() - s_switched_at_us) / 1000));
+        s_switched_at_us = 0;
+    }
+}
+
+/**
+ * @brief Called from the MQTT event handler on disconnect. Starts the failover clock and wakes the probe task. 
+ * 
+ */
+void broker_select_on_disconnected(){
+    if(s_connected){
+        s_disconnected_at_us = esp_timer_get_time();
+    }
+    s_connected = false;
+
+    if(s_probe_task != NULL){
+        xTaskNotifyGive(s_probe_task);
+    }
+}
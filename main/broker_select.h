@@ -0,0 +1,44 @@
+/**
+ * @file broker_select.h
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Picks the active MQTT broker from the configured list, using background latency probes.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "lock_config.h"
+
+typedef struct{
+    bool healthy;
+    uint32_t connect_rtt_us;    // TCP connect to CONNACK, 0 if the last probe failed
+    uint32_t ping_rtt_us;       // PINGREQ to PINGRESP, 0 if not measured
+    uint16_t good_streak;
+    uint16_t fail_streak;
+} broker_health_t;
+
+void broker_select_start();
+const char* broker_select_active_uri();
+int broker_select_active_index();
+void broker_select_get_health(broker_health_t health[LOCK_CONFIG_MAX_BROKERS]);
+void broker_select_on_connected();
+void broker_select_on_disconnected();
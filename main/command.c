@@ -0,0 +1,498 @@
+/**
+ * @file command.c
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Lock commands with correlation ids, acknowledgements and completion reports.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ *
+ *  Commands arrive over MQTT on the command topic, or as UDP datagrams on the LAN (see local_endpoint.c), and
+ *  both go through command_handle(). A command is either the legacy single character "u", or a JSON object:
+ *
+ *      {"cmd": "unlock", "id": "c0ffee-17", "reply": "/fleet/replies/host-1", "boot": "9f3a61c2", "seq": 17}
+ *
+ *  optionally followed by a newline and a signature: the HMAC-SHA256 of the JSON text (everything before the
+ *  newline) under CONFIG_SMART_LOCK_COMMAND_KEY, as 64 hex digits. A command with a "user" may instead be signed
+ *  with that user's own key (see signature_valid()). The "user" picks the access schedule, and is ignored on
+ *  unsigned commands. A signed command must carry the lock's boot
+ *  nonce (published in the retained state and in the mDNS TXT record, and new on every boot) and a sequence
+ *  number above any accepted since boot, so a captured command cannot be replayed. Every key, the shared one and
+ *  each user's, has a sequence of its own, so users cannot use up each other's numbers. It is a whole number that
+ *  starts at 0 on every boot, and each message may move it on by at most CONFIG_SMART_LOCK_COMMAND_SEQ_WINDOW, so
+ *  no single message can push it out of reach. LAN commands must be signed; MQTT commands must be signed if
+ *  CONFIG_SMART_LOCK_COMMAND_REQUIRE_AUTH is set.
+ *
+ *  If it has an id, two replies go back: published on the reply topic for MQTT, or sent to the datagram's source
+ *  address on the LAN. An id with quotes, backslashes or control characters is ignored, so it gets no replies.
+ *  The first goes out as soon as the command has been through admission:
+ *
+ *      {"id": "c0ffee-17", "phase": "ack", "status": "accepted", "t_rx": 81234567}
+ *
+ *  The second goes out when the lock task has finished acting on it:
+ *
+ *      {"id": "c0ffee-17", "phase": "done", "status": "done", "t_rx": ..., "t_start": ..., "t_done": ...,
+ *       "queue_us": 412, "actuation_us": 96}
+ *
+ *  The two are queued separately, so a fast completion can overtake its ack. Timestamps are microseconds on the
+ *  device clock. queue_us is the time from receipt until the lock task picked the command up, and actuation_us is the time the lock task spent acting on it. A coalesced command
+ *  only extended the open window, so its completion follows the ack at once. Rate limited and dropped commands
+ *  get an ack with that status and no completion, and so do commands that fail authentication ("unauthorized"),
+ *  reuse a sequence number ("replayed") or come from a "user" outside their access schedule ("denied", see
+ *  access_schedule.c). Over the LAN, commands that are malformed, unauthorized or replayed get no reply at all.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sdkconfig.h"
+#include "cJSON.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "bootloader_random.h"
+#include "esp_log.h"
+#include "mbedtls/md.h"
+
+#include "mqtt.h"
+#include "fast_log.h"
+#include "trace.h"
+#include "local_endpoint.h"
+#include "audit_log.h"
+#include "access_schedule.h"
+#include "command.h"
+
+#define COMMAND_MAC_LENGTH 32
+#define COMMAND_SEQ_EXACT_MAX 9007199254740992.0    // 2^53, the largest range in which a JSON number is exact
+#define COMMAND_SEQ_KEYS (1 + ACCESS_MAX_USERS)     // the shared key and one per user
+
+#if CONFIG_SMART_LOCK_COMMAND_REQUIRE_AUTH
+#define COMMAND_REQUIRE_AUTH true
+#else
+#define COMMAND_REQUIRE_AUTH false
+#endif
+
+/* What a JSON command said, beyond what goes into its context. */
+typedef struct{
+    bool unlock;
+    bool has_boot;
+    uint32_t boot;
+    bool has_seq;
+    uint64_t seq;
+} command_fields_t;
+
+/* The last sequence number accepted for one signing key. */
+typedef struct{
+    bool used;
+    uint32_t user;      // 0 for the shared key
+    uint64_t last;
+} command_seq_t;
+
+static const char *TAG = "COMMAND";
+
+static uint32_t s_boot_nonce;
+static portMUX_TYPE s_seq_lock = portMUX_INITIALIZER_UNLOCKED;
+static command_seq_t s_seqs[COMMAND_SEQ_KEYS];
+
+static const char* admission_status(lock_admission_t result){
+    switch(result){
+    case LOCK_ADMITTED:
+        return "accepted";
+    case LOCK_COALESCED:
+        return "coalesced";
+    case LOCK_RATE_LIMITED:
+        return "rate_limited";
+    case LOCK_QUEUE_FULL:
+        return "queue_full";
+    case LOCK_DENIED:
+        return "denied";
+    default:
+        return "error";
+    }
+}
+
+static bool wants_reply(const command_ctx_t* ctx){
+    return ctx != NULL && ctx->id[0] != '\0' && (ctx->reply_topic[0] != '\0' || ctx->reply_addr != 0);
+}
+
+static void reply(const command_ctx_t* ctx, const char* payload){
+    if(ctx->reply_addr != 0){
+        local_endpoint_send(ctx->reply_addr, ctx->reply_port, payload);
+        return;
+    }
+
+    // Queued for the MQTT task rather than sent here, so neither the MQTT task nor the lock task waits on the socket.
+    if(esp_mqtt_client_enqueue(client, ctx->reply_topic, payload, 0, 1, 0, true) < 0){
+        ESP_LOGW(TAG, "reply for %s not queued", ctx->id);
+    }
+}
+
+static void reply_ack(const command_ctx_t* ctx, const char* status){
+    char payload[160];
+
+    if(!wants_reply(ctx)){
+        return;
+    }
+
+    snprintf(payload, sizeof(payload), "{\"id\":\"%s\",\"phase\":\"ack\",\"status\":\"%s\",\"t_rx\":%lld}",
+             ctx->id, status, ctx->received_us);
+    reply(ctx, payload);
+}
+
+/**
+ * @brief   Acks a command that was turned away before admission. Only over MQTT: a LAN datagram's source address
+ *          can be forged, so answering rejected datagrams would let anyone aim the replies at a third party.
+ *
+ * @param ctx The command.
+ * @param status Why it was turned away.
+ */
+static void reply_reject(const command_ctx_t* ctx, const char* status){
+    if(ctx->reply_addr == 0){
+        reply_ack(ctx, status);
+    }
+}
+
+static void reply_done(const command_ctx_t* ctx, const char* status, int64_t started_us, int64_t done_us){
+    char payload[256];
+
+    if(!wants_reply(ctx)){
+        return;
+    }
+
+    snprintf(payload, sizeof(payload),
+             "{\"id\":\"%s\",\"phase\":\"done\",\"status\":\"%s\",\"t_rx\":%lld,\"t_start\":%lld,"
+             "\"t_done\":%lld,\"queue_us\":%lld,\"actuation_us\":%lld}",
+             ctx->id, status, ctx->received_us, started_us, done_us,
+             started_us - ctx->received_us, done_us - started_us);
+    reply(ctx, payload);
+}
+
+/**
+ * @brief   Checks that an id can be copied into a JSON reply as it is. Replies are built with snprintf, so an id
+ *          that needs escaping is refused rather than escaped.
+ *
+ * @param id The id from the request.
+ * @return true if it has no quotes, backslashes or control characters.
+ */
+bool command_id_is_plain(const char* id){
+    for(; *id != '\0'; id++){
+        if(*id == '"' || *id == '\\' || (unsigned char)*id < 0x20){
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Parses a JSON command. Fields that are missing are left empty.
+ *
+ * @param data The JSON text.
+ * @param len Length of the text.
+ * @param ctx Receives the id and reply topic.
+ * @param fields Receives the rest.
+ */
+static void parse_json(const char* data, int len, command_ctx_t* ctx, command_fields_t* fields){
+    cJSON* root = cJSON_ParseWithLength(data, len);
+
+    if(root == NULL || !cJSON_IsObject(root)){
+        cJSON_Delete(root);
+        return;
+    }
+
+    cJSON* cmd = cJSON_GetObjectItem(root, "cmd");
+    cJSON* id = cJSON_GetObjectItem(root, "id");
+    cJSON* reply_topic = cJSON_GetObjectItem(root, "reply");
+    cJSON* boot = cJSON_GetObjectItem(root, "boot");
+    cJSON* seq = cJSON_GetObjectItem(root, "seq");
+    cJSON* user = cJSON_GetObjectItem(root, "user");
+
+    if(cJSON_IsString(id) && strlen(id->valuestring) < sizeof(ctx->id) && command_id_is_plain(id->valuestring)){
+        strcpy(ctx->id, id->valuestring);
+    }
+    if(cJSON_IsString(reply_topic) && strlen(reply_topic->valuestring) < sizeof(ctx->reply_topic)){
+        strcpy(ctx->reply_topic, reply_topic->valuestring);
+    }
+    fields->unlock = cJSON_IsString(cmd) && strcmp(cmd->valuestring, "unlock") == 0;
+    unsigned nonce;
+    if(cJSON_IsString(boot) && sscanf(boot->valuestring, "%x", &nonce) == 1){
+        fields->boot = nonce;
+        fields->has_boot = true;
+    }
+    if(cJSON_IsNumber(user) && user->valuedouble >= 0 && user->valuedouble <= UINT32_MAX){
+        ctx->user = user->valuedouble;
+    }
+    // Fractions and numbers too large to be exact would let two different texts stand for the same sequence.
+    if(cJSON_IsNumber(seq) && seq->valuedouble >= 1 && seq->valuedouble <= COMMAND_SEQ_EXACT_MAX &&
+       seq->valuedouble == (double)(uint64_t)seq->valuedouble){
+        fields->seq = seq->valuedouble;
+        fields->has_seq = true;
+    }
+
+    cJSON_Delete(root);
+}
+
+static int hex_value(char c){
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * @brief Splits a trailing signature off a command.
+ *
+ * @param data The command text.
+ * @param len Length of the text. Shortened to the signed part if a signature is found.
+ * @param mac Receives the signature.
+ * @return true if the command ends in a well formed signature.
+ */
+static bool split_signature(const char* data, int* len, uint8_t mac[COMMAND_MAC_LENGTH]){
+    int body = *len - 1 - COMMAND_MAC_LENGTH * 2;
+
+    if(body <= 0 || data[body] != '\n'){
+        return false;
+    }
+
+    for(int i = 0; i < COMMAND_MAC_LENGTH; i++){
+        int high = hex_value(data[body + 1 + i * 2]);
+        int low = hex_value(data[body + 2 + i * 2]);
+        if(high < 0 || low < 0){
+            return false;
+        }
+        mac[i] = high << 4 | low;
+    }
+
+    *len = body;
+    return true;
+}
+
+/**
+ * @brief   Checks a signature in constant time, against the shared key or against one user's key. A user's key is
+ *          the HMAC-SHA256 of "user:<id>" under the shared key, so it can be handed to that user's app without
+ *          letting it sign for anyone else.
+ *
+ * @param data The signed text.
+ * @param len Length of the text.
+ * @param mac The signature it came with.
+ * @param user 0 for the shared key, otherwise the user whose key to check against.
+ * @return true if the shared key is set and the signature matches.
+ */
+static bool signature_valid(const char* data, int len, const uint8_t mac[COMMAND_MAC_LENGTH], uint32_t user){
+    static const char shared_key[] = CONFIG_SMART_LOCK_COMMAND_KEY;
+    const mbedtls_md_info_t* sha256 = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+    const uint8_t* key = (const uint8_t*)shared_key;
+    size_t key_length = sizeof(shared_key) - 1;
+    uint8_t user_key[COMMAND_MAC_LENGTH];
+    uint8_t expected[COMMAND_MAC_LENGTH];
+    uint8_t difference = 0;
+
+    if(key_length == 0){
+        return false;
+    }
+    if(user != 0){
+        char label[16];
+        int label_length = snprintf(label, sizeof(label), "user:%u", user);
+
+        if(mbedtls_md_hmac(sha256, key, key_length, (const uint8_t*)label, label_length, user_key) != 0){
+            return false;
+        }
+        key = user_key;
+        key_length = sizeof(user_key);
+    }
+    if(mbedtls_md_hmac(sha256, key, key_length, (const uint8_t*)data, len, expected) != 0){
+        return false;
+    }
+
+    for(int i = 0; i < COMMAND_MAC_LENGTH; i++){
+        difference |= expected[i] ^ mac[i];
+    }
+
+    return difference == 0;
+}
+
+/**
+ * @brief   Accepts a signed command's boot nonce and sequence number, and moves the signing key's sequence on.
+ *          Shared by every transport, so a command cannot be replayed on the other one either. The sequence may
+ *          only move on by CONFIG_SMART_LOCK_COMMAND_SEQ_WINDOW at a time. A key seen for the first time since
+ *          boot takes a free slot; once all are taken, further keys are turned away until the next boot rather
+ *          than reusing a slot, which would let that key's old messages be replayed.
+ *
+ * @param fields The command.
+ * @param signer The key it was signed with: 0 for the shared key, otherwise the user.
+ * @return true if the command is fresh.
+ */
+static bool take_sequence(const command_fields_t* fields, uint32_t signer){
+    command_seq_t* seq = NULL;
+    bool fresh;
+
+    if(!fields->has_boot || fields->boot != s_boot_nonce || !fields->has_seq){
+        return false;
+    }
+
+    portENTER_CRITICAL(&s_seq_lock);
+    for(int i = 0; i < COMMAND_SEQ_KEYS; i++){
+        if(s_seqs[i].used && s_seqs[i].user == signer){
+            seq = &s_seqs[i];
+            break;
+        }
+        if(!s_seqs[i].used && seq == NULL){
+            seq = &s_seqs[i];
+        }
+    }
+    // A free slot's last is still 0.
+    fresh = seq != NULL && fields->seq > seq->last && fields->seq - seq->last <= CONFIG_SMART_LOCK_COMMAND_SEQ_WINDOW;
+    if(fresh){
+        seq->used = true;
+        seq->user = signer;
+        seq->last = fields->seq;
+    }
+    portEXIT_CRITICAL(&s_seq_lock);
+
+    return fresh;
+}
+
+/**
+ * @brief   Checks a signed JSON message for one of the other topics that change the lock (OTA, config, schedules,
+ *          audit queries). It has to be signed like a command, carry the boot nonce and use up a sequence number,
+ *          which it shares with commands.
+ *
+ * @param data The message.
+ * @param len Length of the message. Shortened to the JSON text if the message is accepted.
+ * @return true if the message is signed with the shared key and fresh.
+ */
+bool command_authenticate(const char* data, int* len){
+    command_ctx_t ctx;
+    command_fields_t fields = {0};
+    uint8_t mac[COMMAND_MAC_LENGTH];
+    int body = *len;
+
+    if(!split_signature(data, &body, mac) || !signature_valid(data, body, mac, 0)){
+        return false;
+    }
+
+    parse_json(data, body, &ctx, &fields);
+    if(!take_sequence(&fields, 0)){
+        return false;
+    }
+
+    *len = body;
+    return true;
+}
+
+/**
+ * @brief   Picks this boot's nonce. Must run before any command is handled. It runs before Wi-Fi is started, when
+ *          esp_random() has no RF noise to draw on, so the SAR ADC entropy source is switched on around it.
+ *
+ */
+void command_init(){
+    bootloader_random_enable();
+    s_boot_nonce = esp_random();
+    bootloader_random_disable();
+}
+
+/**
+ * @brief The nonce signed commands must carry during this boot.
+ *
+ * @return uint32_t The nonce.
+ */
+uint32_t command_boot_nonce(){
+    return s_boot_nonce;
+}
+
+/**
+ * @brief Handles a command, acknowledges it and passes it on to the lock.
+ *
+ * @param data The command text.
+ * @param len Length of the text.
+ * @param source Where it came from, for rate limiting. LOCK_SOURCE_LOCAL commands must be signed.
+ * @param origin    The receive time, from esp_timer_get_time(), and for LAN commands the address to reply to. The
+ *                  id and reply topic are filled in from the command.
+ */
+void command_handle(const char* data, int len, lock_source_t source, const command_ctx_t* origin){
+    command_ctx_t ctx = *origin;
+    command_fields_t fields = {0};
+    uint8_t mac[COMMAND_MAC_LENGTH];
+    bool is_signed = split_signature(data, &len, mac);
+    bool needs_signature = source == LOCK_SOURCE_LOCAL || COMMAND_REQUIRE_AUTH;
+
+    ctx.id[0] = '\0';
+    ctx.reply_topic[0] = '\0';
+    ctx.user = 0;
+
+    if(len > 0 && data[0] == '{'){
+        parse_json(data, len, &ctx, &fields);
+    }else{
+        fields.unlock = len > 0 && data[0] == 'u';
+    }
+
+    // The access schedule is picked by user, so a claimed user only counts once the signature backs it up.
+    uint32_t claimed_user = ctx.user;
+    ctx.user = 0;
+
+    if(!fields.unlock){
+        FLOGW(TAG, "unknown command");
+        audit_log_reject(AUDIT_EVENT_REJECTED, source, AUDIT_REJECT_BAD_REQUEST, ctx.user);
+        reply_reject(&ctx, "bad_request");
+        return;
+    }
+
+    // The shared key is held by trusted clients, which may act for any user. A user's own key only signs for
+    // that user. An unsigned command acts for no one and gets the default schedule.
+    uint32_t signer = 0;
+    bool authentic = false;
+    if(is_signed && signature_valid(data, len, mac, 0)){
+        authentic = true;
+    }else if(is_signed && claimed_user != 0 && signature_valid(data, len, mac, claimed_user)){
+        authentic = true;
+        signer = claimed_user;
+    }
+    if(is_signed ? !authentic : needs_signature){
+        FLOGW(TAG, "unauthorized command from %s", lock_source_name(source));
+        audit_log_reject(AUDIT_EVENT_REJECTED, source, AUDIT_REJECT_UNAUTHORIZED, ctx.user);
+        reply_reject(&ctx, "unauthorized");
+        return;
+    }
+    if(is_signed){
+        ctx.user = claimed_user;
+    }
+    if(is_signed && !take_sequence(&fields, signer)){
+        FLOGW(TAG, "replayed command from %s", lock_source_name(source));
+        audit_log_reject(AUDIT_EVENT_REJECTED, source, AUDIT_REJECT_REPLAYED, ctx.user);
+        reply_reject(&ctx, "replayed");
+        return;
+    }
+
+    TRACE_BEGIN("dispatch");
+    lock_admission_t result = request_unlock(source, &ctx);
+    TRACE_END("dispatch");
+
+    reply_ack(&ctx, admission_status(result));
+
+    if(result == LOCK_COALESCED){
+        int64_t now = esp_timer_get_time();
+        reply_done(&ctx, "extended", now, now);
+    }
+}
+
+/**
+ * @brief Called by the lock task once it has acted on an admitted command.
+ *
+ * @param ctx The command.
+ * @param started_us When the lock task picked it up.
+ * @param done_us When the lock task finished with it.
+ */
+void command_complete(const command_ctx_t* ctx, int64_t started_us, int64_t done_us){
+    reply_done(ctx, "done", started_us, done_us);
+}
@@ -0,0 +1,49 @@
+/**
+ * @file command.h
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Lock commands with correlation ids, acknowledgements and completion reports.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "lock_actuation.h"
+
+#define COMMAND_ID_LENGTH 40
+#define COMMAND_REPLY_TOPIC_LENGTH 96
+
+/* What a command needs carried along to be answered once the lock has acted on it. */
+typedef struct command_ctx{
+    char id[COMMAND_ID_LENGTH];
+    char reply_topic[COMMAND_REPLY_TOPIC_LENGTH];   // MQTT: topic replies are published on
+    uint32_t reply_addr;                            // LAN: IPv4 address replies are sent to, network order
+    uint16_t reply_port;                            // LAN: UDP port replies are sent to, network order
+    uint32_t user;                                  // "user" from a signed command, 0 if none
+    int64_t received_us;
+} command_ctx_t;
+
+void command_init();
+uint32_t command_boot_nonce();
+void command_handle(const char* data, int len, lock_source_t source, const command_ctx_t* origin);
+void command_complete(const command_ctx_t* ctx, int64_t started_us, int64_t done_us);
+bool command_authenticate(const char* data, int* len);
+bool command_id_is_plain(const char* id);
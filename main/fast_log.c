@@ -0,0 +1,209 @@
+/**
+ * @file fast_log.c
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Deferred formatting log. Hot paths store the format pointer and raw arguments; a drain task formats later.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ *
+ *  Each core has its own ring, so writers only ever race with tasks and interrupts on the same core. A writer
+ *  claims a slot with one atomic increment of the ring head, fills it in, and publishes it by storing the slot's
+ *  sequence number last. The drain task is the only reader. When the ring is full the oldest records are
+ *  overwritten and counted as dropped; logging never blocks.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "fast_log.h"
+#include "mqtt.h"
+
+#define RING_SIZE (1 << CONFIG_SMART_LOCK_FAST_LOG_RING_ORDER)
+#define RING_MASK (RING_SIZE - 1)
+#define DRAIN_PERIOD_MS 20
+#define RAW_BATCH_RECORDS 32
+
+typedef struct{
+    volatile uint32_t seq; // index + 1 once the record is complete
+    fast_log_record_t record;
+} log_slot_t;
+
+typedef struct{
+    uint32_t head;
+    uint32_t tail;
+    uint32_t dropped;
+    log_slot_t slots[RING_SIZE];
+} log_ring_t;
+
+static log_ring_t s_rings[portNUM_PROCESSORS];
+
+/**
+ * @brief Stores one record. Safe from any task or ISR. Does not format, lock or block.
+ *
+ * @param level 'E', 'W', 'I' or 'D'.
+ * @param tag Tag string with static storage.
+ * @param fmt Format string with static storage.
+ * @param nargs Number of arguments used.
+ */
+void IRAM_ATTR fast_log_write(char level, const char* tag, const char* fmt, int nargs,
+                              uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3){
+    uint32_t core = xPortGetCoreID();
+    log_ring_t* ring = &s_rings[core];
+
+    uint32_t index = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+    log_slot_t* slot = &ring->slots[index & RING_MASK];
+
+    // Not the cycle count: that wraps every few seconds and differs between the cores, so records from the two
+    // rings could not be put back in order.
+    int64_t now_us = esp_timer_get_time();
+
+    slot->seq = 0;
+    slot->record.time_us = (uint32_t)now_us;
+    slot->record.time_hi = (uint8_t)(now_us >> 32);
+    slot->record.fmt = (uint32_t)fmt;
+    slot->record.tag = (uint32_t)tag;
+    slot->record.level = level;
+    slot->record.nargs = nargs;
+    slot->record.core = core;
+    slot->record.args[0] = a0;
+    slot->record.args[1] = a1;
+    slot->record.args[2] = a2;
+    slot->record.args[3] = a3;
+
+    __atomic_store_n(&slot->seq, index + 1, __ATOMIC_RELEASE);
+}
+
+#ifndef CONFIG_SMART_LOCK_FAST_LOG_RAW_MQTT
+/**
+ * @brief Formats a record and prints it on the console.
+ *
+ * @param record The record.
+ */
+static void emit_text(const fast_log_record_t* record){
+    char message[160];
+
+    snprintf(message, sizeof(message), (const char*)record->fmt,
+             record->args[0], record->args[1], record->args[2], record->args[3]);
+
+    uint64_t time_us = (uint64_t)record->time_hi << 32 | record->time_us;
+
+    printf("%c (%llu) %s: %s\n", record->level, time_us / 1000, (const char*)record->tag, message);
+}
+#else
+static fast_log_record_t s_batch[RAW_BATCH_RECORDS];
+static int s_batch_len = 0;
+
+static void flush_raw(){
+    if(s_batch_len > 0){
+        esp_mqtt_client_publish(client, LOG_TOPIC, (const char*)s_batch, s_batch_len * sizeof(fast_log_record_t), 0, 0);
+        s_batch_len = 0;
+    }
+}
+
+static void emit_raw(const fast_log_record_t* record){
+    s_batch[s_batch_len++] = *record;
+    if(s_batch_len == RAW_BATCH_RECORDS){
+        flush_raw();
+    }
+}
+#endif
+
+/**
+ * @brief Moves every completed record out of a ring.
+ *
+ * @param ring The ring.
+ */
+static void drain_ring(log_ring_t* ring){
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    if(head - ring->tail > RING_SIZE){
+        ring->dropped += head - ring->tail - RING_SIZE;
+        ring->tail = head - RING_SIZE;
+    }
+
+    while(ring->tail != head){
+        log_slot_t* slot = &ring->slots[ring->tail & RING_MASK];
+        uint32_t expected = ring->tail + 1;
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        if(seq != expected){
+            if(seq == 0 || (int32_t)(seq - expected) < 0){
+                break; // still being written, pick it up next time
+            }
+            ring->dropped++; // overwritten by a newer record
+            ring->tail++;
+            continue;
+        }
+
+        fast_log_record_t record = slot->record;
+        if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != expected){
+            ring->dropped++;
+            ring->tail++;
+            continue;
+        }
+        ring->tail++;
+
+#ifdef CONFIG_SMART_LOCK_FAST_LOG_RAW_MQTT
+        emit_raw(&record);
+#else
+        emit_text(&record);
+#endif
+    }
+}
+
+/**
+ * @brief Low priority task that empties the rings.
+ *
+ * @param arg unused
+ */
+static void drain_task(void* arg){
+    uint32_t reported_dropped = 0;
+
+    for(;;){
+        uint32_t dropped = 0;
+
+        for(int core = 0; core < portNUM_PROCESSORS; core++){
+            drain_ring(&s_rings[core]);
+            dropped += s_rings[core].dropped;
+        }
+
+#ifdef CONFIG_SMART_LOCK_FAST_LOG_RAW_MQTT
+        flush_raw();
+#endif
+
+        if(dropped != reported_dropped){
+            printf("W fast_log: %u records dropped\n", dropped - reported_dropped);
+            reported_dropped = dropped;
+        }
+
+        vTaskDelay(pdMS_TO_TICKS(DRAIN_PERIOD_MS));
+    }
+}
+
+/**
+ * @brief Starts the drain task. Records written before this are kept until the ring wraps.
+ *
+ */
+void fast_log_start(){
+    xTaskCreate(drain_task, "fast_log", 3072, NULL, 1, NULL);
+}
@@ -0,0 +1,65 @@
+/**
+ * @file fast_log.h
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Deferred formatting log. Hot paths store the format pointer and raw arguments; a drain task formats later.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "sdkconfig.h"
+
+#define LOG_TOPIC "/mister_nolan/log"
+
+/* Raw record as written to the ring and as published on LOG_TOPIC. Little endian, 32 bytes. tools/decode_log.py
+ * resolves fmt and tag (and any %s argument) against the firmware ELF. */
+typedef struct{
+    uint32_t time_us;   // low 32 bits of esp_timer_get_time(), one clock for both cores
+    uint32_t fmt;       // address of the format string
+    uint32_t tag;       // address of the tag string
+    uint8_t level;      // 'E', 'W', 'I' or 'D'
+    uint8_t nargs;
+    uint8_t core;
+    uint8_t time_hi;    // bits 32-39 of the time, so it only wraps after 12 days
+    uint32_t args[4];
+} fast_log_record_t;
+
+void fast_log_start();
+void fast_log_write(char level, const char* tag, const char* fmt, int nargs,
+                    uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3);
+
+/* Up to four integer or pointer arguments. Strings passed for %s must outlive the drain (literals, static
+ * buffers); floats and 64 bit values are not supported. */
+#define FAST_LOG_NARGS(...) FAST_LOG_NARGS_(0, ##__VA_ARGS__, 4, 3, 2, 1, 0)
+#define FAST_LOG_NARGS_(_0, _1, _2, _3, _4, N, ...) N
+#define FAST_LOG_ARGS(...) FAST_LOG_ARGS_(0, ##__VA_ARGS__, 0, 0, 0, 0)
+#define FAST_LOG_ARGS_(_0, a, b, c, d, ...) (uint32_t)(a), (uint32_t)(b), (uint32_t)(c), (uint32_t)(d)
+
+#define FLOG(level, tag, fmt, ...) \
+    fast_log_write(level, tag, fmt, FAST_LOG_NARGS(__VA_ARGS__), FAST_LOG_ARGS(__VA_ARGS__))
+
+#define FLOGE(tag, fmt, ...) FLOG('E', tag, fmt, ##__VA_ARGS__)
+#define FLOGW(tag, fmt, ...) FLOG('W', tag, fmt, ##__VA_ARGS__)
+#define FLOGI(tag, fmt, ...) FLOG('I', tag, fmt, ##__VA_ARGS__)
+#if CONFIG_LOG_DEFAULT_LEVEL >= 4
+#define FLOGD(tag, fmt, ...) FLOG('D', tag, fmt, ##__VA_ARGS__)
+#else
+#define FLOGD(tag, fmt, ...) do{ }while(0)
+#endif
@@ -0,0 +1,179 @@
+/**
+ * @file jitter_probe.c
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Measures scheduling latency of tasks on the app core.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "sdkconfig.h"
+#include "driver/timer.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "jitter_probe.h"
+#include "trace.h"
+
+#ifdef CONFIG_SMART_LOCK_JITTER_PROBE
+
+#define PROBE_TIMER_GROUP TIMER_GROUP_1
+#define PROBE_TIMER TIMER_0
+#define PROBE_TIMER_DIVIDER 80 // 80 MHz APB clock / 80 = 1 tick per microsecond
+
+static const char *TAG = "JITTER_PROBE";
+
+static TaskHandle_t s_probe_task;
+static volatile int64_t s_alarm_time_us;
+static jitter_stats_t s_stats;
+static portMUX_TYPE s_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * @brief Hardware timer alarm. Records when the alarm fired and wakes the probe task.
+ *
+ * @param arg unused
+ * @return true if a context switch is needed on exit from the ISR.
+ */
+static bool IRAM_ATTR probe_timer_isr(void* arg){
+    TRACE_ISR("jitter_probe");
+
+    BaseType_t high_task_awoken = pdFALSE;
+
+    s_alarm_time_us = esp_timer_get_time();
+    vTaskNotifyGiveFromISR(s_probe_task, &high_task_awoken);
+
+    return high_task_awoken == pdTRUE;
+}
+
+/**
+ * @brief Adds one latency sample to the statistics.
+ *
+ * @param latency_us Time between the timer alarm and the probe task running.
+ */
+static void record_sample(uint32_t latency_us){
+    int bucket;
+    if(latency_us < 10) bucket = 0;
+    else if(latency_us < 50) bucket = 1;
+    else if(latency_us < 100) bucket = 2;
+    else if(latency_us < 500) bucket = 3;
+    else if(latency_us < 1000) bucket = 4;
+    else bucket = 5;
+
+    portENTER_CRITICAL(&s_stats_lock);
+    if(s_stats.samples == 0 || latency_us < s_stats.min_us) s_stats.min_us = latency_us;
+    if(latency_us > s_stats.max_us) s_stats.max_us = latency_us;
+    s_stats.total_us += latency_us;
+    s_stats.samples++;
+    s_stats.buckets[bucket]++;
+    portEXIT_CRITICAL(&s_stats_lock);
+}
+
+/**
+ * @brief Logs the current statistics and starts a new measurement window.
+ *
+ */
+static void report_and_reset(){
+    jitter_stats_t stats;
+
+    portENTER_CRITICAL(&s_stats_lock);
+    stats = s_stats;
+    memset(&s_stats, 0, sizeof(s_stats));
+    portEXIT_CRITICAL(&s_stats_lock);
+
+    if(stats.samples == 0){
+        return;
+    }
+
+    ESP_LOGI(TAG, "n=%u min=%uus avg=%uus max=%uus | <10us:%u <50us:%u <100us:%u <500us:%u <1ms:%u >=1ms:%u",
+             stats.samples, stats.min_us, (uint32_t)(stats.total_us / stats.samples), stats.max_us,
+             stats.buckets[0], stats.buckets[1], stats.buckets[2],
+             stats.buckets[3], stats.buckets[4], stats.buckets[5]);
+}
+
+/**
+ * @brief   Runs on the app core at the actuation priority. The timer ISR is installed from this task so that it
+ *          is also serviced on the app core, so the measured latency is what the actuation task would see.
+ *
+ * @param arg unused
+ */
+static void probe_task(void* arg){
+    timer_config_t config = {
+        .divider = PROBE_TIMER_DIVIDER,
+        .counter_dir = TIMER_COUNT_UP,
+        .counter_en = TIMER_PAUSE,
+        .alarm_en = TIMER_ALARM_EN,
+        .auto_reload = TIMER_AUTORELOAD_EN,
+    };
+
+    s_probe_task = xTaskGetCurrentTaskHandle();
+
+    ESP_ERROR_CHECK(timer_init(PROBE_TIMER_GROUP, PROBE_TIMER, &config));
+    ESP_ERROR_CHECK(timer_set_counter_value(PROBE_TIMER_GROUP, PROBE_TIMER, 0));
+    ESP_ERROR_CHECK(timer_set_alarm_value(PROBE_TIMER_GROUP, PROBE_TIMER, CONFIG_SMART_LOCK_JITTER_PROBE_PERIOD_MS * 1000));
+    ESP_ERROR_CHECK(timer_enable_intr(PROBE_TIMER_GROUP, PROBE_TIMER));
+    ESP_ERROR_CHECK(timer_isr_callback_add(PROBE_TIMER_GROUP, PROBE_TIMER, probe_timer_isr, NULL, 0));
+    ESP_ERROR_CHECK(timer_start(PROBE_TIMER_GROUP, PROBE_TIMER));
+
+    int64_t next_report_us = esp_timer_get_time() + CONFIG_SMART_LOCK_JITTER_PROBE_REPORT_S * 1000000LL;
+
+    for(;;){
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        int64_t now = esp_timer_get_time();
+
+        record_sample((uint32_t)(now - s_alarm_time_us));
+
+        if(now >= next_report_us){
+            report_and_reset();
+            next_report_us = now + CONFIG_SMART_LOCK_JITTER_PROBE_REPORT_S * 1000000LL;
+        }
+    }
+}
+
+/**
+ * @brief Starts the jitter probe task on the app core.
+ *
+ */
+void jitter_probe_start(){
+    xTaskCreatePinnedToCore(probe_task, "jitter_probe", 3072, NULL, CONFIG_SMART_LOCK_ACTUATION_TASK_PRIORITY,
+                            NULL, CONFIG_SMART_LOCK_APP_CORE);
+}
+
+/**
+ * @brief Copies the statistics for the current measurement window.
+ *
+ * @param stats Where the statistics are copied to.
+ */
+void jitter_probe_get_stats(jitter_stats_t* stats){
+    portENTER_CRITICAL(&s_stats_lock);
+    *stats = s_stats;
+    portEXIT_CRITICAL(&s_stats_lock);
+}
+
+#else
+
+void jitter_probe_start(){
+}
+
+void jitter_probe_get_stats(jitter_stats_t* stats){
+    memset(stats, 0, sizeof(*stats));
+}
+
+#endif
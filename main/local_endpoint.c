@@ -0,0 +1,171 @@
+/**
+ * @file local_endpoint.c
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief LAN command endpoint: signed commands over UDP, advertised over mDNS.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ *
+ *  A phone or hub on the same network can unlock without going through the broker, which is faster and still
+ *  works while the uplink is down. Each command is one UDP datagram, in the same signed format as MQTT commands
+ *  (see command.c), and goes through the same admission and actuation path under LOCK_SOURCE_LOCAL. The ack and
+ *  completion are sent back as datagrams to the address and port the command came from. Malformed, unsigned and
+ *  replayed datagrams get no reply, so a forged source address cannot turn the lock into a reflector.
+ *
+ *  The lock advertises itself over mDNS as smart-lock-xxxxxx.local with a _smartlock._udp service. The TXT
+ *  record carries the boot nonce signed commands need, so a LAN client never has to reach the broker.
+ *
+ *  Nothing is started unless CONFIG_SMART_LOCK_COMMAND_KEY is set, since only signed commands are accepted here.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_mac.h"
+#include "esp_log.h"
+#include "mdns.h"
+
+#include "lwip/sockets.h"
+
+#include "command.h"
+#include "trace.h"
+#include "local_endpoint.h"
+
+#define LOCAL_MAX_DATAGRAM 512
+
+static const char *TAG = "LOCAL_ENDPOINT";
+
+static int s_socket = -1;
+
+/**
+ * @brief Receives command datagrams and hands them to the command handler.
+ *
+ * @param arg unused
+ */
+static void endpoint_task(void* arg){
+    char buffer[LOCAL_MAX_DATAGRAM];
+    struct sockaddr_in from;
+    socklen_t from_length;
+
+    for(;;){
+        from_length = sizeof(from);
+        int length = recvfrom(s_socket, buffer, sizeof(buffer), 0, (struct sockaddr*)&from, &from_length);
+        int64_t received_us = esp_timer_get_time();
+
+        if(length <= 0 || from.sin_family != AF_INET){
+            continue;
+        }
+
+        command_ctx_t origin = {
+            .reply_addr = from.sin_addr.s_addr,
+            .reply_port = from.sin_port,
+            .received_us = received_us,
+        };
+
+        TRACE_BEGIN("lan_rx");
+        command_handle(buffer, length, LOCK_SOURCE_LOCAL, &origin);
+        TRACE_END("lan_rx");
+    }
+}
+
+/**
+ * @brief Advertises the endpoint over mDNS.
+ *
+ */
+static void advertise(){
+    uint8_t mac[6];
+    char hostname[24];
+    char nonce[9];
+
+    esp_read_mac(mac, ESP_MAC_WIFI_STA);
+    snprintf(hostname, sizeof(hostname), "smart-lock-%02x%02x%02x", mac[3], mac[4], mac[5]);
+    snprintf(nonce, sizeof(nonce), "%08x", command_boot_nonce());
+
+    mdns_txt_item_t txt[] = {
+        {"boot", nonce},
+        {"v", "1"},
+    };
+
+    if(mdns_init() != ESP_OK){
+        ESP_LOGE(TAG, "mDNS not started");
+        return;
+    }
+    mdns_hostname_set(hostname);
+    mdns_instance_name_set("Smart lock");
+    mdns_service_add(NULL, LOCAL_ENDPOINT_SERVICE, LOCAL_ENDPOINT_PROTO, CONFIG_SMART_LOCK_LOCAL_PORT,
+                     txt, sizeof(txt) / sizeof(txt[0]));
+
+    ESP_LOGI(TAG, "advertised as %s.local port %d", hostname, CONFIG_SMART_LOCK_LOCAL_PORT);
+}
+
+/**
+ * @brief Opens the UDP socket, advertises it and starts the receive task. Wi-Fi must already be started.
+ *
+ */
+void local_endpoint_start(){
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(CONFIG_SMART_LOCK_LOCAL_PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+
+    if(sizeof(CONFIG_SMART_LOCK_COMMAND_KEY) <= 1){
+        ESP_LOGW(TAG, "no command key set, LAN endpoint disabled");
+        return;
+    }
+
+    s_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(s_socket < 0 || bind(s_socket, (struct sockaddr*)&address, sizeof(address)) != 0){
+        ESP_LOGE(TAG, "cannot bind UDP port %d", CONFIG_SMART_LOCK_LOCAL_PORT);
+        if(s_socket >= 0){
+            close(s_socket);
+            s_socket = -1;
+        }
+        return;
+    }
+
+    advertise();
+
+    xTaskCreatePinnedToCore(endpoint_task, "lan_endpoint", 4096, NULL, CONFIG_SMART_LOCK_LOCAL_TASK_PRIORITY,
+                            NULL, CONFIG_SMART_LOCK_NETWORK_CORE);
+}
+
+/**
+ * @brief   Sends a reply datagram. Does not wait for buffer space, so it is safe to call from the lock task; a reply
+ *          that does not fit is dropped, like any other lost datagram.
+ *
+ * @param addr IPv4 address, network order.
+ * @param port UDP port, network order.
+ * @param payload The reply text.
+ */
+void local_endpoint_send(uint32_t addr, uint16_t port, const char* payload){
+    struct sockaddr_in to = {
+        .sin_family = AF_INET,
+        .sin_port = port,
+        .sin_addr.s_addr = addr,
+    };
+
+    if(s_socket < 0){
+        return;
+    }
+
+    sendto(s_socket, payload, strlen(payload), MSG_DONTWAIT, (struct sockaddr*)&to, sizeof(to));
+}
@@ -0,0 +1,32 @@
+/**
+ * @file local_endpoint.h
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief LAN command endpoint: signed commands over UDP, advertised over mDNS.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define LOCAL_ENDPOINT_SERVICE "_smartlock"
+#define LOCAL_ENDPOINT_PROTO "_udp"
+
+void local_endpoint_start();
+void local_endpoint_send(uint32_t addr, uint16_t port, const char* payload);
@@ -22,52 +22,562 @@
  */
 #include <stdio.h>
 
-#include "driver/mcpwm.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_timer.h"
+#include "esp_log.h"
 
-#include "HD44780.h"
+#include "fast_log.h"
+#include "status_display.h"
+#include "telemetry.h"
+#include "warm_boot.h"
+#include "trace.h"
 #include "smart_lock_utils.h"
+#include "timer_service.h"
+#include "lock_config.h"
 #include "lock_actuation.h"
+#include "command.h"
+#include "actuator.h"
+#include "audit_log.h"
+#include "access_schedule.h"
 
+#define LOCK_QUEUE_LENGTH 4
+
+typedef enum{
+    LOCK_REQUEST_UNLOCK,
+    LOCK_REQUEST_RELOCK,
+    LOCK_REQUEST_BENCHMARK,
+    LOCK_REQUEST_SCHEDULE
+} lock_request_type_t;
+
+typedef struct{
+    lock_request_type_t type;
+    bool has_command;       // true if command holds a command to report completion for
+    command_ctx_t command;
+    int64_t queued_us;      // LOCK_REQUEST_BENCHMARK: when the request was queued
+    TaskHandle_t waiter;    // LOCK_REQUEST_BENCHMARK: notified with the sequence when done
+    uint32_t sequence;      // LOCK_REQUEST_BENCHMARK: tells the answer apart from a late one to an earlier request
+} lock_request_t;
+
+/* Where the lock is, as far as admission is concerned. */
+typedef enum{
+    ADMIT_CLOSED,
+    ADMIT_UNLOCK_QUEUED,
+    ADMIT_OPEN
+} admit_state_t;
+
+/* Token bucket, in thousandths of a token so that slow refill rates do not round away. */
+typedef struct{
+    int32_t burst_milli;
+    int32_t per_minute;
+    int32_t tokens_milli;
+    int64_t last_refill_us;
+} token_bucket_t;
+
+static const char *TAG = "LOCK_ACTUATION";
+
+static QueueHandle_t s_lock_queue;
+static soft_timer_t s_relock_timer;
+
+static portMUX_TYPE s_admit_lock = portMUX_INITIALIZER_UNLOCKED;
+static admit_state_t s_admit_state = ADMIT_CLOSED;
+static int64_t s_open_until_us = 0;
+static bool s_held = false;     // held open by a passage window; the relock waits until it ends
+static lock_source_t s_last_actor = LOCK_SOURCE_MQTT;
+static lock_state_t s_restored_state = CLOSED;
+static lock_admission_stats_t s_stats;
+static token_bucket_t s_buckets[LOCK_SOURCE_COUNT] = {
+    [LOCK_SOURCE_MQTT] = {CONFIG_SMART_LOCK_RATE_MQTT_BURST * 1000, CONFIG_SMART_LOCK_RATE_MQTT_PER_MINUTE,
+                          CONFIG_SMART_LOCK_RATE_MQTT_BURST * 1000, 0},
+    [LOCK_SOURCE_BUTTON] = {CONFIG_SMART_LOCK_RATE_BUTTON_BURST * 1000, CONFIG_SMART_LOCK_RATE_BUTTON_PER_MINUTE,
+                            CONFIG_SMART_LOCK_RATE_BUTTON_BURST * 1000, 0},
+    [LOCK_SOURCE_LOCAL] = {CONFIG_SMART_LOCK_RATE_LOCAL_BURST * 1000, CONFIG_SMART_LOCK_RATE_LOCAL_PER_MINUTE,
+                           CONFIG_SMART_LOCK_RATE_LOCAL_BURST * 1000, 0},
+};
+
+static const char* const s_source_names[LOCK_SOURCE_COUNT] = {"mqtt", "button", "local"};
+
+#if CONFIG_SMART_LOCK_ACTUATOR_STEPPER
+static const lock_actuator_t* const s_actuator = &lock_actuator_stepper;
+#elif CONFIG_SMART_LOCK_ACTUATOR_SOLENOID
+static const lock_actuator_t* const s_actuator = &lock_actuator_solenoid;
+#else
+static const lock_actuator_t* const s_actuator = &lock_actuator_servo;
+#endif
+
+static portMUX_TYPE s_timing_lock = portMUX_INITIALIZER_UNLOCKED;
+static lock_actuation_timing_t s_timing;
+
+/* Only touched by the lock task once it is running. */
+static lock_state_t s_state = CLOSED;
+static uint32_t s_benchmark_queue_us;
+static uint32_t s_benchmark_call_us;
+static uint32_t s_benchmark_sequence = 0;   // only touched by the benchmarking task
+
+/**
+ * @brief Moves the bolt through the configured actuator and records how long the actuator took.
+ *
+ * @param state Where to move the bolt.
+ */
 void set_lock_state(lock_state_t state){
-    if(state == OPEN){
-        mcpwm_set_duty(MCPWM_UNIT_0, MCPWM_TIMER_0, MCPWM_GEN_A, DUTY_CYCLE_OPEN_STATE);
-    }else if(state == CLOSED){
-        mcpwm_set_duty(MCPWM_UNIT_0, MCPWM_TIMER_0, MCPWM_GEN_A, DUTY_CYCLE_CLOSED_STATE);
+    if(state != OPEN && state != CLOSED){
+        return;
+    }
+
+    TRACE_BEGIN("set_lock_state");
+    int64_t start = esp_timer_get_time();
+    s_actuator->set(state);
+    uint32_t elapsed = esp_timer_get_time() - start;
+    TRACE_END("set_lock_state");
+
+    s_state = state;
+
+    portENTER_CRITICAL(&s_timing_lock);
+    s_timing.count++;
+    s_timing.last_us = elapsed;
+    s_timing.total_us += elapsed;
+    if(elapsed > s_timing.max_us){
+        s_timing.max_us = elapsed;
     }
+    portEXIT_CRITICAL(&s_timing_lock);
 }
 
+/**
+ * @brief   Takes over the actuator. After a warm boot the bolt is left where it was, as far as the actuator allows;
+ *          otherwise it is closed.
+ * 
+ */
 void init_lock_motor(){
-    mcpwm_gpio_init(MCPWM_UNIT_0, MCPWM0A, 33);
-    mcpwm_config_t config;
-    config.frequency = 50;
-    config.cmpr_a = 10;
-    config.cmpr_b = 10;
-    config.duty_mode = MCPWM_DUTY_MODE_0;
-    config.counter_mode = MCPWM_UP_COUNTER;
+    const warm_boot_snapshot_t* restored = warm_boot_restored();
+    lock_state_t state = restored != NULL ? (lock_state_t)restored->lock_state : CLOSED;
 
-    mcpwm_init(MCPWM_UNIT_0, MCPWM_TIMER_0, &config);
+    s_timing.actuator = s_actuator->name;
+    s_actuator->init(state, restored != NULL);
+    s_state = state;
+
+    s_restored_state = state;
+}
 
+/**
+ * @brief Closes the lock and shows it on the LCD. 
+ * 
+ */
+static void relock(){
     set_lock_state(CLOSED);
+
+    status_display_show("locked", NULL);
+
+    telemetry_set_lock_state(true, "auto");
+
+    audit_log_append(AUDIT_EVENT_RELOCK, AUDIT_SOURCE_AUTO, 0, 0);
 }
 
-void unlock(){
-    lcd_clear_display();
+/**
+ * @brief   Opens the lock and arms the relock timer. Does not block; the lock closes again after the configured hold time. 
+ *          Unlocking while already open restarts the hold time.
+ * 
+ * @param command The command that asked for it, or NULL. Its user is shown as the actor on the LCD.
+ */
+void unlock(const command_ctx_t* command){
+    char actor_line[LCD_LINE_LENGTH + 1];
 
-    lcd_set_cursor_location(0, 4);
+    portENTER_CRITICAL(&s_admit_lock);
+    lock_source_t actor = s_last_actor;
+    portEXIT_CRITICAL(&s_admit_lock);
 
-    lcd_print_string("unlocked");
+    if(command != NULL && command->user != 0){
+        snprintf(actor_line, sizeof(actor_line), "by user %u", command->user);
+    }else{
+        snprintf(actor_line, sizeof(actor_line), "by %s", lock_source_name(actor));
+    }
+    status_display_show("unlocked", actor_line);
     
     set_lock_state(OPEN);
 
-    delay_ms(4000);
+    uint32_t hold_ms;
+    LOCK_CONFIG_GET(hold_ms, unlock_hold_ms);
 
-    set_lock_state(CLOSED);
+    portENTER_CRITICAL(&s_admit_lock);
+    s_admit_state = ADMIT_OPEN;
+    s_open_until_us = esp_timer_get_time() + hold_ms * 1000LL;
+    portEXIT_CRITICAL(&s_admit_lock);
+
+    telemetry_set_lock_state(false, lock_source_name(actor));
+
+    if(!soft_timer_start_once(&s_relock_timer, hold_ms * 1000ULL)){
+        // Without a timer the lock must not be left open.
+        delay_ms(hold_ms);
+        portENTER_CRITICAL(&s_admit_lock);
+        s_admit_state = ADMIT_CLOSED;
+        portEXIT_CRITICAL(&s_admit_lock);
+        relock();
+    }
+}
+
+/**
+ * @brief   Handles the relock timer on the lock task. Unlocks admitted while the lock was open only moved
+ *          s_open_until_us, so the timer may have fired early; if so it is re-armed for the rest of the window.
+ *
+ */
+static void relock_if_due(){
+    int64_t remaining_us;
+
+    portENTER_CRITICAL(&s_admit_lock);
+    if(s_held){
+        // release_hold() relocks once the passage window ends.
+        portEXIT_CRITICAL(&s_admit_lock);
+        return;
+    }
+    remaining_us = s_open_until_us - esp_timer_get_time();
+    if(remaining_us <= 0){
+        s_admit_state = ADMIT_CLOSED;
+    }
+    portEXIT_CRITICAL(&s_admit_lock);
+
+    if(remaining_us > 0){
+        if(soft_timer_start_once(&s_relock_timer, remaining_us)){
+            return;
+        }
+        portENTER_CRITICAL(&s_admit_lock);
+        s_admit_state = ADMIT_CLOSED;
+        portEXIT_CRITICAL(&s_admit_lock);
+    }
+
+    relock();
+}
+
+/**
+ * @brief   Holds the lock open for a passage window. Unlocks during the window are coalesced as usual, and the relock
+ *          timer leaves the lock open until release_hold().
+ *
+ */
+static void hold_open(){
+    portENTER_CRITICAL(&s_admit_lock);
+    bool was_held = s_held;
+    s_held = true;
+    s_admit_state = ADMIT_OPEN;
+    portEXIT_CRITICAL(&s_admit_lock);
+
+    if(was_held){
+        return;
+    }
+
+    set_lock_state(OPEN);
+
+    status_display_show("unlocked", "by schedule");
+
+    telemetry_set_lock_state(false, "schedule");
+
+    audit_log_append(AUDIT_EVENT_UNLOCK, AUDIT_SOURCE_SCHEDULE, LOCK_ADMITTED, 0);
+}
+
+/**
+ * @brief   Ends a passage window. The lock closes now, unless someone unlocked near the end of the window, in which
+ *          case they still get their hold time.
+ *
+ */
+static void release_hold(){
+    portENTER_CRITICAL(&s_admit_lock);
+    bool was_held = s_held;
+    s_held = false;
+    portEXIT_CRITICAL(&s_admit_lock);
+
+    if(was_held){
+        relock_if_due();
+    }
+}
+
+/**
+ * @brief Relock timer callback. Runs on the timer service task, so it only hands the work to the lock task.
+ * 
+ * @param arg unused
+ */
+static void relock_timer_callback(void* arg){
+    lock_request_t request = {
+        .type = LOCK_REQUEST_RELOCK,
+    };
+
+    if(xQueueSend(s_lock_queue, &request, 0) != pdTRUE){
+        // Queue is full of unlock requests; try again shortly rather than losing the relock.
+        soft_timer_start_once(&s_relock_timer, 100 * 1000);
+    }
+}
+
+/**
+ * @brief   Performs queued lock requests. This is the only task that touches the lock motor once the lock has been
+ *          initialized, so it is pinned to the app core away from the network stack.
+ *
+ * @param arg unused
+ */
+static void lock_task(void* arg){
+    lock_request_t request;
+
+    for(;;){
+        if(xQueueReceive(s_lock_queue, &request, portMAX_DELAY) != pdTRUE){
+            continue;
+        }
+
+        if(request.type == LOCK_REQUEST_UNLOCK){
+            int64_t started_us = esp_timer_get_time();
+            unlock(request.has_command ? &request.command : NULL);
+            if(request.has_command){
+                command_complete(&request.command, started_us, esp_timer_get_time());
+            }
+        }else if(request.type == LOCK_REQUEST_RELOCK){
+            relock_if_due();
+        }else if(request.type == LOCK_REQUEST_SCHEDULE){
+            access_passage_t passage = access_schedule_evaluate();
+            if(passage == ACCESS_PASSAGE_OPEN){
+                hold_open();
+            }else if(passage == ACCESS_PASSAGE_CLOSED){
+                release_hold();
+            }
+        }else if(request.type == LOCK_REQUEST_BENCHMARK){
+            // Re-applies the current state, so the bolt stays where it is, and stays out of the actuation timings.
+            int64_t started_us = esp_timer_get_time();
+            s_actuator->set(s_state);
+            int64_t done_us = esp_timer_get_time();
+
+            s_benchmark_queue_us = started_us - request.queued_us;
+            s_benchmark_call_us = done_us - started_us;
+            xTaskNotify(request.waiter, request.sequence, eSetValueWithOverwrite);
+        }
+    }
+}
+
+/**
+ * @brief Creates the lock request queue and starts the actuation task. A lock that was open before a warm boot
+ *        is closed by the task straight away.
+ *
+ */
+void lock_task_start(){
+    s_lock_queue = xQueueCreate(LOCK_QUEUE_LENGTH, sizeof(lock_request_t));
+
+    soft_timer_init(&s_relock_timer, relock_timer_callback, NULL);
+
+    xTaskCreatePinnedToCore(lock_task, "lock", 4096, NULL, CONFIG_SMART_LOCK_ACTUATION_TASK_PRIORITY,
+                            NULL, CONFIG_SMART_LOCK_APP_CORE);
+
+    if(s_restored_state == OPEN){
+        // Reset while open: the relock timer was lost with the rest of the run. Close now rather than granting
+        // another hold time, which a reset loop could otherwise renew forever. An unlock that arrives before the
+        // relock is done still extends the window as usual.
+        lock_request_t request = {
+            .type = LOCK_REQUEST_RELOCK,
+        };
+
+        portENTER_CRITICAL(&s_admit_lock);
+        s_admit_state = ADMIT_OPEN;
+        s_open_until_us = esp_timer_get_time();
+        portEXIT_CRITICAL(&s_admit_lock);
+
+        xQueueSend(s_lock_queue, &request, portMAX_DELAY);
+    }
+}
+
+/**
+ * @brief Takes a token from a source's bucket, refilling it for the time since the last take.
+ *
+ * @param bucket The bucket. Must be called with s_admit_lock held.
+ * @param now_us The current time.
+ * @return true if a token was available.
+ */
+static bool take_token(token_bucket_t* bucket, int64_t now_us){
+    if(bucket->last_refill_us != 0){
+        // per_minute tokens per 60e6 us is per_minute / 60000 thousandths of a token per us.
+        int64_t refill = (now_us - bucket->last_refill_us) * bucket->per_minute / 60000;
+        bucket->tokens_milli = refill >= bucket->burst_milli - bucket->tokens_milli
+                               ? bucket->burst_milli : bucket->tokens_milli + (int32_t)refill;
+    }
+    bucket->last_refill_us = now_us;
+
+    if(bucket->tokens_milli < 1000){
+        return false;
+    }
+
+    bucket->tokens_milli -= 1000;
+    return true;
+}
 
-    lcd_clear_display();
+/**
+ * @brief   Asks the actuation task to unlock. Does not block. The user, 0 for the button and for commands without
+ *          one, must be inside their access schedule. Each source is rate limited by its own token bucket. An unlock
+ *          that arrives while the lock is open, or while an unlock is already queued, does not start another
+ *          actuator cycle; it extends the open window instead.
+ *
+ * @param source Where the request came from.
+ * @param command   The command that asked for the unlock, to report its completion once the lock has opened. NULL if
+ *                  there is nothing to report.
+ * @return lock_admission_t What happened to the request.
+ */
+lock_admission_t request_unlock(lock_source_t source, const command_ctx_t* command){
+    lock_admission_t result;
+    int64_t now_us = esp_timer_get_time();
+    uint32_t user = command != NULL ? command->user : 0;
+
+    if(source >= LOCK_SOURCE_COUNT){
+        return LOCK_RATE_LIMITED;
+    }
+
+    // One bit test against the compiled schedule, before the request can use up a token. The button is inside
+    // the door, so it is never held to a schedule; it must work before SNTP has set the clock, too.
+    if(source != LOCK_SOURCE_BUTTON && !access_schedule_allows(user)){
+        portENTER_CRITICAL(&s_admit_lock);
+        s_stats.denied[source]++;
+        portEXIT_CRITICAL(&s_admit_lock);
 
-    lcd_set_cursor_location(0, 5);
+        FLOGW(TAG, "unlock from %s outside schedule", s_source_names[source]);
+        audit_log_reject(AUDIT_EVENT_UNLOCK, source, LOCK_DENIED, user);
+        return LOCK_DENIED;
+    }
+
+    // Read before taking the admission lock, which must not be held across another one.
+    uint32_t hold_ms;
+    LOCK_CONFIG_GET(hold_ms, unlock_hold_ms);
+
+    portENTER_CRITICAL(&s_admit_lock);
+    if(!take_token(&s_buckets[source], now_us)){
+        result = LOCK_RATE_LIMITED;
+        s_stats.rate_limited[source]++;
+    }else if(s_admit_state == ADMIT_CLOSED){
+        result = LOCK_ADMITTED;
+        s_admit_state = ADMIT_UNLOCK_QUEUED;
+        s_last_actor = source;
+    }else{
+        // The relock check in relock_if_due() honours the new deadline.
+        result = LOCK_COALESCED;
+        int64_t open_until_us = now_us + hold_ms * 1000LL;
+        if(s_admit_state == ADMIT_OPEN && open_until_us > s_open_until_us){
+            s_open_until_us = open_until_us;
+        }
+        s_stats.coalesced[source]++;
+    }
+    portEXIT_CRITICAL(&s_admit_lock);
 
-    lcd_print_string("locked");
-}
\ No newline at end of file
+    if(result == LOCK_ADMITTED){
+        lock_request_t request = {
+            .type = LOCK_REQUEST_UNLOCK,
+            .has_command = command != NULL,
+        };
+
+        if(command != NULL){
+            request.command = *command;
+        }
+
+        if(xQueueSend(s_lock_queue, &request, 0) != pdTRUE){
+            portENTER_CRITICAL(&s_admit_lock);
+            s_admit_state = ADMIT_CLOSED;
+            s_stats.queue_full[source]++;
+            portEXIT_CRITICAL(&s_admit_lock);
+
+            ESP_LOGW(TAG, "unlock request dropped, queue full");
+            audit_log_append(AUDIT_EVENT_UNLOCK, source, LOCK_QUEUE_FULL, user);
+            return LOCK_QUEUE_FULL;
+        }
+
+        portENTER_CRITICAL(&s_admit_lock);
+        s_stats.admitted[source]++;
+        portEXIT_CRITICAL(&s_admit_lock);
+    }else if(result == LOCK_RATE_LIMITED){
+        FLOGW(TAG, "unlock from %s rate limited", s_source_names[source]);
+    }else{
+        FLOGD(TAG, "unlock from %s coalesced", s_source_names[source]);
+    }
+
+    if(result == LOCK_RATE_LIMITED){
+        audit_log_reject(AUDIT_EVENT_UNLOCK, source, result, user);
+    }else{
+        audit_log_append(AUDIT_EVENT_UNLOCK, source, result, user);
+    }
+
+    return result;
+}
+
+/**
+ * @brief Copies the admission counters.
+ *
+ * @param stats Where to copy them.
+ */
+void lock_admission_get_stats(lock_admission_stats_t* stats){
+    portENTER_CRITICAL(&s_admit_lock);
+    *stats = s_stats;
+    portEXIT_CRITICAL(&s_admit_lock);
+}
+
+/**
+ * @brief Name of a request source, for logs and reports.
+ *
+ * @param source The source.
+ * @return const char* The name.
+ */
+const char* lock_source_name(lock_source_t source){
+    return source < LOCK_SOURCE_COUNT ? s_source_names[source] : "unknown";
+}
+
+/**
+ * @brief Copies the actuation timings for the configured actuator.
+ *
+ * @param timing Where to copy them.
+ */
+void lock_actuation_get_timing(lock_actuation_timing_t* timing){
+    portENTER_CRITICAL(&s_timing_lock);
+    *timing = s_timing;
+    portEXIT_CRITICAL(&s_timing_lock);
+}
+
+/**
+ * @brief   Times one pass through the lock task: from queueing a request until the lock task picks it up, and the
+ *          actuator call it then makes. The call re-applies the current state, so the bolt does not move. Blocks the
+ *          caller, and uses its task notification.
+ *
+ * @param queue_us Receives the time spent queued.
+ * @param call_us Receives the time spent in the actuator driver.
+ * @return true if the lock task answered.
+ */
+bool lock_actuation_benchmark(uint32_t* queue_us, uint32_t* call_us){
+    lock_request_t request = {
+        .type = LOCK_REQUEST_BENCHMARK,
+        .waiter = xTaskGetCurrentTaskHandle(),
+        .sequence = ++s_benchmark_sequence,
+    };
+    uint32_t answered = 0;
+    TimeOut_t timeout;
+    TickType_t wait = pdMS_TO_TICKS(2000);
+
+    xTaskNotifyStateClear(NULL);
+    request.queued_us = esp_timer_get_time();
+    if(xQueueSend(s_lock_queue, &request, pdMS_TO_TICKS(100)) != pdTRUE){
+        return false;
+    }
+
+    // A request that timed out earlier can still be answered late. The lock task takes requests in order, so
+    // once this one is answered no late answer can overwrite the timings.
+    vTaskSetTimeOutState(&timeout);
+    do{
+        if(xTaskNotifyWait(0, 0, &answered, wait) != pdTRUE){
+            return false;
+        }
+    }while(answered != request.sequence && xTaskCheckForTimeOut(&timeout, &wait) == pdFALSE);
+    if(answered != request.sequence){
+        return false;
+    }
+
+    *queue_us = s_benchmark_queue_us;
+    *call_us = s_benchmark_call_us;
+    return true;
+}
+
+/**
+ * @brief   Asks the lock task to apply the access schedule's passage windows: hold the lock open if one has started,
+ *          relock if one has ended. Does not block.
+ *
+ * @return true if the request was queued.
+ */
+bool request_schedule_check(){
+    lock_request_t request = {
+        .type = LOCK_REQUEST_SCHEDULE,
+    };
+
+    return s_lock_queue != NULL && xQueueSend(s_lock_queue, &request, 0) == pdTRUE;
+}
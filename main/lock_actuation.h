@@ -22,14 +22,56 @@
  */
 #pragma once
 
-#define DUTY_CYCLE_OPEN_STATE 9.5
-#define DUTY_CYCLE_CLOSED_STATE 2.5
+#include <stdbool.h>
+#include <stdint.h>
+
+struct command_ctx;
 
 typedef enum{
     OPEN,
     CLOSED
 } lock_state_t;
 
-void unlock();
+/* Where an actuation request came from. Each source has its own rate limit. */
+typedef enum{
+    LOCK_SOURCE_MQTT,
+    LOCK_SOURCE_BUTTON,
+    LOCK_SOURCE_LOCAL,
+    LOCK_SOURCE_COUNT
+} lock_source_t;
+
+typedef enum{
+    LOCK_ADMITTED,      // queued for the actuation task
+    LOCK_COALESCED,     // the lock is already open or opening; the open window was extended instead
+    LOCK_RATE_LIMITED,  // the source's token bucket was empty
+    LOCK_QUEUE_FULL,    // admitted but the actuation queue had no room
+    LOCK_DENIED         // outside the user's access schedule
+} lock_admission_t;
+
+typedef struct{
+    uint32_t admitted[LOCK_SOURCE_COUNT];
+    uint32_t coalesced[LOCK_SOURCE_COUNT];
+    uint32_t rate_limited[LOCK_SOURCE_COUNT];
+    uint32_t queue_full[LOCK_SOURCE_COUNT];
+    uint32_t denied[LOCK_SOURCE_COUNT];
+} lock_admission_stats_t;
+
+/* Time spent in the actuator driver per set_lock_state(). See actuator.h for what each driver counts. */
+typedef struct{
+    const char* actuator;
+    uint32_t count;
+    uint32_t last_us;
+    uint32_t max_us;
+    uint64_t total_us;
+} lock_actuation_timing_t;
+
+void unlock(const struct command_ctx* command);
 void init_lock_motor();
-void set_lock_state(lock_state_t state);
\ No newline at end of file
+void set_lock_state(lock_state_t state);
+void lock_task_start();
+lock_admission_t request_unlock(lock_source_t source, const struct command_ctx* command);
+void lock_admission_get_stats(lock_admission_stats_t* stats);
+const char* lock_source_name(lock_source_t source);
+void lock_actuation_get_timing(lock_actuation_timing_t* timing);
+bool lock_actuation_benchmark(uint32_t* queue_us, uint32_t* call_us);
+bool request_schedule_check();
\ No newline at end of file
@@ -0,0 +1,465 @@
+/**
+ * @file lock_config.c
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Runtime configuration, stored as one versioned NVS blob and cached in RAM.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ *
+ *  The configuration is read from NVS once at boot. Everything else copies the fields it needs out of the RAM
+ *  copy with LOCK_CONFIG_GET(), so no NVS access happens outside of boot and updates. Updates are built in a
+ *  scratch buffer and written to NVS, and only then copied over the RAM copy. Readers and that copy take the
+ *  same spinlock, so a reader never sees a half applied update, however close together updates arrive.
+ *
+ *  A blob stored by an older image is migrated in RAM at boot, but only written back in the new layout once the
+ *  running image is confirmed (lock_config_commit_migration()). Until then the old blob stays in NVS, so an image
+ *  that gets rolled back still finds the configuration it can read.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cJSON.h"
+#include "esp_crc.h"
+#include "esp_log.h"
+#include "nvs.h"
+#include "nvs_flash.h"
+#include "driver/gpio.h"
+#include "freertos/FreeRTOS.h"
+
+#include "lock_config.h"
+
+#define NVS_NAMESPACE "smart_lock"
+#define NVS_CONFIG_KEY "config"
+
+/* Layouts of older versions, kept for migrate(). */
+typedef struct{
+    uint16_t version;
+    uint16_t size;
+    char wifi_ssid[33];
+    char wifi_password[65];
+    char broker_uri[128];
+    char command_topic[64];
+    char event_topic[64];
+    float duty_cycle_open;
+    float duty_cycle_closed;
+    uint32_t unlock_hold_ms;
+    uint8_t button_pin;
+    uint32_t crc;
+} lock_config_v1_t;
+
+typedef struct{
+    uint16_t version;
+    uint16_t size;
+    char wifi_ssid[33];
+    char wifi_password[65];
+    char broker_uris[LOCK_CONFIG_MAX_BROKERS][LOCK_CONFIG_URI_LENGTH];
+    char command_topic[64];
+    char event_topic[64];
+    float duty_cycle_open;
+    float duty_cycle_closed;
+    uint32_t unlock_hold_ms;
+    uint8_t button_pin;
+    uint32_t crc;
+} lock_config_v2_t;
+
+static const char *TAG = "LOCK_CONFIG";
+
+static lock_config_t s_config;
+static portMUX_TYPE s_config_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool s_migrated = false; // the RAM copy was migrated and NVS still holds the old layout
+
+static uint32_t config_crc(const void* blob, size_t len){
+    return esp_crc32_le(0, blob, len - sizeof(uint32_t));
+}
+
+static void set_defaults(lock_config_t* config){
+    memset(config, 0, sizeof(*config));
+
+    config->version = LOCK_CONFIG_VERSION;
+    config->size = sizeof(lock_config_t);
+    strlcpy(config->wifi_networks[0].ssid, DEFAULT_WIFI_SSID, sizeof(config->wifi_networks[0].ssid));
+    strlcpy(config->wifi_networks[0].password, DEFAULT_WIFI_PASSWORD, sizeof(config->wifi_networks[0].password));
+    strlcpy(config->broker_uris[0], DEFAULT_BROKER_URI, sizeof(config->broker_uris[0]));
+    strlcpy(config->command_topic, DEFAULT_COMMAND_TOPIC, sizeof(config->command_topic));
+    strlcpy(config->event_topic, DEFAULT_EVENT_TOPIC, sizeof(config->event_topic));
+    config->duty_cycle_open = DEFAULT_DUTY_CYCLE_OPEN;
+    config->duty_cycle_closed = DEFAULT_DUTY_CYCLE_CLOSED;
+    config->unlock_hold_ms = DEFAULT_UNLOCK_HOLD_MS;
+    config->button_pin = DEFAULT_BUTTON_PIN;
+}
+
+/**
+ * @brief   Converts a stored blob of any known version into the current layout. Each step upgrades one version,
+ *          so a blob written by any older firmware walks through every step in order. Fields added by a step
+ *          take their defaults.
+ *
+ * @param config Receives the current layout.
+ * @param blob The stored blob. Its CRC has already been checked.
+ * @param len Length of the blob.
+ * @return true if the blob was understood.
+ */
+static bool migrate(lock_config_t* config, const uint8_t* blob, size_t len){
+    uint16_t version;
+    memcpy(&version, blob, sizeof(version));
+
+    if(version == LOCK_CONFIG_VERSION){
+        if(len != sizeof(lock_config_t)){
+            return false;
+        }
+        memcpy(config, blob, len);
+        return true;
+    }
+
+    lock_config_v2_t v2;
+
+    if((version == 1 && len != sizeof(lock_config_v1_t)) || (version == 2 && len != sizeof(lock_config_v2_t))){
+        return false;
+    }
+
+    if(version == 1){
+        // v2: the single broker became a list of up to LOCK_CONFIG_MAX_BROKERS.
+        lock_config_v1_t v1;
+        memcpy(&v1, blob, len);
+
+        memset(&v2, 0, sizeof(v2));
+        memcpy(v2.wifi_ssid, v1.wifi_ssid, sizeof(v2.wifi_ssid));
+        memcpy(v2.wifi_password, v1.wifi_password, sizeof(v2.wifi_password));
+        memcpy(v2.broker_uris[0], v1.broker_uri, sizeof(v2.broker_uris[0]));
+        memcpy(v2.command_topic, v1.command_topic, sizeof(v2.command_topic));
+        memcpy(v2.event_topic, v1.event_topic, sizeof(v2.event_topic));
+        v2.duty_cycle_open = v1.duty_cycle_open;
+        v2.duty_cycle_closed = v1.duty_cycle_closed;
+        v2.unlock_hold_ms = v1.unlock_hold_ms;
+        v2.button_pin = v1.button_pin;
+        version = 2;
+    }else if(version == 2){
+        memcpy(&v2, blob, len);
+    }
+
+    if(version == 2){
+        // v3: the single Wi-Fi network became a list of up to LOCK_CONFIG_MAX_NETWORKS.
+        set_defaults(config);
+        memset(config->wifi_networks, 0, sizeof(config->wifi_networks));
+        memcpy(config->wifi_networks[0].ssid, v2.wifi_ssid, sizeof(config->wifi_networks[0].ssid));
+        memcpy(config->wifi_networks[0].password, v2.wifi_password, sizeof(config->wifi_networks[0].password));
+        memcpy(config->broker_uris, v2.broker_uris, sizeof(config->broker_uris));
+        memcpy(config->command_topic, v2.command_topic, sizeof(config->command_topic));
+        memcpy(config->event_topic, v2.event_topic, sizeof(config->event_topic));
+        config->duty_cycle_open = v2.duty_cycle_open;
+        config->duty_cycle_closed = v2.duty_cycle_closed;
+        config->unlock_hold_ms = v2.unlock_hold_ms;
+        config->button_pin = v2.button_pin;
+        return true;
+    }
+
+    // Blob from a newer firmware (after a rollback) or one we no longer support.
+    ESP_LOGW(TAG, "no migration from config version %u", version);
+    return false;
+}
+
+/**
+ * @brief Writes a configuration to NVS.
+ *
+ * @param config The configuration. Its CRC is filled in.
+ * @return esp_err_t
+ */
+static esp_err_t store(lock_config_t* config){
+    nvs_handle_t handle;
+
+    config->version = LOCK_CONFIG_VERSION;
+    config->size = sizeof(lock_config_t);
+    config->crc = config_crc(config, sizeof(lock_config_t));
+
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if(err != ESP_OK){
+        return err;
+    }
+
+    // NVS keeps the old blob until the new one is fully written, so a reset here loses nothing.
+    err = nvs_set_blob(handle, NVS_CONFIG_KEY, config, sizeof(lock_config_t));
+    if(err == ESP_OK){
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+
+    return err;
+}
+
+/**
+ * @brief   Initializes NVS and loads the configuration into RAM with a single read. Falls back to the compiled in
+ *          defaults if nothing valid is stored. Must be called before anything reads the configuration.
+ *
+ * @return esp_err_t
+ */
+esp_err_t lock_config_load(){
+    esp_err_t ret = nvs_flash_init();
+    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+      ESP_ERROR_CHECK(nvs_flash_erase());
+      ret = nvs_flash_init();
+    }
+    ESP_ERROR_CHECK(ret);
+
+    // Nothing reads the configuration before it is loaded, so it is loaded in place.
+    lock_config_t* config = &s_config;
+    set_defaults(config);
+
+    nvs_handle_t handle;
+    if(nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK){
+        ESP_LOGI(TAG, "no stored config, using defaults");
+        return ESP_OK;
+    }
+
+    size_t len = 0;
+    uint8_t* blob = NULL;
+    bool loaded = false;
+
+    if(nvs_get_blob(handle, NVS_CONFIG_KEY, NULL, &len) == ESP_OK && len > 2 * sizeof(uint32_t)){
+        blob = malloc(len);
+    }
+    if(blob != NULL && nvs_get_blob(handle, NVS_CONFIG_KEY, blob, &len) == ESP_OK){
+        uint32_t stored_crc;
+        memcpy(&stored_crc, blob + len - sizeof(stored_crc), sizeof(stored_crc));
+
+        if(stored_crc != config_crc(blob, len)){
+            ESP_LOGE(TAG, "stored config is corrupt, using defaults");
+        }else{
+            loaded = migrate(config, blob, len);
+        }
+    }
+    free(blob);
+    nvs_close(handle);
+
+    if(!loaded){
+        set_defaults(config);
+    }else if(config->version != LOCK_CONFIG_VERSION || len != sizeof(lock_config_t)){
+        s_migrated = true;
+    }
+
+    ESP_LOGI(TAG, "config v%u loaded (%s)", config->version, loaded ? "stored" : "defaults");
+
+    return ESP_OK;
+}
+
+/**
+ * @brief   Writes a configuration that was migrated at boot back to NVS in the current layout. Called once the
+ *          running image is confirmed; before that a rollback could still boot an image that only reads the old
+ *          layout. Does nothing if there was no migration.
+ *
+ */
+void lock_config_commit_migration(){
+    if(!s_migrated){
+        return;
+    }
+
+    lock_config_t* config = malloc(sizeof(lock_config_t));
+    if(config == NULL){
+        return;
+    }
+    lock_config_read(config, 0, sizeof(lock_config_t));
+
+    esp_err_t err = store(config);
+    free(config);
+
+    if(err != ESP_OK){
+        ESP_LOGE(TAG, "could not store migrated config: %s", esp_err_to_name(err));
+        return;
+    }
+
+    s_migrated = false;
+    ESP_LOGI(TAG, "migrated config stored");
+}
+
+/**
+ * @brief Copies part of the current configuration. Cheap; reads RAM only. Use LOCK_CONFIG_GET().
+ *
+ * @param dest Receives the bytes.
+ * @param offset Offset of the field in lock_config_t.
+ * @param size Size of the field.
+ */
+void lock_config_read(void* dest, size_t offset, size_t size){
+    portENTER_CRITICAL(&s_config_lock);
+    memcpy(dest, (const uint8_t*)&s_config + offset, size);
+    portEXIT_CRITICAL(&s_config_lock);
+}
+
+static void copy_string(cJSON* root, const char* key, char* dest, size_t dest_len, bool* ok){
+    cJSON* item = cJSON_GetObjectItem(root, key);
+    if(item == NULL){
+        return;
+    }
+    if(!cJSON_IsString(item) || strlen(item->valuestring) >= dest_len){
+        ESP_LOGE(TAG, "bad value for %s", key);
+        *ok = false;
+        return;
+    }
+    strcpy(dest, item->valuestring);
+}
+
+/**
+ * @brief Replaces a list of strings with a JSON array of at most count strings. Unused entries are cleared.
+ */
+static void copy_string_array(cJSON* root, const char* key, char* dest, size_t dest_len, int count, bool* ok){
+    cJSON* item = cJSON_GetObjectItem(root, key);
+    if(item == NULL){
+        return;
+    }
+    if(!cJSON_IsArray(item) || cJSON_GetArraySize(item) < 1 || cJSON_GetArraySize(item) > count){
+        ESP_LOGE(TAG, "bad value for %s", key);
+        *ok = false;
+        return;
+    }
+
+    memset(dest, 0, dest_len * count);
+
+    int i = 0;
+    cJSON* entry;
+    cJSON_ArrayForEach(entry, item){
+        if(!cJSON_IsString(entry) || strlen(entry->valuestring) == 0 || strlen(entry->valuestring) >= dest_len){
+            ESP_LOGE(TAG, "bad value for %s", key);
+            *ok = false;
+            return;
+        }
+        strcpy(dest + i * dest_len, entry->valuestring);
+        i++;
+    }
+}
+
+/**
+ * @brief   Replaces the Wi-Fi network list with a JSON array of at most LOCK_CONFIG_MAX_NETWORKS objects, each with an
+ *          "ssid" and an optional "password". Unused entries are cleared.
+ */
+static void copy_networks(cJSON* root, const char* key, lock_wifi_network_t* dest, bool* ok){
+    cJSON* item = cJSON_GetObjectItem(root, key);
+    if(item == NULL){
+        return;
+    }
+    if(!cJSON_IsArray(item) || cJSON_GetArraySize(item) < 1 || cJSON_GetArraySize(item) > LOCK_CONFIG_MAX_NETWORKS){
+        ESP_LOGE(TAG, "bad value for %s", key);
+        *ok = false;
+        return;
+    }
+
+    memset(dest, 0, sizeof(lock_wifi_network_t) * LOCK_CONFIG_MAX_NETWORKS);
+
+    int i = 0;
+    cJSON* entry;
+    cJSON_ArrayForEach(entry, item){
+        copy_string(entry, "ssid", dest[i].ssid, sizeof(dest[i].ssid), ok);
+        copy_string(entry, "password", dest[i].password, sizeof(dest[i].password), ok);
+        if(!cJSON_IsObject(entry) || dest[i].ssid[0] == '\0'){
+            ESP_LOGE(TAG, "bad value for %s", key);
+            *ok = false;
+            return;
+        }
+        i++;
+    }
+}
+
+static void copy_number(cJSON* root, const char* key, double min, double max, double* dest, bool* ok){
+    cJSON* item = cJSON_GetObjectItem(root, key);
+    if(item == NULL){
+        return;
+    }
+    if(!cJSON_IsNumber(item) || item->valuedouble < min || item->valuedouble > max){
+        ESP_LOGE(TAG, "bad value for %s", key);
+        *ok = false;
+        return;
+    }
+    *dest = item->valuedouble;
+}
+
+/**
+ * @brief   Applies a JSON object of changed fields, e.g. {"unlock_hold_ms": 6000}. Either every field is applied
+ *          or none are. "broker_uris" replaces the whole broker list; "broker_uri" only replaces the first entry.
+ *          Likewise "wifi_networks" replaces the whole list of [{"ssid": ..., "password": ...}], and "wifi_ssid" and
+ *          "wifi_password" only the first entry. Broker, topic and button pin changes take effect after a reboot,
+ *          Wi-Fi changes the next time the lock scans for a network, and the rest on next use. Only called from
+ *          the MQTT task, once the message has been authenticated, so updates never race each other.
+ *
+ * @param json The JSON text.
+ * @param len Length of the JSON text.
+ * @return esp_err_t ESP_ERR_INVALID_ARG if any field is invalid.
+ */
+esp_err_t lock_config_update_json(const char* json, size_t len){
+    cJSON* root = cJSON_ParseWithLength(json, len);
+    if(root == NULL || !cJSON_IsObject(root)){
+        cJSON_Delete(root);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    lock_config_t* next = malloc(sizeof(lock_config_t));
+    if(next == NULL){
+        cJSON_Delete(root);
+        return ESP_ERR_NO_MEM;
+    }
+    lock_config_read(next, 0, sizeof(lock_config_t));
+
+    bool ok = true;
+    double duty_open = next->duty_cycle_open;
+    double duty_closed = next->duty_cycle_closed;
+    double hold_ms = next->unlock_hold_ms;
+    double button_pin = next->button_pin;
+
+    copy_string(root, "wifi_ssid", next->wifi_networks[0].ssid, sizeof(next->wifi_networks[0].ssid), &ok);
+    copy_string(root, "wifi_password", next->wifi_networks[0].password, sizeof(next->wifi_networks[0].password), &ok);
+    copy_networks(root, "wifi_networks", next->wifi_networks, &ok);
+    copy_string(root, "broker_uri", next->broker_uris[0], sizeof(next->broker_uris[0]), &ok);
+    copy_string_array(root, "broker_uris", next->broker_uris[0], sizeof(next->broker_uris[0]),
+                      LOCK_CONFIG_MAX_BROKERS, &ok);
+    copy_string(root, "command_topic", next->command_topic, sizeof(next->command_topic), &ok);
+    copy_string(root, "event_topic", next->event_topic, sizeof(next->event_topic), &ok);
+    copy_number(root, "duty_cycle_open", 0, 100, &duty_open, &ok);
+    copy_number(root, "duty_cycle_closed", 0, 100, &duty_closed, &ok);
+    copy_number(root, "unlock_hold_ms", 100, 60000, &hold_ms, &ok);
+    copy_number(root, "button_pin", 0, GPIO_NUM_MAX - 1, &button_pin, &ok);
+    cJSON_Delete(root);
+
+    // The range alone lets through pins this chip does not have.
+    if(ok && (button_pin != (int)button_pin || !GPIO_IS_VALID_GPIO((int)button_pin))){
+        ESP_LOGE(TAG, "bad value for button_pin");
+        ok = false;
+    }
+    if(!ok){
+        free(next);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    next->duty_cycle_open = duty_open;
+    next->duty_cycle_closed = duty_closed;
+    next->unlock_hold_ms = hold_ms;
+    next->button_pin = button_pin;
+
+    esp_err_t err = store(next);
+    if(err == ESP_OK){
+        portENTER_CRITICAL(&s_config_lock);
+        s_config = *next;
+        portEXIT_CRITICAL(&s_config_lock);
+        s_migrated = false;
+    }
+    free(next);
+
+    if(err != ESP_OK){
+        ESP_LOGE(TAG, "could not store config: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    ESP_LOGI(TAG, "config updated");
+
+    return ESP_OK;
+}
@@ -0,0 +1,83 @@
+/**
+ * @file lock_config.h
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Runtime configuration, stored as one versioned NVS blob and cached in RAM.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#define CONFIG_TOPIC "/mister_nolan/config"
+
+/* Compiled in defaults, used on first boot or when the stored blob is unusable. */
+#define DEFAULT_WIFI_SSID "testspot"
+#define DEFAULT_WIFI_PASSWORD "1234567890"
+#define DEFAULT_BROKER_URI "mqtt://test.mosquitto.org"
+#define DEFAULT_COMMAND_TOPIC "/mister_nolan/sub"
+#define DEFAULT_EVENT_TOPIC "/mister_nolan"
+#define DEFAULT_DUTY_CYCLE_OPEN 9.5f
+#define DEFAULT_DUTY_CYCLE_CLOSED 2.5f
+#define DEFAULT_UNLOCK_HOLD_MS 4000
+#define DEFAULT_BUTTON_PIN 36
+
+#define LOCK_CONFIG_MAX_BROKERS 3
+#define LOCK_CONFIG_URI_LENGTH 128
+#define LOCK_CONFIG_MAX_NETWORKS 4
+
+/* Bump this whenever lock_config_t changes, and add a migration step in lock_config.c. */
+#define LOCK_CONFIG_VERSION 3
+
+typedef struct{
+    char ssid[33];      // empty if the entry is unused
+    char password[65];
+} lock_wifi_network_t;
+
+typedef struct{
+    uint16_t version;
+    uint16_t size;
+    lock_wifi_network_t wifi_networks[LOCK_CONFIG_MAX_NETWORKS]; // any of these will do; the strongest is joined
+    char broker_uris[LOCK_CONFIG_MAX_BROKERS][LOCK_CONFIG_URI_LENGTH]; // in order of preference, unused entries empty
+    char command_topic[64];
+    char event_topic[64];
+    float duty_cycle_open;
+    float duty_cycle_closed;
+    uint32_t unlock_hold_ms;
+    uint8_t button_pin;
+    uint32_t crc; // must stay last, covers everything before it
+} lock_config_t;
+
+/* Copies one field of the current configuration into dest, which must be the same size, e.g.
+ *
+ *      uint32_t hold_ms;
+ *      LOCK_CONFIG_GET(hold_ms, unlock_hold_ms);
+ *
+ * The copy is taken under the lock that updates take, so it is never half old and half new. */
+#define LOCK_CONFIG_GET(dest, field) do{ \
+        _Static_assert(sizeof(dest) == sizeof(((lock_config_t*)0)->field), "size of " #field); \
+        lock_config_read(&(dest), offsetof(lock_config_t, field), sizeof(dest)); \
+    }while(0)
+
+esp_err_t lock_config_load();
+void lock_config_commit_migration();
+void lock_config_read(void* dest, size_t offset, size_t size);
+esp_err_t lock_config_update_json(const char* json, size_t len);
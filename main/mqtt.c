@@ -42,22 +42,201 @@
 
 #include "mqtt.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "mqtt_client.h"
 #include "smart_lock_utils.h"
 #include "lock_actuation.h"
+#include "ota_update.h"
+#include "lock_config.h"
+#include "fast_log.h"
+#include "telemetry.h"
+#include "broker_select.h"
+#include "warm_boot.h"
+#include "trace.h"
+#include "command.h"
+#include "bench.h"
+#include "audit_log.h"
+#include "access_schedule.h"
+#include "status_display.h"
 
 
+typedef struct{
+    char topic[64];
+    int qos;
+} subscription_t;
+
 static const char *TAG = "SMART_LOCK_MQTT";
 
+static volatile bool s_connected = false;
+
+/* Everything the lock subscribes to, so that it can be subscribed again after any reconnect. */
+static subscription_t s_subscriptions[MQTT_MAX_SUBSCRIPTIONS];
+static int s_subscription_count = 0;
+static portMUX_TYPE s_subscription_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * @brief   Subscribes to every registered topic. Sessions are clean, so this runs on every connect, including
+ *          a connect to a different broker after a failover.
+ *
+ */
+static void subscribe_all(){
+    subscription_t subscriptions[MQTT_MAX_SUBSCRIPTIONS];
+    int count;
+
+    portENTER_CRITICAL(&s_subscription_lock);
+    count = s_subscription_count;
+    memcpy(subscriptions, s_subscriptions, sizeof(subscription_t) * count);
+    portEXIT_CRITICAL(&s_subscription_lock);
+
+    for(int i = 0; i < count; i++){
+        esp_mqtt_client_subscribe(client, subscriptions[i].topic, subscriptions[i].qos);
+    }
+}
+
+static bool topic_is(const char* topic, int topic_len, const char* name){
+    return topic_len == strlen(name) && strncmp(topic, name, topic_len) == 0;
+}
+
+/**
+ * @brief Routes an incoming message to whatever handles its topic.
+ *
+ * @param topic The topic, not terminated.
+ * @param topic_len Length of the topic.
+ * @param data The whole message.
+ * @param data_len Length of the message.
+ * @param received_us When the message, or its first fragment, reached the handler, for command timing.
+ */
+static void handle_data(const char* topic, int topic_len, const char* data, int data_len, int64_t received_us){
+    if(topic_is(topic, topic_len, OTA_TOPIC)){
+        ota_update_command(data, data_len);
+        return;
+    }
+    if(topic_is(topic, topic_len, CONFIG_TOPIC)){
+        int len = data_len;
+        // The config names the Wi-Fi networks and brokers the lock trusts, so only signed updates are taken.
+        if(!command_authenticate(data, &len)){
+            ESP_LOGW(TAG, "unsigned or replayed config update ignored");
+        }else if(lock_config_update_json(data, len) != ESP_OK){
+            ESP_LOGW(TAG, "config update rejected");
+            status_display_set_error(STATUS_ERROR_CONFIG, "update rejected");
+        }else{
+            status_display_set_error(STATUS_ERROR_CONFIG, NULL);
+        }
+        return;
+    }
+    if(topic_is(topic, topic_len, TRACE_TOPIC)){
+        trace_command(data, data_len);
+        return;
+    }
+    if(topic_is(topic, topic_len, SCHEDULE_TOPIC)){
+        int len = data_len;
+        // Passage windows hold the lock open and the table outlives reboots in NVS, so only signed sets are taken.
+        if(!command_authenticate(data, &len)){
+            ESP_LOGW(TAG, "unsigned or replayed schedules ignored");
+        }else if(access_schedule_update_json(data, len) != ESP_OK){
+            ESP_LOGW(TAG, "schedules rejected");
+        }
+        return;
+    }
+    if(topic_is(topic, topic_len, AUDIT_QUERY_TOPIC)){
+        int len = data_len;
+        // The log says who came and went, so it is only read out for signed queries.
+        if(!command_authenticate(data, &len)){
+            ESP_LOGW(TAG, "unsigned or replayed audit query ignored");
+        }else{
+            audit_log_command(data, len);
+        }
+        return;
+    }
+    if(topic_is(topic, topic_len, BENCH_ECHO_TOPIC)){
+        bench_echo_received(data, data_len, received_us);
+        return;
+    }
+    command_ctx_t origin = {
+        .received_us = received_us,
+    };
+    command_handle(data, data_len, LOCK_SOURCE_MQTT, &origin);
+}
+
+/**
+ * @brief   Handles an MQTT_EVENT_DATA event. A message longer than the client's buffer arrives as several events,
+ *          and only the first carries the topic; those are put back together here, up to MQTT_MAX_MESSAGE_LENGTH,
+ *          before the message is routed. Longer messages, and fragments that do not follow on, are dropped.
+ *
+ * @param event The MQTT_EVENT_DATA event.
+ * @param received_us When the event reached the handler.
+ */
+static void handle_fragment(esp_mqtt_event_handle_t event, int64_t received_us){
+    // Only the MQTT task calls this, so the partial message needs no lock.
+    static char s_data[MQTT_MAX_MESSAGE_LENGTH];
+    static char s_topic[sizeof(s_subscriptions[0].topic)];
+    static int s_topic_len = 0;
+    static int s_length = 0;
+    static int s_total = -1;        // -1 while no message is being put together
+    static int64_t s_received_us;
+
+    if(event->current_data_offset == 0 && event->data_len == event->total_data_len){
+        // The whole message in one piece, which is the usual case.
+        s_total = -1;
+        handle_data(event->topic, event->topic_len, event->data, event->data_len, received_us);
+        return;
+    }
+
+    if(event->current_data_offset == 0){
+        s_total = -1;
+        if(event->total_data_len > sizeof(s_data) || event->topic_len >= sizeof(s_topic)){
+            ESP_LOGW(TAG, "%d byte message on %.*s is too long, dropped", event->total_data_len, event->topic_len,
+                     event->topic);
+            return;
+        }
+        memcpy(s_topic, event->topic, event->topic_len);
+        s_topic_len = event->topic_len;
+        s_length = 0;
+        s_total = event->total_data_len;
+        s_received_us = received_us;
+    }
+
+    if(s_total < 0){
+        return;
+    }
+    if(event->current_data_offset != s_length || event->data_len > s_total - s_length){
+        ESP_LOGW(TAG, "fragment out of order, message dropped");
+        s_total = -1;
+        return;
+    }
+
+    memcpy(s_data + s_length, event->data, event->data_len);
+    s_length += event->data_len;
+
+    if(s_length == s_total){
+        s_total = -1;
+        handle_data(s_topic, s_topic_len, s_data, s_length, s_received_us);
+    }
+}
+
 static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data){
-    ESP_LOGD(TAG, "Event dispatched from event loop base=%s, event_id=%d", base, event_id);
+    FLOGD(TAG, "Event dispatched from event loop base=%s, event_id=%d", base, event_id);
     esp_mqtt_event_handle_t event = event_data;
     esp_mqtt_client_handle_t client = event->client;
     int msg_id;
     switch ((esp_mqtt_event_id_t)event_id) {
     case MQTT_EVENT_CONNECTED:
         
-        ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
+        FLOGI(TAG, "MQTT_EVENT_CONNECTED");
+        s_connected = true;
+        status_display_set_error(STATUS_ERROR_MQTT, NULL);
+
+        subscribe_all();
+
+        broker_select_on_connected();
+
+        warm_boot_save_broker(broker_select_active_index());
+        warm_boot_milestone(WARM_BOOT_MQTT_READY);
+
+        // Reaching the broker is the health check for a freshly updated image.
+        ota_confirm_running_image();
+
+        telemetry_on_connected();
         /*
         msg_id = esp_mqtt_client_publish(client, "/topic/qos1", "data_3", 0, 1, 0);
         ESP_LOGI(TAG, "sent publish successful, msg_id=%d", msg_id);
@@ -73,36 +252,41 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
         */
         break;
     case MQTT_EVENT_DISCONNECTED:
-        ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
+        FLOGI(TAG, "MQTT_EVENT_DISCONNECTED");
+        s_connected = false;
+        status_display_set_error(STATUS_ERROR_MQTT, "disconnected");
+
+        broker_select_on_disconnected();
         break;
 
     case MQTT_EVENT_SUBSCRIBED:
-        ESP_LOGI(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
+        FLOGI(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
         //msg_id = esp_mqtt_client_publish(client, "/topic/qos0", "data", 0, 0, 0);
         //ESP_LOGI(TAG, "sent publish successful, msg_id=%d", msg_id);
         break;
     case MQTT_EVENT_UNSUBSCRIBED:
-        ESP_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
+        FLOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
         break;
     case MQTT_EVENT_PUBLISHED:
-        ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+        FLOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
         break;
     case MQTT_EVENT_DATA:
-        ESP_LOGI(TAG, "MQTT_EVENT_DATA");
-        printf("character received: %c\n", (char)(*(event->data)));
-        if((char)(*(event->data)) == 'u'){
-            unlock();
-        }
+        FLOGI(TAG, "MQTT_EVENT_DATA");
+        TRACE_BEGIN("mqtt_rx");
+        handle_fragment(event, esp_timer_get_time());
+        TRACE_END("mqtt_rx");
         break;
     case MQTT_EVENT_ERROR:
         ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
         if (event->error_handle->error_type == MQTT_ERROR_TYPE_TCP_TRANSPORT) {
             ESP_LOGI(TAG, "Last errno string (%s)", strerror(event->error_handle->esp_transport_sock_errno));
-
+            status_display_set_error(STATUS_ERROR_MQTT, strerror(event->error_handle->esp_transport_sock_errno));
+        } else if (event->error_handle->error_type == MQTT_ERROR_TYPE_CONNECTION_REFUSED) {
+            status_display_set_error(STATUS_ERROR_MQTT, "refused by broker");
         }
         break;
     default:
-        ESP_LOGI(TAG, "Other event id:%d", event->event_id);
+        FLOGI(TAG, "Other event id:%d", event->event_id);
         break;
     }
 }
@@ -110,11 +294,81 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 void mqtt_app_start(void)
 {
     esp_mqtt_client_config_t mqtt_cfg = {
-        .host = "test.mosquitto.org",
+        .uri = broker_select_active_uri(),
+        .task_prio = CONFIG_SMART_LOCK_MQTT_TASK_PRIORITY,
+        // Short timeouts so a dead broker is noticed, and failed over from, within a bounded time.
+        .keepalive = CONFIG_SMART_LOCK_MQTT_KEEPALIVE_S,
+        .network_timeout_ms = CONFIG_SMART_LOCK_BROKER_PROBE_TIMEOUT_MS,
+        .reconnect_timeout_ms = 1000,
+        .lwt_topic = STATE_TOPIC,
+        .lwt_msg = STATE_LAST_WILL,
+        .lwt_qos = 1,
+        .lwt_retain = 1,
     };
 
     client = esp_mqtt_client_init(&mqtt_cfg);
     /* The last argument may be used to pass data to the event handler, in this example mqtt_event_handler */
     esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
     esp_mqtt_client_start(client);
-}
\ No newline at end of file
+}
+
+/**
+ * @brief   Adds a topic to the subscription list and subscribes now if connected. The list is replayed on every
+ *          connect, so callers do not need to care whether the client is connected yet.
+ *
+ * @param topic The topic. Copied.
+ * @param qos The QoS.
+ */
+void mqtt_subscribe(const char* topic, int qos){
+    bool added = false;
+
+    portENTER_CRITICAL(&s_subscription_lock);
+    if(s_subscription_count < MQTT_MAX_SUBSCRIPTIONS && strlen(topic) < sizeof(s_subscriptions[0].topic)){
+        strcpy(s_subscriptions[s_subscription_count].topic, topic);
+        s_subscriptions[s_subscription_count].qos = qos;
+        s_subscription_count++;
+        added = true;
+    }
+    portEXIT_CRITICAL(&s_subscription_lock);
+
+    if(!added){
+        ESP_LOGE(TAG, "cannot subscribe to %s", topic);
+        return;
+    }
+
+    if(s_connected){
+        esp_mqtt_client_subscribe(client, topic, qos);
+    }
+}
+
+/**
+ * @brief   Publishes a message. While disconnected the message is kept in the client's outbox and sent after the
+ *          next connect, whichever broker that is.
+ *
+ * @return int The message id, or -1 if it could not be sent or queued.
+ */
+int mqtt_publish(const char* topic, const char* data, int len, int qos, int retain){
+    if(s_connected){
+        return esp_mqtt_client_publish(client, topic, data, len, qos, retain);
+    }
+
+    return esp_mqtt_client_enqueue(client, topic, data, len, qos, retain, true);
+}
+
+bool mqtt_connected(){
+    return s_connected;
+}
+
+/**
+ * @brief   Moves the client to another broker. Must not be called from the MQTT event handler. The outbox is
+ *          kept across the switch, and the subscriptions are replayed once the new broker accepts the connection.
+ *
+ * @param uri The broker URI.
+ */
+void mqtt_switch_broker(const char* uri){
+    esp_mqtt_client_stop(client);
+    s_connected = false;
+
+    esp_mqtt_client_set_uri(client, uri);
+    esp_mqtt_client_start(client);
+}
@@ -22,8 +22,16 @@
  */
 
 #pragma once
+#include <stdbool.h>
 #include "mqtt_client.h"
 
 esp_mqtt_client_handle_t client;
 
-void mqtt_app_start(void);
\ No newline at end of file
+#define MQTT_MAX_SUBSCRIPTIONS 8
+#define MQTT_MAX_MESSAGE_LENGTH 4096    // longer messages arrive in fragments that are not reassembled
+
+void mqtt_app_start(void);
+void mqtt_subscribe(const char* topic, int qos);
+int mqtt_publish(const char* topic, const char* data, int len, int qos, int retain);
+bool mqtt_connected();
+void mqtt_switch_broker(const char* uri);
\ No newline at end of file
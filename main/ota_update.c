@@ -0,0 +1,616 @@
+/**
+ * @file ota_update.c
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Over the air firmware updates, full images or compressed deltas.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ *
+ *  The update is streamed: each HTTP chunk is either written straight to the inactive OTA slot (full image) or
+ *  inflated and applied against the running image (delta). Memory use is fixed regardless of image size: one
+ *  inflator, its 32KB dictionary window and two small buffers.
+ *
+ *  Updates are started by a signed message on OTA_TOPIC (see command_authenticate() in command.c):
+ *
+ *      {"url": "https://host/smart_lock.delta", "sha256": "5e1c...", "boot": "9f3a61c2", "seq": 3}
+ *
+ *  followed by a newline and the signature, so only holders of CONFIG_SMART_LOCK_COMMAND_KEY can flash the lock.
+ *  "sha256" is the SHA-256 of the new image as esp_partition_get_sha256() reports it (tools/make_delta.py prints
+ *  it), and the slot is only made bootable if what was written matches. The signature covers the hash, so it
+ *  pins the exact image even if the server or the link to it is not trusted. The URL must be https.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdkconfig.h"
+#include "cJSON.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_http_client.h"
+#include "esp_crt_bundle.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp32/rom/miniz.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "ota_update.h"
+#include "timer_service.h"
+#include "command.h"
+#include "lock_config.h"
+#include "status_display.h"
+
+#define OTA_BUF_SIZE 4096
+#define OTA_URL_MAX_LEN 256
+#define OTA_DELTA_HEADER_LEN 44
+#define OTA_SHA256_LEN 32
+
+static const char *TAG = "OTA_UPDATE";
+
+typedef enum{
+    DELTA_OP,
+    DELTA_ARGS,
+    DELTA_DIFF,
+    DELTA_INSERT,
+    DELTA_DONE
+} delta_state_t;
+
+typedef struct{
+    esp_ota_handle_t ota;
+    const esp_partition_t* source;
+    uint32_t target_size;
+
+    tinfl_decompressor inflator;
+    uint8_t window[TINFL_LZ_DICT_SIZE];
+    size_t window_ofs;
+
+    delta_state_t state;
+    uint8_t op;
+    uint8_t args[8];
+    size_t args_len;
+    size_t args_needed;
+    uint32_t src_offset;
+    uint32_t remaining;
+
+    uint8_t src_buf[256];
+    uint8_t out_buf[OTA_BUF_SIZE];
+    size_t out_len;
+    uint32_t written;
+} delta_ctx_t;
+
+static char s_url[OTA_URL_MAX_LEN];
+static uint8_t s_expected_sha[OTA_SHA256_LEN];
+static volatile bool s_in_progress = false;
+static soft_timer_t s_verify_timer;
+
+static uint32_t read_u32(const uint8_t* p){
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/**
+ * @brief Writes the buffered output to the OTA slot.
+ *
+ * @param ctx The delta context.
+ * @return esp_err_t
+ */
+static esp_err_t delta_flush(delta_ctx_t* ctx){
+    if(ctx->out_len == 0){
+        return ESP_OK;
+    }
+
+    esp_err_t err = esp_ota_write(ctx->ota, ctx->out_buf, ctx->out_len);
+    ctx->written += ctx->out_len;
+    ctx->out_len = 0;
+
+    return err;
+}
+
+static esp_err_t delta_output(delta_ctx_t* ctx, uint8_t byte){
+    ctx->out_buf[ctx->out_len++] = byte;
+
+    if(ctx->out_len == sizeof(ctx->out_buf)){
+        return delta_flush(ctx);
+    }
+
+    return ESP_OK;
+}
+
+/**
+ * @brief Runs the operation state machine over a block of inflated patch data.
+ *
+ * @param ctx The delta context.
+ * @param data Inflated bytes.
+ * @param len Number of inflated bytes.
+ * @return esp_err_t
+ */
+static esp_err_t delta_process(delta_ctx_t* ctx, const uint8_t* data, size_t len){
+    esp_err_t err = ESP_OK;
+
+    while(len > 0 && err == ESP_OK){
+        switch(ctx->state){
+        case DELTA_OP:
+            ctx->op = *data++;
+            len--;
+            ctx->args_len = 0;
+            if(ctx->op == OTA_DELTA_OP_DIFF){
+                ctx->args_needed = 8;
+            }else if(ctx->op == OTA_DELTA_OP_INSERT){
+                ctx->args_needed = 4;
+            }else{
+                ESP_LOGE(TAG, "bad delta op 0x%02x", ctx->op);
+                return ESP_ERR_INVALID_RESPONSE;
+            }
+            ctx->state = DELTA_ARGS;
+            break;
+
+        case DELTA_ARGS:
+            while(len > 0 && ctx->args_len < ctx->args_needed){
+                ctx->args[ctx->args_len++] = *data++;
+                len--;
+            }
+            if(ctx->args_len < ctx->args_needed){
+                break;
+            }
+            if(ctx->op == OTA_DELTA_OP_DIFF){
+                ctx->src_offset = read_u32(ctx->args);
+                ctx->remaining = read_u32(ctx->args + 4);
+                if(ctx->src_offset + ctx->remaining > ctx->source->size){
+                    ESP_LOGE(TAG, "delta reads past the end of the source image");
+                    return ESP_ERR_INVALID_SIZE;
+                }
+                ctx->state = DELTA_DIFF;
+            }else{
+                ctx->remaining = read_u32(ctx->args);
+                ctx->state = DELTA_INSERT;
+            }
+            if(ctx->remaining == 0){
+                ctx->state = DELTA_OP;
+            }
+            break;
+
+        case DELTA_DIFF: {
+            size_t n = len;
+            if(n > ctx->remaining) n = ctx->remaining;
+            if(n > sizeof(ctx->src_buf)) n = sizeof(ctx->src_buf);
+
+            err = esp_partition_read(ctx->source, ctx->src_offset, ctx->src_buf, n);
+            for(size_t i = 0; i < n && err == ESP_OK; i++){
+                err = delta_output(ctx, (uint8_t)(ctx->src_buf[i] + data[i]));
+            }
+
+            data += n;
+            len -= n;
+            ctx->src_offset += n;
+            ctx->remaining -= n;
+            if(ctx->remaining == 0){
+                ctx->state = DELTA_OP;
+            }
+            break;
+        }
+
+        case DELTA_INSERT: {
+            size_t n = len;
+            if(n > ctx->remaining) n = ctx->remaining;
+
+            for(size_t i = 0; i < n && err == ESP_OK; i++){
+                err = delta_output(ctx, data[i]);
+            }
+
+            data += n;
+            len -= n;
+            ctx->remaining -= n;
+            if(ctx->remaining == 0){
+                ctx->state = DELTA_OP;
+            }
+            break;
+        }
+
+        case DELTA_DONE:
+            ESP_LOGE(TAG, "trailing data after the end of the delta");
+            return ESP_ERR_INVALID_SIZE;
+        }
+    }
+
+    return err;
+}
+
+/**
+ * @brief Inflates a chunk of the compressed patch body and applies it.
+ *
+ * @param ctx The delta context.
+ * @param in Compressed bytes.
+ * @param in_len Number of compressed bytes.
+ * @return esp_err_t
+ */
+static esp_err_t delta_feed(delta_ctx_t* ctx, const uint8_t* in, size_t in_len){
+    while(ctx->state != DELTA_DONE){
+        size_t in_bytes = in_len;
+        size_t out_bytes = TINFL_LZ_DICT_SIZE - ctx->window_ofs;
+
+        tinfl_status status = tinfl_decompress(&ctx->inflator, in, &in_bytes, ctx->window,
+                                               ctx->window + ctx->window_ofs, &out_bytes,
+                                               TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT);
+        in += in_bytes;
+        in_len -= in_bytes;
+
+        if(out_bytes > 0){
+            esp_err_t err = delta_process(ctx, ctx->window + ctx->window_ofs, out_bytes);
+            if(err != ESP_OK){
+                return err;
+            }
+            ctx->window_ofs = (ctx->window_ofs + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+        }
+
+        if(status < TINFL_STATUS_DONE){
+            ESP_LOGE(TAG, "inflate failed (%d)", status);
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+
+        if(status == TINFL_STATUS_DONE){
+            if(ctx->state != DELTA_OP){
+                ESP_LOGE(TAG, "delta ended in the middle of an operation");
+                return ESP_ERR_INVALID_SIZE;
+            }
+            ctx->state = DELTA_DONE;
+        }else if(status == TINFL_STATUS_NEEDS_MORE_INPUT){
+            break;
+        }
+    }
+
+    return ESP_OK;
+}
+
+/**
+ * @brief Checks the delta header against the running image and prepares the inflator.
+ *
+ * @param ctx The delta context.
+ * @param header The 44 byte header.
+ * @return esp_err_t
+ */
+static esp_err_t delta_begin(delta_ctx_t* ctx, const uint8_t* header){
+    uint8_t running_sha[32];
+
+    uint32_t source_size = read_u32(header + 4);
+    ctx->target_size = read_u32(header + 8);
+
+    esp_err_t err = esp_partition_get_sha256(ctx->source, running_sha);
+    if(err != ESP_OK){
+        return err;
+    }
+
+    if(memcmp(running_sha, header + 12, sizeof(running_sha)) != 0){
+        ESP_LOGE(TAG, "delta was made against a different firmware image");
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    if(source_size > ctx->source->size){
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    tinfl_init(&ctx->inflator);
+    ctx->window_ofs = 0;
+    ctx->state = DELTA_OP;
+    ctx->out_len = 0;
+    ctx->written = 0;
+
+    ESP_LOGI(TAG, "applying delta: source %u bytes, target %u bytes", source_size, ctx->target_size);
+
+    return ESP_OK;
+}
+
+/**
+ * @brief Downloads the update and writes it to the inactive slot, then reboots into it.
+ *
+ * @param arg unused
+ */
+static void ota_task(void* arg){
+    const esp_partition_t* update_partition = esp_ota_get_next_update_partition(NULL);
+    esp_ota_handle_t ota_handle = 0;
+    delta_ctx_t* delta = NULL;
+    uint8_t* buf = malloc(OTA_BUF_SIZE);
+    uint8_t header[OTA_DELTA_HEADER_LEN];
+    size_t header_len = 0;
+    bool mode_known = false;
+    uint32_t downloaded = 0;
+    esp_err_t err = ESP_FAIL;
+
+    int64_t start = esp_timer_get_time();
+
+    esp_http_client_config_t config = {
+        .url = s_url,
+        .crt_bundle_attach = esp_crt_bundle_attach,
+        .timeout_ms = 10000,
+        .keep_alive_enable = true,
+    };
+    esp_http_client_handle_t http = esp_http_client_init(&config);
+
+    if(buf == NULL || http == NULL || update_partition == NULL){
+        ESP_LOGE(TAG, "could not set up the update");
+        goto cleanup;
+    }
+
+    err = esp_http_client_open(http, 0);
+    if(err != ESP_OK){
+        ESP_LOGE(TAG, "could not open %s: %s", s_url, esp_err_to_name(err));
+        goto cleanup;
+    }
+    esp_http_client_fetch_headers(http);
+
+    // Anything else is an error page, not an image.
+    int status = esp_http_client_get_status_code(http);
+    if(status != 200){
+        ESP_LOGE(TAG, "could not fetch %s: HTTP %d", s_url, status);
+        err = ESP_FAIL;
+        goto cleanup;
+    }
+
+    err = esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES, &ota_handle);
+    if(err != ESP_OK){
+        ESP_LOGE(TAG, "esp_ota_begin failed: %s", esp_err_to_name(err));
+        goto cleanup;
+    }
+
+    for(;;){
+        int len = esp_http_client_read(http, (char*)buf, OTA_BUF_SIZE);
+        if(len < 0){
+            ESP_LOGE(TAG, "download failed");
+            err = ESP_FAIL;
+            goto cleanup;
+        }
+        if(len == 0){
+            break;
+        }
+        downloaded += len;
+
+        uint8_t* data = buf;
+        size_t data_len = len;
+
+        // The first bytes decide between a full image and a delta.
+        if(!mode_known){
+            while(data_len > 0 && header_len < OTA_DELTA_HEADER_LEN){
+                header[header_len++] = *data++;
+                data_len--;
+            }
+            if(header_len < OTA_DELTA_HEADER_LEN){
+                continue;
+            }
+            mode_known = true;
+
+            if(memcmp(header, OTA_DELTA_MAGIC, 4) == 0){
+                delta = malloc(sizeof(delta_ctx_t));
+                if(delta == NULL){
+                    err = ESP_ERR_NO_MEM;
+                    goto cleanup;
+                }
+                delta->ota = ota_handle;
+                delta->source = esp_ota_get_running_partition();
+                err = delta_begin(delta, header);
+            }else{
+                ESP_LOGI(TAG, "applying full image");
+                err = esp_ota_write(ota_handle, header, header_len);
+            }
+            if(err != ESP_OK){
+                goto cleanup;
+            }
+        }
+
+        if(delta != NULL){
+            err = delta_feed(delta, data, data_len);
+        }else if(data_len > 0){
+            err = esp_ota_write(ota_handle, data, data_len);
+        }
+        if(err != ESP_OK){
+            ESP_LOGE(TAG, "applying update failed: %s", esp_err_to_name(err));
+            goto cleanup;
+        }
+    }
+
+    if(!esp_http_client_is_complete_data_received(http) || !mode_known){
+        ESP_LOGE(TAG, "download incomplete");
+        err = ESP_FAIL;
+        goto cleanup;
+    }
+
+    if(delta != NULL){
+        if(delta->state != DELTA_DONE || delta_flush(delta) != ESP_OK || delta->written != delta->target_size){
+            ESP_LOGE(TAG, "delta did not produce the expected image");
+            err = ESP_ERR_INVALID_SIZE;
+            goto cleanup;
+        }
+    }
+
+    // esp_ota_end() validates the image, including its SHA-256, before it can be booted.
+    err = esp_ota_end(ota_handle);
+    ota_handle = 0;
+    if(err != ESP_OK){
+        ESP_LOGE(TAG, "image validation failed: %s", esp_err_to_name(err));
+        goto cleanup;
+    }
+
+    // That only shows the image is intact. Whether it is the image that was asked for is up to the signed hash.
+    uint8_t written_sha[OTA_SHA256_LEN];
+    err = esp_partition_get_sha256(update_partition, written_sha);
+    if(err == ESP_OK && memcmp(written_sha, s_expected_sha, sizeof(written_sha)) != 0){
+        ESP_LOGE(TAG, "image is not the one the update request names");
+        err = ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+    if(err != ESP_OK){
+        goto cleanup;
+    }
+
+    err = esp_ota_set_boot_partition(update_partition);
+    if(err != ESP_OK){
+        goto cleanup;
+    }
+
+    int64_t elapsed_ms = (esp_timer_get_time() - start) / 1000;
+    ESP_LOGI(TAG, "update done: downloaded %u bytes (%s) in %lld ms, %u B/s. Rebooting.",
+             downloaded, delta != NULL ? "delta" : "full", elapsed_ms,
+             elapsed_ms > 0 ? (uint32_t)(downloaded * 1000LL / elapsed_ms) : 0);
+
+cleanup:
+    if(ota_handle != 0){
+        esp_ota_abort(ota_handle);
+    }
+    if(http != NULL){
+        esp_http_client_close(http);
+        esp_http_client_cleanup(http);
+    }
+    free(delta);
+    free(buf);
+
+    if(err == ESP_OK){
+        esp_restart();
+    }
+    status_display_set_error(STATUS_ERROR_OTA, esp_err_to_name(err));
+
+    s_in_progress = false;
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief Starts downloading and applying an update in the background.
+ *
+ * @param url HTTPS URL of a full image or a delta made by tools/make_delta.py.
+ * @param sha256 SHA-256 of the image the update must produce.
+ * @return true if the update was started.
+ * @return false if an update is already running, or the URL is too long or not https.
+ */
+bool ota_update_start(const char* url, const uint8_t sha256[32]){
+    if(s_in_progress || strlen(url) >= OTA_URL_MAX_LEN || strncmp(url, "https://", 8) != 0){
+        return false;
+    }
+    s_in_progress = true;
+
+    strcpy(s_url, url);
+    memcpy(s_expected_sha, sha256, OTA_SHA256_LEN);
+    status_display_set_error(STATUS_ERROR_OTA, NULL);
+
+    ESP_LOGI(TAG, "starting update from %s", s_url);
+
+    if(xTaskCreatePinnedToCore(ota_task, "ota", 6144, NULL, CONFIG_SMART_LOCK_OTA_TASK_PRIORITY, NULL,
+                               CONFIG_SMART_LOCK_NETWORK_CORE) != pdPASS){
+        s_in_progress = false;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Parses 64 hex digits into a SHA-256.
+ *
+ * @param hex The digits.
+ * @param sha Where to put the hash.
+ * @return true if hex was exactly 64 hex digits.
+ */
+static bool parse_sha256(const char* hex, uint8_t sha[OTA_SHA256_LEN]){
+    if(strlen(hex) != OTA_SHA256_LEN * 2){
+        return false;
+    }
+
+    for(int i = 0; i < OTA_SHA256_LEN; i++){
+        char byte[3] = {hex[i * 2], hex[i * 2 + 1], '\0'};
+        char* end;
+        sha[i] = strtoul(byte, &end, 16);
+        if(end != byte + 2){
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Handles a message on OTA_TOPIC: checks its signature and starts the update it names.
+ *
+ * @param data The message.
+ * @param len Length of the message.
+ */
+void ota_update_command(const char* data, int len){
+    if(!command_authenticate(data, &len)){
+        ESP_LOGW(TAG, "unsigned or replayed update request ignored");
+        return;
+    }
+
+    cJSON* root = cJSON_ParseWithLength(data, len);
+    cJSON* url = cJSON_GetObjectItem(root, "url");
+    cJSON* sha256 = cJSON_GetObjectItem(root, "sha256");
+    uint8_t sha[OTA_SHA256_LEN];
+
+    if(!cJSON_IsString(url) || !cJSON_IsString(sha256) || !parse_sha256(sha256->valuestring, sha)){
+        ESP_LOGW(TAG, "bad update request");
+        status_display_set_error(STATUS_ERROR_OTA, "bad request");
+    }else if(!ota_update_start(url->valuestring, sha)){
+        ESP_LOGW(TAG, "OTA not started");
+        status_display_set_error(STATUS_ERROR_OTA, "not started");
+    }
+
+    cJSON_Delete(root);
+}
+
+/**
+ * @brief Rolls back to the previous image if the new one never confirmed itself.
+ *
+ * @param arg unused
+ */
+static void verify_timeout(void* arg){
+    ESP_LOGE(TAG, "new firmware was not confirmed in time, rolling back");
+    esp_ota_mark_app_invalid_rollback_and_reboot();
+}
+
+/**
+ * @brief   Checks whether this is the first boot of a new image. If it is, the image has to call
+ *          ota_confirm_running_image() within CONFIG_SMART_LOCK_OTA_VERIFY_TIMEOUT_S or it is rolled back.
+ *          A crash or watchdog reset before then also rolls back, because the bootloader will not boot an
+ *          unconfirmed image twice.
+ *
+ */
+void ota_boot_check(){
+    esp_ota_img_states_t state;
+
+    if(esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) != ESP_OK){
+        return;
+    }
+
+    if(state == ESP_OTA_IMG_PENDING_VERIFY){
+        ESP_LOGW(TAG, "running a new image, waiting for it to be confirmed");
+        soft_timer_init(&s_verify_timer, verify_timeout, NULL);
+        soft_timer_start_once(&s_verify_timer, CONFIG_SMART_LOCK_OTA_VERIFY_TIMEOUT_S * 1000000ULL);
+    }
+}
+
+/**
+ * @brief   Marks the running image as good. Called once the lock is back on the broker. Only then is a config
+ *          migrated at boot written back, since the previous image can no longer be rolled back to.
+ *
+ */
+void ota_confirm_running_image(){
+    esp_ota_img_states_t state;
+
+    if(esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) == ESP_OK &&
+       state == ESP_OTA_IMG_PENDING_VERIFY){
+        soft_timer_stop(&s_verify_timer);
+        esp_ota_mark_app_valid_cancel_rollback();
+        ESP_LOGI(TAG, "new image confirmed");
+    }
+
+    lock_config_commit_migration();
+}
@@ -0,0 +1,47 @@
+/**
+ * @file ota_update.h
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Over the air firmware updates, full images or compressed deltas.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define OTA_TOPIC "/mister_nolan/ota"
+
+/* Delta patch format, produced by tools/make_delta.py:
+ *
+ *  header (44 bytes, little endian, uncompressed):
+ *      "SLD1", u32 source size, u32 target size, u8[32] SHA-256 of the source image
+ *  body (zlib stream) of operations:
+ *      0x01 DIFF   u32 source offset, u32 length, length bytes added (mod 256) to the source bytes
+ *      0x02 INSERT u32 length, length literal bytes
+ *
+ * Anything that does not start with the magic is treated as a full image. */
+#define OTA_DELTA_MAGIC "SLD1"
+#define OTA_DELTA_OP_DIFF 0x01
+#define OTA_DELTA_OP_INSERT 0x02
+
+bool ota_update_start(const char* url, const uint8_t sha256[32]);
+void ota_update_command(const char* data, int len);
+void ota_boot_check();
+void ota_confirm_running_image();
@@ -33,39 +33,135 @@
 #include "smart_lock_utils.h"
 #include "mqtt.h"
 #include "lock_actuation.h"
+#include "jitter_probe.h"
+#include "timer_service.h"
+#include "ota_update.h"
+#include "lock_config.h"
+#include "fast_log.h"
+#include "status_display.h"
+#include "telemetry.h"
+#include "broker_select.h"
+#include "warm_boot.h"
+#include "trace.h"
+#include "bench.h"
+#include "command.h"
+#include "local_endpoint.h"
+#include "audit_log.h"
+#include "access_schedule.h"
+#include "time_sync.h"
 
-#define BUTTON_PIN 36
+/* Button pin and topics only change on reboot, so they are read once. */
+static uint8_t s_button_pin;
+static char s_event_topic[64];
+
+/**
+ * @brief Polls the unlock button and asks for an unlock on each press.
+ * 
+ * @param arg unused
+ */
+static void button_task(void* arg){
+    int last_level = 0;
+
+    for(;;){
+        int level = gpio_get_level(s_button_pin);
+
+        if(level == 1 && last_level == 0){
+            lock_admission_t result = request_unlock(LOCK_SOURCE_BUTTON, NULL);
+
+            if(result == LOCK_ADMITTED || result == LOCK_COALESCED){
+                mqtt_publish(s_event_topic, "unlocked manually through a button", 0, 0, 0);
+            }
+        }
+        last_level = level;
+
+        delay_ms(25);
+    }
+}
 
 void app_main(void)
 {
+    fast_log_start();
+
+    trace_init();
+
+    command_init();
+
+    bool warm = warm_boot_begin();
+
+    lock_config_load();
+
+    LOCK_CONFIG_GET(s_button_pin, button_pin);
+
+    LOCK_CONFIG_GET(s_event_topic, event_topic);
+
+    timer_service_start();
+
+    audit_log_start();
+
+    ota_boot_check();
+
     init_lock_motor();
 
-    gpio_reset_pin(BUTTON_PIN);
+    warm_boot_milestone(WARM_BOOT_LOCK_READY);
+
+    gpio_reset_pin(s_button_pin);
 
-    gpio_set_direction(BUTTON_PIN, GPIO_MODE_INPUT);
+    gpio_set_direction(s_button_pin, GPIO_MODE_INPUT);
 
     #ifdef USE_LCD_SCREEN
-    lcd_init(1, 0, 0);
+    if(warm){
+        // The LCD kept power through the reset; only the bus needs setting up again.
+        lcd_attach();
+
+        status_display_start();
 
-    lcd_set_cursor_location(0, 5);
+        status_display_show(warm_boot_restored()->lcd_lines[0], warm_boot_restored()->lcd_lines[1]);
+    }else{
+        lcd_init(1, 0, 0);
 
-    lcd_print_string("locked");
+        status_display_start();
+
+        status_display_show("locked", NULL);
+    }
     #endif
 
+    lock_task_start();
+
+    access_schedule_start();
+
     connect_to_wifi();
 
+    time_sync_start();
+
+    local_endpoint_start();
+
     mqtt_app_start();
 
-    delay_ms(200);
+    telemetry_start();
 
-    esp_mqtt_client_subscribe(client, "/mister_nolan/sub", 0);
+    char command_topic[64];
+    LOCK_CONFIG_GET(command_topic, command_topic);
 
-    for(;;){
-        if(gpio_get_level(BUTTON_PIN) == 1){
-            esp_mqtt_client_publish(client, "/mister_nolan", "unlocked manually through a button", 0, 0, 0);
-            unlock();
-        }
+    mqtt_subscribe(command_topic, 0);
 
-        delay_ms(25);
-    }
+    mqtt_subscribe(CONFIG_TOPIC, 1);
+
+    mqtt_subscribe(OTA_TOPIC, 1);
+
+    mqtt_subscribe(AUDIT_QUERY_TOPIC, 1);
+
+    mqtt_subscribe(SCHEDULE_TOPIC, 1);
+
+    #if CONFIG_SMART_LOCK_TRACE
+    mqtt_subscribe(TRACE_TOPIC, 1);
+    #endif
+
+    broker_select_start();
+
+    xTaskCreatePinnedToCore(button_task, "button", 3072, NULL, CONFIG_SMART_LOCK_INPUT_TASK_PRIORITY,
+                            NULL, CONFIG_SMART_LOCK_APP_CORE);
+
+    jitter_probe_start();
+
+    bench_start();
 }
@@ -23,8 +23,60 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "esp_rom_sys.h"
 #include "smart_lock_utils.h"
+#include "timer_service.h"
 
+// Below this a busy wait is cheaper and more accurate than blocking on a timer.
+#define DELAY_SPIN_THRESHOLD_US 50
+
+static void wake_task(void* arg){
+    xTaskNotifyGive((TaskHandle_t)arg);
+}
+
+/**
+ * @brief   Blocks the calling task for at least the given number of microseconds. Short delays spin, longer ones block
+ *          on a timer service timer so that the delay is not rounded to the FreeRTOS tick. Uses the calling task's
+ *          notification value.
+ * 
+ * @param us Microseconds to wait.
+ */
+void delay_us(uint32_t us){
+    if(us == 0){
+        return;
+    }
+
+    if(us < DELAY_SPIN_THRESHOLD_US){
+        esp_rom_delay_us(us);
+        return;
+    }
+
+    soft_timer_t timer;
+    soft_timer_init(&timer, wake_task, xTaskGetCurrentTaskHandle());
+
+    ulTaskNotifyTake(pdTRUE, 0); // drop any stale notification
+
+    if(!soft_timer_start_once(&timer, us)){
+        // Timer service not running yet. Round up to whole ticks so the delay is never shorter than asked for.
+        uint32_t tick_us = portTICK_PERIOD_MS * 1000;
+        vTaskDelay((us + tick_us - 1) / tick_us + 1);
+        return;
+    }
+
+    do{
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }while(soft_timer_is_active(&timer));
+}
+
+/**
+ * @brief Blocks the calling task for at least the given number of milliseconds.
+ * 
+ * @param ms Milliseconds to wait.
+ */
 void delay_ms(int ms){
-    vTaskDelay(ms / portTICK_PERIOD_MS);
+    if(ms <= 0){
+        return;
+    }
+
+    delay_us((uint32_t)ms * 1000);
 }
\ No newline at end of file
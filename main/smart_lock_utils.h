@@ -26,4 +26,5 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
-void delay_ms(int ms);
\ No newline at end of file
+void delay_ms(int ms);
+void delay_us(uint32_t us);
\ No newline at end of file
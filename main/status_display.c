@@ -0,0 +1,344 @@
+/**
+ * @file status_display.c
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Status screens on the LCD, with paging and hardware scrolling of long lines.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ *
+ *  The UI task is the only thing that talks to the LCD once it is initialized. Each page is written to DDRAM
+ *  once, 40 columns per line. Lines longer than the screen are then scrolled with the display shift instruction,
+ *  one bus command per step, and the next page starts with return home. Steps are paced by a timer service
+ *  timer, so nothing busy-waits between steps.
+ *
+ *  The first page is always the lock state (status_display_show()). It is followed by a page with the IP address
+ *  while Wi-Fi is up, and a page for each error that is set, so the screen cycles through them.
+ */
+
+#include <string.h>
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+
+#include "HD44780.h"
+#include "status_display.h"
+#include "timer_service.h"
+#include "warm_boot.h"
+#include "trace.h"
+
+#define UI_QUEUE_LENGTH 4
+
+typedef enum{
+    UI_SHOW,
+    UI_TICK,
+    UI_BENCHMARK
+} ui_msg_type_t;
+
+typedef struct{
+    ui_msg_type_t type;
+    uint32_t generation;
+    int count;              // UI_BENCHMARK: characters to write
+    TaskHandle_t waiter;    // UI_BENCHMARK: notified with the sequence once the result is in place
+    uint32_t sequence;      // UI_BENCHMARK: tells the answer apart from a late one to an earlier request
+} ui_msg_t;
+
+static QueueHandle_t s_ui_queue = NULL;
+static soft_timer_t s_step_timer;
+static volatile uint32_t s_generation = 0;
+static volatile int s_benchmark_result;
+static uint32_t s_benchmark_sequence = 0;   // only touched by the benchmarking task
+
+/* What the pages are made of, and the latest pages made from it. Guarded by s_pending_lock. */
+static status_page_t s_lock_page;
+static char s_network[LCD_LINE_LENGTH + 1];
+static char s_errors[STATUS_ERROR_COUNT][LCD_LINE_LENGTH + 1];
+static status_page_t s_pending_pages[STATUS_DISPLAY_MAX_PAGES];
+static int s_pending_count = 0;
+static portMUX_TYPE s_pending_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static const char* const s_error_titles[STATUS_ERROR_COUNT] = {"MQTT error", "OTA error", "config error"};
+
+/* Only touched by the UI task. */
+static status_page_t s_pages[STATUS_DISPLAY_MAX_PAGES];
+static int s_page_count = 0;
+static int s_current_page = 0;
+static int s_shift = 0;
+static int s_max_shift = 0;
+
+/**
+ * @brief Timer callback. Hands the step to the UI task along with the generation it was armed for.
+ *
+ * @param arg unused
+ */
+static void step_timer_callback(void* arg){
+    ui_msg_t msg = {
+        .type = UI_TICK,
+        .generation = s_generation,
+    };
+
+    xQueueSend(s_ui_queue, &msg, 0);
+}
+
+static void arm_step(uint32_t delay_ms){
+    s_generation++;
+    soft_timer_start_once(&s_step_timer, delay_ms * 1000ULL);
+}
+
+/**
+ * @brief Writes a page to DDRAM and decides whether it needs to scroll.
+ *
+ * @param page The page.
+ */
+static void render_page(const status_page_t* page){
+    char line[LCD_LINE_LENGTH + 1];
+    int width = 0;
+
+    lcd_return_home();
+
+    for(int row = 0; row < 2; row++){
+        int length = strlen(page->lines[row]);
+
+        // Short lines are centered on the visible part of the screen.
+        if(length < LCD_VISIBLE_COLUMNS){
+            int pad = (LCD_VISIBLE_COLUMNS - length) / 2;
+            memset(line, ' ', pad);
+            strcpy(line + pad, page->lines[row]);
+        }else{
+            strcpy(line, page->lines[row]);
+        }
+
+        lcd_write_line(row, line);
+
+        if(length > width) width = length;
+    }
+
+    s_shift = 0;
+    s_max_shift = width > LCD_VISIBLE_COLUMNS ? width - LCD_VISIBLE_COLUMNS : 0;
+
+    if(s_max_shift > 0 || s_page_count > 1){
+        arm_step(CONFIG_SMART_LOCK_LCD_PAGE_DWELL_MS);
+    }else{
+        s_generation++; // static screen, ignore any step already queued
+        soft_timer_stop(&s_step_timer);
+    }
+}
+
+/**
+ * @brief Advances the current page by one scroll step, or moves to the next page.
+ *
+ */
+static void step(){
+    if(s_shift < s_max_shift){
+        lcd_shift_display(0);
+        s_shift++;
+        arm_step(s_shift == s_max_shift ? CONFIG_SMART_LOCK_LCD_PAGE_DWELL_MS : CONFIG_SMART_LOCK_LCD_SCROLL_STEP_MS);
+    }else if(s_page_count > 1){
+        s_current_page = (s_current_page + 1) % s_page_count;
+        render_page(&s_pages[s_current_page]);
+    }else{
+        // One long page: jump back to the start with a single command and scroll again.
+        lcd_return_home();
+        s_shift = 0;
+        arm_step(CONFIG_SMART_LOCK_LCD_PAGE_DWELL_MS);
+    }
+}
+
+static void ui_task(void* arg){
+    ui_msg_t msg;
+
+    for(;;){
+        if(xQueueReceive(s_ui_queue, &msg, portMAX_DELAY) != pdTRUE){
+            continue;
+        }
+
+        if(msg.type == UI_SHOW){
+            portENTER_CRITICAL(&s_pending_lock);
+            s_page_count = s_pending_count;
+            memcpy(s_pages, s_pending_pages, sizeof(status_page_t) * s_page_count);
+            portEXIT_CRITICAL(&s_pending_lock);
+
+            s_current_page = 0;
+            TRACE_BEGIN("lcd_flush");
+            render_page(&s_pages[0]);
+            TRACE_END("lcd_flush");
+        }else if(msg.type == UI_TICK && msg.generation == s_generation){
+            TRACE_BEGIN("lcd_flush");
+            step();
+            TRACE_END("lcd_flush");
+        }else if(msg.type == UI_BENCHMARK){
+            s_benchmark_result = lcd_measure_chars_per_second(msg.count);
+
+            // The measurement overwrote DDRAM; put the current page back.
+            if(s_page_count > 0){
+                render_page(&s_pages[s_current_page]);
+            }
+            xTaskNotify(msg.waiter, msg.sequence, eSetValueWithOverwrite);
+        }
+    }
+}
+
+/**
+ * @brief Starts the UI task. The LCD must already be initialized.
+ *
+ */
+void status_display_start(){
+    s_ui_queue = xQueueCreate(UI_QUEUE_LENGTH, sizeof(ui_msg_t));
+
+    soft_timer_init(&s_step_timer, step_timer_callback, NULL);
+
+    xTaskCreatePinnedToCore(ui_task, "ui", 3072, NULL, CONFIG_SMART_LOCK_UI_TASK_PRIORITY,
+                            NULL, CONFIG_SMART_LOCK_APP_CORE);
+}
+
+/**
+ * @brief   Rebuilds the pages from what is set and hands them to the UI task, which cycles through them. Lines
+ *          longer than the screen scroll.
+ *
+ */
+static void refresh(){
+    int count = 0;
+
+    portENTER_CRITICAL(&s_pending_lock);
+    s_pending_pages[count++] = s_lock_page;
+    if(s_network[0] != '\0'){
+        strcpy(s_pending_pages[count].lines[0], "IP address");
+        strcpy(s_pending_pages[count].lines[1], s_network);
+        count++;
+    }
+    for(int i = 0; i < STATUS_ERROR_COUNT; i++){
+        if(s_errors[i][0] != '\0'){
+            strcpy(s_pending_pages[count].lines[0], s_error_titles[i]);
+            strcpy(s_pending_pages[count].lines[1], s_errors[i]);
+            count++;
+        }
+    }
+    s_pending_count = count;
+    portEXIT_CRITICAL(&s_pending_lock);
+
+    // Only the newest pages matter, so a burst of updates collapses into one redraw.
+    if(s_ui_queue != NULL){
+        ui_msg_t msg = {
+            .type = UI_SHOW,
+        };
+        xQueueSend(s_ui_queue, &msg, pdMS_TO_TICKS(100));
+    }
+}
+
+/**
+ * @brief   Sets the lock state page, which is shown first. Lines are truncated to 40 characters. Nothing is drawn
+ *          until the display is started, but the page is kept for then.
+ *
+ * @param line0 First line, or NULL for blank.
+ * @param line1 Second line, or NULL for blank.
+ */
+void status_display_show(const char* line0, const char* line1){
+    status_page_t page;
+
+    strlcpy(page.lines[0], line0 != NULL ? line0 : "", sizeof(page.lines[0]));
+    strlcpy(page.lines[1], line1 != NULL ? line1 : "", sizeof(page.lines[1]));
+
+    warm_boot_save_display(page.lines[0], page.lines[1]);
+
+    portENTER_CRITICAL(&s_pending_lock);
+    s_lock_page = page;
+    portEXIT_CRITICAL(&s_pending_lock);
+
+    refresh();
+}
+
+/**
+ * @brief Shows the lock's address on a page of its own.
+ *
+ * @param address The address as text, or NULL while there is none.
+ */
+void status_display_set_network(const char* address){
+    char line[LCD_LINE_LENGTH + 1];
+
+    strlcpy(line, address != NULL ? address : "", sizeof(line));
+
+    portENTER_CRITICAL(&s_pending_lock);
+    strcpy(s_network, line);
+    portEXIT_CRITICAL(&s_pending_lock);
+
+    refresh();
+}
+
+/**
+ * @brief Shows an error on a page of its own, replacing the last one of the same kind.
+ *
+ * @param error Which kind of error.
+ * @param text What went wrong, or NULL once it is resolved.
+ */
+void status_display_set_error(status_error_t error, const char* text){
+    char line[LCD_LINE_LENGTH + 1];
+
+    if(error >= STATUS_ERROR_COUNT){
+        return;
+    }
+    strlcpy(line, text != NULL ? text : "", sizeof(line));
+
+    portENTER_CRITICAL(&s_pending_lock);
+    // A repeat of the same error would not change the pages, only restart the cycle.
+    bool changed = strcmp(s_errors[error], line) != 0;
+    strcpy(s_errors[error], line);
+    portEXIT_CRITICAL(&s_pending_lock);
+
+    if(changed){
+        refresh();
+    }
+}
+
+/**
+ * @brief   Measures LCD throughput on the UI task, which owns the LCD, and then redraws the current page. Blocks the
+ *          caller until the measurement is done. Uses the caller's task notification.
+ *
+ * @param count Number of characters to write.
+ * @return int Characters per second, or -1 if the display was not started or did not answer.
+ */
+int status_display_benchmark(int count){
+    uint32_t answered = 0;
+    TimeOut_t timeout;
+    TickType_t wait = pdMS_TO_TICKS(5000);
+
+    if(s_ui_queue == NULL){
+        return -1;
+    }
+
+    ui_msg_t msg = {
+        .type = UI_BENCHMARK,
+        .count = count,
+        .waiter = xTaskGetCurrentTaskHandle(),
+        .sequence = ++s_benchmark_sequence,
+    };
+
+    xTaskNotifyStateClear(NULL);
+    if(xQueueSend(s_ui_queue, &msg, pdMS_TO_TICKS(100)) != pdTRUE){
+        return -1;
+    }
+
+    // A request that timed out earlier can still be answered late; skip until the answer to this one.
+    vTaskSetTimeOutState(&timeout);
+    do{
+        if(xTaskNotifyWait(0, 0, &answered, wait) != pdTRUE){
+            return -1;
+        }
+    }while(answered != msg.sequence && xTaskCheckForTimeOut(&timeout, &wait) == pdFALSE);
+
+    return answered == msg.sequence ? s_benchmark_result : -1;
+}
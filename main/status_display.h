@@ -0,0 +1,47 @@
+/**
+ * @file status_display.h
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Status screens on the LCD, with paging and hardware scrolling of long lines.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "HD44780.h"
+
+/* Things that can go wrong in the background. Each one that is set gets a page of its own. */
+typedef enum{
+    STATUS_ERROR_MQTT,
+    STATUS_ERROR_OTA,
+    STATUS_ERROR_CONFIG,
+    STATUS_ERROR_COUNT
+} status_error_t;
+
+/* The lock state, the network and one per error. */
+#define STATUS_DISPLAY_MAX_PAGES (2 + STATUS_ERROR_COUNT)
+
+typedef struct{
+    char lines[2][LCD_LINE_LENGTH + 1];
+} status_page_t;
+
+void status_display_start();
+void status_display_show(const char* line0, const char* line1);
+void status_display_set_network(const char* address);
+void status_display_set_error(status_error_t error, const char* text);
+int status_display_benchmark(int count);
@@ -0,0 +1,285 @@
+/**
+ * @file telemetry.c
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Retained lock state and delta-only telemetry over MQTT.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ *
+ *  Two kinds of message go out:
+ *
+ *  - STATE_TOPIC carries the whole lock state as a retained message, so a dashboard that subscribes later gets
+ *    it at once. It is published whenever the lock state or last actor changes, and again on every connect.
+ *    The Last Will replaces it with {"online":false} if the lock drops off.
+ *  - TELEMETRY_TOPIC carries only the fields that changed since the last packet, plus uptime as a timestamp.
+ *    Nothing is sent when nothing changed.
+ *
+ *  Changes do not publish immediately. The first change arms a short window and everything that changes
+ *  before it closes goes out together, so a burst of updates costs one packet per topic.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "esp_system.h"
+
+#include "mqtt.h"
+#include "fast_log.h"
+#include "timer_service.h"
+#include "lock_actuation.h"
+#include "command.h"
+#include "telemetry.h"
+
+#define NOTIFY_FLUSH BIT0
+#define NOTIFY_SAMPLE BIT1
+
+#define RSSI_UNKNOWN 0
+
+typedef struct{
+    int rssi;
+    uint32_t free_heap;
+    uint32_t admitted;
+    uint32_t coalesced;
+    uint32_t dropped;
+    uint32_t actuation_us;  // last set_lock_state()
+} telemetry_sample_t;
+
+static const char *TAG = "TELEMETRY";
+
+static TaskHandle_t s_task = NULL;
+static soft_timer_t s_window_timer;
+static soft_timer_t s_sample_timer;
+
+/* Written by the lock task, read by the telemetry task. */
+static portMUX_TYPE s_state_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool s_locked = true;
+static const char* s_actor = "none";
+static bool s_state_dirty = false;
+static bool s_send_all = false;
+
+/* Only touched by the telemetry task. */
+static telemetry_sample_t s_published;
+
+static void window_timer_callback(void* arg){
+    xTaskNotify(s_task, NOTIFY_FLUSH, eSetBits);
+}
+
+static void sample_timer_callback(void* arg){
+    xTaskNotify(s_task, NOTIFY_SAMPLE, eSetBits);
+}
+
+/**
+ * @brief Opens the coalescing window, unless one is already open. 
+ * 
+ */
+static void open_window(){
+    if(s_task != NULL && !soft_timer_is_active(&s_window_timer)){
+        soft_timer_start_once(&s_window_timer, CONFIG_SMART_LOCK_TELEMETRY_WINDOW_MS * 1000ULL);
+    }
+}
+
+static void take_sample(telemetry_sample_t* sample){
+    wifi_ap_record_t ap;
+    lock_admission_stats_t stats;
+    lock_actuation_timing_t timing;
+
+    sample->rssi = esp_wifi_sta_get_ap_info(&ap) == ESP_OK ? ap.rssi : RSSI_UNKNOWN;
+    sample->free_heap = esp_get_free_heap_size();
+
+    lock_admission_get_stats(&stats);
+    sample->admitted = sample->coalesced = sample->dropped = 0;
+    for(int i = 0; i < LOCK_SOURCE_COUNT; i++){
+        sample->admitted += stats.admitted[i];
+        sample->coalesced += stats.coalesced[i];
+        sample->dropped += stats.rate_limited[i] + stats.queue_full[i];
+    }
+
+    lock_actuation_get_timing(&timing);
+    sample->actuation_us = timing.last_us;
+}
+
+static void publish_state(bool locked, const char* actor, const telemetry_sample_t* sample){
+    char payload[192];
+    lock_actuation_timing_t timing;
+
+    // boot is the nonce signed commands have to carry until the next reboot.
+    lock_actuation_get_timing(&timing);
+    snprintf(payload, sizeof(payload),
+             "{\"online\":true,\"lock\":\"%s\",\"actor\":\"%s\",\"actuator\":\"%s\",\"rssi\":%d,\"uptime\":%lld,"
+             "\"boot\":\"%08x\"}",
+             locked ? "locked" : "unlocked", actor, timing.actuator, sample->rssi, esp_timer_get_time() / 1000000,
+             command_boot_nonce());
+
+    if(esp_mqtt_client_publish(client, STATE_TOPIC, payload, 0, 1, 1) < 0){
+        // Sent again on the next connect.
+        FLOGW(TAG, "state publish failed");
+    }
+}
+
+/**
+ * @brief Publishes the fields that changed since the last successful telemetry packet. 
+ * 
+ * @param sample The current values. 
+ * @param send_all Publish every field, after a reconnect. 
+ */
+static void publish_delta(const telemetry_sample_t* sample, bool send_all){
+    char payload[192];
+    int length = snprintf(payload, sizeof(payload), "{\"uptime\":%lld", esp_timer_get_time() / 1000000);
+    int fields = 0;
+
+    bool rssi = sample->rssi != RSSI_UNKNOWN &&
+                (send_all || abs(sample->rssi - s_published.rssi) >= CONFIG_SMART_LOCK_TELEMETRY_RSSI_DEADBAND);
+    bool heap = send_all || sample->free_heap != s_published.free_heap;
+    bool admitted = send_all || sample->admitted != s_published.admitted;
+    bool coalesced = send_all || sample->coalesced != s_published.coalesced;
+    bool dropped = send_all || sample->dropped != s_published.dropped;
+    bool actuation = send_all || sample->actuation_us != s_published.actuation_us;
+
+    if(rssi){
+        length += snprintf(payload + length, sizeof(payload) - length, ",\"rssi\":%d", sample->rssi);
+        fields++;
+    }
+    if(heap){
+        length += snprintf(payload + length, sizeof(payload) - length, ",\"heap\":%u", sample->free_heap);
+        fields++;
+    }
+    if(admitted){
+        length += snprintf(payload + length, sizeof(payload) - length, ",\"admitted\":%u", sample->admitted);
+        fields++;
+    }
+    if(coalesced){
+        length += snprintf(payload + length, sizeof(payload) - length, ",\"coalesced\":%u", sample->coalesced);
+        fields++;
+    }
+    if(dropped){
+        length += snprintf(payload + length, sizeof(payload) - length, ",\"dropped\":%u", sample->dropped);
+        fields++;
+    }
+    if(actuation){
+        length += snprintf(payload + length, sizeof(payload) - length, ",\"actuation_us\":%u", sample->actuation_us);
+        fields++;
+    }
+    snprintf(payload + length, sizeof(payload) - length, "}");
+
+    if(fields == 0){
+        return;
+    }
+
+    if(esp_mqtt_client_publish(client, TELEMETRY_TOPIC, payload, 0, 0, 0) < 0){
+        // Not connected; the fields stay changed and go out with the next packet.
+        return;
+    }
+
+    if(rssi) s_published.rssi = sample->rssi;
+    if(heap) s_published.free_heap = sample->free_heap;
+    if(admitted) s_published.admitted = sample->admitted;
+    if(coalesced) s_published.coalesced = sample->coalesced;
+    if(dropped) s_published.dropped = sample->dropped;
+    if(actuation) s_published.actuation_us = sample->actuation_us;
+}
+
+static void flush(){
+    telemetry_sample_t sample;
+    bool state_dirty, send_all, locked;
+    const char* actor;
+
+    portENTER_CRITICAL(&s_state_lock);
+    state_dirty = s_state_dirty;
+    send_all = s_send_all;
+    locked = s_locked;
+    actor = s_actor;
+    s_state_dirty = false;
+    s_send_all = false;
+    portEXIT_CRITICAL(&s_state_lock);
+
+    take_sample(&sample);
+
+    if(state_dirty){
+        publish_state(locked, actor, &sample);
+    }
+    publish_delta(&sample, send_all);
+}
+
+static void telemetry_task(void* arg){
+    uint32_t bits;
+
+    for(;;){
+        xTaskNotifyWait(0, UINT32_MAX, &bits, portMAX_DELAY);
+
+        if(bits & NOTIFY_SAMPLE){
+            open_window();
+        }
+        if(bits & NOTIFY_FLUSH){
+            flush();
+        }
+    }
+}
+
+/**
+ * @brief Starts the telemetry task and the periodic sample timer. 
+ * 
+ */
+void telemetry_start(){
+    soft_timer_init(&s_window_timer, window_timer_callback, NULL);
+    soft_timer_init(&s_sample_timer, sample_timer_callback, NULL);
+
+    xTaskCreatePinnedToCore(telemetry_task, "telemetry", 3072, NULL, CONFIG_SMART_LOCK_TELEMETRY_TASK_PRIORITY,
+                            &s_task, CONFIG_SMART_LOCK_NETWORK_CORE);
+
+    soft_timer_start_periodic(&s_sample_timer, CONFIG_SMART_LOCK_TELEMETRY_PERIOD_S * 1000000ULL);
+
+    // Anything recorded before the task existed, such as an early connect.
+    open_window();
+}
+
+/**
+ * @brief Records a lock state change. Published as retained state when the coalescing window closes. 
+ * 
+ * @param locked true if the lock is closed. 
+ * @param actor Who caused the change. Must be a string literal or otherwise outlive the publish. 
+ */
+void telemetry_set_lock_state(bool locked, const char* actor){
+    portENTER_CRITICAL(&s_state_lock);
+    if(s_locked != locked || s_actor != actor){
+        s_locked = locked;
+        s_actor = actor;
+        s_state_dirty = true;
+    }
+    portEXIT_CRITICAL(&s_state_lock);
+
+    open_window();
+}
+
+/**
+ * @brief   Called on every broker connect. Republishes the retained state, which the Last Will may have
+ *          replaced, and sends every telemetry field once so a new subscriber has a baseline. 
+ * 
+ */
+void telemetry_on_connected(){
+    portENTER_CRITICAL(&s_state_lock);
+    s_state_dirty = true;
+    s_send_all = true;
+    portEXIT_CRITICAL(&s_state_lock);
+
+    open_window();
+}
@@ -0,0 +1,36 @@
+/**
+ * @file telemetry.h
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Retained lock state and delta-only telemetry over MQTT.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#define STATE_TOPIC "/mister_nolan/state"
+#define TELEMETRY_TOPIC "/mister_nolan/telemetry"
+
+/* Retained on STATE_TOPIC by the broker when the connection drops without a disconnect. */
+#define STATE_LAST_WILL "{\"online\":false}"
+
+void telemetry_start();
+void telemetry_set_lock_state(bool locked, const char* actor);
+void telemetry_on_connected();
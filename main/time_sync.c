@@ -0,0 +1,71 @@
+/**
+ * @file time_sync.c
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Sets the clock from SNTP.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ *
+ *  The clock is only needed for access schedules and audit log times, so nothing waits for it. SNTP runs inside
+ *  lwIP and asks CONFIG_SMART_LOCK_SNTP_SERVER again every CONFIG_LWIP_SNTP_UPDATE_DELAY ms. The RTC keeps
+ *  counting through a software reset, so after a warm boot the clock is already set before SNTP answers.
+ */
+
+#include <time.h>
+#include <sys/time.h>
+
+#include "sdkconfig.h"
+#include "esp_sntp.h"
+#include "esp_log.h"
+
+#include "access_schedule.h"
+#include "time_sync.h"
+
+#define CLOCK_SET_AFTER 1600000000      // 2020-09-13; anything earlier is time since boot
+
+static const char *TAG = "TIME_SYNC";
+
+/**
+ * @brief SNTP callback. Runs on the lwIP task each time the clock is set.
+ *
+ * @param tv The new time.
+ */
+static void time_synced(struct timeval* tv){
+    ESP_LOGI(TAG, "clock set to %lld", (long long)tv->tv_sec);
+
+    access_schedule_clock_changed();
+}
+
+/**
+ * @brief Starts SNTP. The network interface must already be up (connect_to_wifi()).
+ *
+ */
+void time_sync_start(){
+    sntp_setoperatingmode(SNTP_OPMODE_POLL);
+    sntp_setservername(0, CONFIG_SMART_LOCK_SNTP_SERVER);
+    sntp_set_time_sync_notification_cb(time_synced);
+    sntp_init();
+}
+
+/**
+ * @brief Whether the clock holds the real time, from SNTP or from before a warm boot.
+ *
+ * @return true if the clock has been set.
+ */
+bool time_sync_is_set(){
+    return time(NULL) >= CLOCK_SET_AFTER;
+}
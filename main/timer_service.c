@@ -0,0 +1,325 @@
+/**
+ * @file timer_service.c
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Software timers multiplexed onto a single esp_timer.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ *
+ *  Pending timers are kept in a fixed size binary min-heap ordered by deadline. Only the earliest deadline is
+ *  programmed into the esp_timer. When it fires, the service task runs every expired callback and reprograms the
+ *  esp_timer for the new earliest deadline. The service task is the only thing that touches the esp_timer.
+ */
+
+#include <stddef.h>
+
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "timer_service.h"
+#include "trace.h"
+
+static const char *TAG = "TIMER_SERVICE";
+
+static soft_timer_t* s_heap[CONFIG_SMART_LOCK_MAX_TIMERS];
+static int s_heap_size = 0;
+static portMUX_TYPE s_heap_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static esp_timer_handle_t s_hw_timer;
+static TaskHandle_t s_service_task = NULL;
+
+/* Heap helpers. These must be called with s_heap_lock held. */
+
+static void heap_swap(int a, int b){
+    soft_timer_t* tmp = s_heap[a];
+    s_heap[a] = s_heap[b];
+    s_heap[b] = tmp;
+    s_heap[a]->heap_index = a;
+    s_heap[b]->heap_index = b;
+}
+
+static void heap_sift_up(int i){
+    while(i > 0){
+        int parent = (i - 1) / 2;
+        if(s_heap[parent]->deadline_us <= s_heap[i]->deadline_us){
+            break;
+        }
+        heap_swap(i, parent);
+        i = parent;
+    }
+}
+
+static void heap_sift_down(int i){
+    for(;;){
+        int left = 2 * i + 1;
+        int right = left + 1;
+        int smallest = i;
+
+        if(left < s_heap_size && s_heap[left]->deadline_us < s_heap[smallest]->deadline_us) smallest = left;
+        if(right < s_heap_size && s_heap[right]->deadline_us < s_heap[smallest]->deadline_us) smallest = right;
+
+        if(smallest == i){
+            break;
+        }
+        heap_swap(i, smallest);
+        i = smallest;
+    }
+}
+
+static bool heap_insert(soft_timer_t* timer){
+    if(s_heap_size >= CONFIG_SMART_LOCK_MAX_TIMERS){
+        return false;
+    }
+
+    timer->heap_index = s_heap_size;
+    s_heap[s_heap_size++] = timer;
+    heap_sift_up(timer->heap_index);
+
+    return true;
+}
+
+static void heap_remove(soft_timer_t* timer){
+    int i = timer->heap_index;
+
+    timer->heap_index = -1;
+    s_heap_size--;
+
+    if(i == s_heap_size){
+        return;
+    }
+
+    soft_timer_t* moved = s_heap[s_heap_size];
+    s_heap[i] = moved;
+    moved->heap_index = i;
+    heap_sift_up(i);
+    heap_sift_down(moved->heap_index);
+}
+
+/**
+ * @brief Called when the earliest deadline is reached. Wakes the service task.
+ *
+ * @param arg unused
+ */
+static void IRAM_ATTR hw_timer_callback(void* arg){
+    TRACE_ISR("timer_service");
+
+#if CONFIG_ESP_TIMER_SUPPORTS_ISR_DISPATCH_METHOD
+    BaseType_t high_task_awoken = pdFALSE;
+    vTaskNotifyGiveFromISR(s_service_task, &high_task_awoken);
+    if(high_task_awoken == pdTRUE){
+        esp_timer_isr_dispatch_need_yield();
+    }
+#else
+    xTaskNotifyGive(s_service_task);
+#endif
+}
+
+/**
+ * @brief Runs every expired timer and reschedules the periodic ones.
+ *
+ * @return int64_t The next deadline in microseconds, or -1 if no timers are pending.
+ */
+static int64_t dispatch_expired(){
+    for(;;){
+        int64_t now = esp_timer_get_time();
+
+        portENTER_CRITICAL(&s_heap_lock);
+        if(s_heap_size == 0){
+            portEXIT_CRITICAL(&s_heap_lock);
+            return -1;
+        }
+
+        soft_timer_t* timer = s_heap[0];
+        if(timer->deadline_us > now){
+            int64_t next = timer->deadline_us;
+            portEXIT_CRITICAL(&s_heap_lock);
+            return next;
+        }
+
+        heap_remove(timer);
+        if(timer->period_us > 0){
+            timer->deadline_us += timer->period_us;
+            if(timer->deadline_us <= now){ // fell behind, skip the missed periods
+                timer->deadline_us = now + timer->period_us;
+            }
+            heap_insert(timer);
+        }
+
+        soft_timer_cb_t callback = timer->callback;
+        void* arg = timer->arg;
+        portEXIT_CRITICAL(&s_heap_lock);
+
+        callback(arg);
+    }
+}
+
+/**
+ * @brief Dispatches expired timers and keeps the esp_timer armed for the earliest deadline.
+ *
+ * @param arg unused
+ */
+static void timer_service_task(void* arg){
+    for(;;){
+        int64_t next = dispatch_expired();
+
+        esp_timer_stop(s_hw_timer); // fails harmlessly if it is not running
+
+        if(next >= 0){
+            int64_t wait_us = next - esp_timer_get_time();
+            if(wait_us <= 0){
+                continue;
+            }
+            ESP_ERROR_CHECK(esp_timer_start_once(s_hw_timer, wait_us));
+        }
+
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+}
+
+/**
+ * @brief Creates the backing esp_timer and starts the service task.
+ *
+ */
+void timer_service_start(){
+    esp_timer_create_args_t args = {
+        .callback = hw_timer_callback,
+        .arg = NULL,
+#if CONFIG_ESP_TIMER_SUPPORTS_ISR_DISPATCH_METHOD
+        .dispatch_method = ESP_TIMER_ISR,
+#else
+        .dispatch_method = ESP_TIMER_TASK,
+#endif
+        .name = "timer_service",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&args, &s_hw_timer));
+
+    xTaskCreatePinnedToCore(timer_service_task, "timer_service", 3072, NULL, CONFIG_SMART_LOCK_TIMER_SERVICE_PRIORITY,
+                            &s_service_task, CONFIG_SMART_LOCK_APP_CORE);
+}
+
+/**
+ * @brief Checks whether timer_service_start() has been called.
+ *
+ * @return true if timers can be started.
+ */
+bool timer_service_running(){
+    return s_service_task != NULL;
+}
+
+/**
+ * @brief Prepares a timer for use. Must be called once before the timer is started.
+ *
+ * @param timer The timer.
+ * @param callback Called from the timer service task when the timer expires. It must not block.
+ * @param arg Passed to the callback.
+ */
+void soft_timer_init(soft_timer_t* timer, soft_timer_cb_t callback, void* arg){
+    timer->deadline_us = 0;
+    timer->period_us = 0;
+    timer->callback = callback;
+    timer->arg = arg;
+    timer->heap_index = -1;
+}
+
+/**
+ * @brief Arms a timer. If the timer is already armed it is rescheduled.
+ *
+ * @param timer The timer.
+ * @param first_us Microseconds until the first expiry.
+ * @param period_us Microseconds between expiries, 0 for a one-shot timer.
+ * @return true if the timer was armed.
+ * @return false if the service is not running or CONFIG_SMART_LOCK_MAX_TIMERS timers are already pending.
+ */
+static bool soft_timer_arm(soft_timer_t* timer, uint64_t first_us, uint64_t period_us){
+    if(!timer_service_running()){
+        return false;
+    }
+
+    portENTER_CRITICAL(&s_heap_lock);
+    if(timer->heap_index >= 0){
+        heap_remove(timer);
+    }
+    timer->deadline_us = esp_timer_get_time() + first_us;
+    timer->period_us = period_us;
+    bool inserted = heap_insert(timer);
+    bool new_earliest = inserted && timer->heap_index == 0;
+    portEXIT_CRITICAL(&s_heap_lock);
+
+    if(!inserted){
+        ESP_LOGE(TAG, "no free timer slots, increase CONFIG_SMART_LOCK_MAX_TIMERS");
+        return false;
+    }
+
+    if(new_earliest){
+        xTaskNotifyGive(s_service_task);
+    }
+
+    return true;
+}
+
+/**
+ * @brief Arms a one-shot timer.
+ *
+ * @param timer The timer.
+ * @param timeout_us Microseconds until the timer expires.
+ * @return true if the timer was armed.
+ */
+bool soft_timer_start_once(soft_timer_t* timer, uint64_t timeout_us){
+    return soft_timer_arm(timer, timeout_us, 0);
+}
+
+/**
+ * @brief Arms a periodic timer. The first expiry is one period from now.
+ *
+ * @param timer The timer.
+ * @param period_us Microseconds between expiries. Must not be 0.
+ * @return true if the timer was armed.
+ */
+bool soft_timer_start_periodic(soft_timer_t* timer, uint64_t period_us){
+    if(period_us == 0){
+        return false;
+    }
+
+    return soft_timer_arm(timer, period_us, period_us);
+}
+
+/**
+ * @brief   Disarms a timer. Does nothing if the timer is not armed. The callback may still run once if it was
+ *          already being dispatched when this was called.
+ *
+ * @param timer The timer.
+ */
+void soft_timer_stop(soft_timer_t* timer){
+    portENTER_CRITICAL(&s_heap_lock);
+    if(timer->heap_index >= 0){
+        heap_remove(timer);
+    }
+    portEXIT_CRITICAL(&s_heap_lock);
+}
+
+/**
+ * @brief Checks whether a timer is armed.
+ *
+ * @param timer The timer.
+ * @return true if the timer is waiting to expire.
+ */
+bool soft_timer_is_active(const soft_timer_t* timer){
+    return timer->heap_index >= 0;
+}
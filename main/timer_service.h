@@ -0,0 +1,50 @@
+/**
+ * @file timer_service.h
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Software timers multiplexed onto a single esp_timer.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef void (*soft_timer_cb_t)(void* arg);
+
+/**
+ * @brief   A one-shot or periodic timer. The storage is owned by the caller (usually a static or a stack variable
+ *          that outlives the timer), so arming a timer never allocates. The fields are private to timer_service.c.
+ */
+typedef struct{
+    int64_t deadline_us;
+    int64_t period_us;
+    soft_timer_cb_t callback;
+    void* arg;
+    int heap_index;
+} soft_timer_t;
+
+void timer_service_start();
+bool timer_service_running();
+
+void soft_timer_init(soft_timer_t* timer, soft_timer_cb_t callback, void* arg);
+bool soft_timer_start_once(soft_timer_t* timer, uint64_t timeout_us);
+bool soft_timer_start_periodic(soft_timer_t* timer, uint64_t period_us);
+void soft_timer_stop(soft_timer_t* timer);
+bool soft_timer_is_active(const soft_timer_t* timer);
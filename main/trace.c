@@ -0,0 +1,261 @@
+/**
+ * @file trace.c
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Opt-in execution trace: task switches, interrupts and named spans in a RAM ring.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ *
+ *  Every event is 12 bytes written into one ring shared by both cores. The slot is claimed with an atomic add,
+ *  so recording never takes a lock and works from the scheduler and from interrupts; the functions that record
+ *  live in IRAM for that reason. Old events are overwritten, so the ring always holds the most recent history.
+ *
+ *  A dump stops recording and prints one line per event, oldest first, preceded by the names of the tasks it
+ *  may refer to:
+ *
+ *      T <task id> <task name>
+ *      E <time us> <core> <S|I|B|E> <task id or name>
+ *
+ *  Task names are copied into a table the first time a task is switched in, and switch events refer to the
+ *  table. Tasks like the OTA and dump tasks delete themselves, so their handles cannot be looked up later.
+ *
+ *  tools/trace_to_perfetto.py turns that into a Chrome JSON trace that Perfetto and chrome://tracing open.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#include "mqtt.h"
+#include "trace.h"
+
+#if CONFIG_SMART_LOCK_TRACE
+
+#define TRACE_RING_SIZE (1 << CONFIG_SMART_LOCK_TRACE_RING_ORDER)
+#define TRACE_RING_MASK (TRACE_RING_SIZE - 1)
+#define MAX_TRACE_TASKS 32
+#define MQTT_CHUNK_SIZE 1024
+
+typedef struct{
+    bool to_mqtt;
+    char buffer[MQTT_CHUNK_SIZE];
+    int length;
+} dump_sink_t;
+
+static const char *TAG = "TRACE";
+
+/* A task, as it was when it was switched in. Written once; the handle is stored last. */
+typedef struct{
+    const void* volatile handle;
+    char name[configMAX_TASK_NAME_LEN];
+} trace_task_t;
+
+static trace_record_t s_ring[TRACE_RING_SIZE];
+static uint32_t s_head = 0;
+static trace_task_t s_tasks[MAX_TRACE_TASKS];
+static uint32_t s_task_count = 0;
+static volatile bool s_enabled = false;
+static volatile bool s_dumping = false;
+
+/**
+ * @brief Records one event. Callable from any task, from interrupts and from inside the scheduler. 
+ * 
+ * @param type The event type. 
+ * @param arg Task handle or name, see trace_event_type_t. 
+ */
+void IRAM_ATTR trace_event(trace_event_type_t type, const void* arg){
+    if(!s_enabled){
+        return;
+    }
+
+    uint32_t index = __atomic_fetch_add(&s_head, 1, __ATOMIC_RELAXED);
+    trace_record_t* record = &s_ring[index & TRACE_RING_MASK];
+
+    record->time_us = (uint32_t)esp_timer_get_time();
+    record->type = type;
+    record->core = xPortGetCoreID();
+    record->arg = arg;
+}
+
+/**
+ * @brief   Finds a task in the table, adding it if it is new. A deleted task's handle can be reused by a new task,
+ *          so the name has to match too. If both cores add the same task at once it gets two entries, which only
+ *          repeats a name in the dump.
+ *
+ * @param handle The task.
+ * @param name Its name, read from the TCB.
+ * @return uint32_t Index in the table, or MAX_TRACE_TASKS if the table is full.
+ */
+static uint32_t IRAM_ATTR task_index(const void* handle, const char* name){
+    uint32_t count = __atomic_load_n(&s_task_count, __ATOMIC_ACQUIRE);
+
+    for(uint32_t i = 0; i < count && i < MAX_TRACE_TASKS; i++){
+        if(s_tasks[i].handle == handle && strncmp(s_tasks[i].name, name, configMAX_TASK_NAME_LEN) == 0){
+            return i;
+        }
+    }
+
+    uint32_t index = __atomic_fetch_add(&s_task_count, 1, __ATOMIC_RELAXED);
+    if(index >= MAX_TRACE_TASKS){
+        s_task_count = MAX_TRACE_TASKS;
+        return MAX_TRACE_TASKS;
+    }
+
+    strlcpy(s_tasks[index].name, name, sizeof(s_tasks[index].name));
+    __atomic_store_n(&s_tasks[index].handle, handle, __ATOMIC_RELEASE);
+    return index;
+}
+
+void IRAM_ATTR trace_task_switched_in(const char* name){
+    if(!s_enabled){
+        return;
+    }
+
+    trace_event(TRACE_TASK_SWITCH, (const void*)(uintptr_t)task_index(xTaskGetCurrentTaskHandle(), name));
+}
+
+void IRAM_ATTR trace_tick(void){
+    trace_event(TRACE_ISR_ENTER, "tick");
+}
+
+void trace_init(){
+#if CONFIG_SMART_LOCK_TRACE_AT_BOOT
+    trace_start();
+#endif
+}
+
+void trace_start(){
+    s_head = 0;
+    s_enabled = true;
+}
+
+void trace_stop(){
+    s_enabled = false;
+}
+
+static void sink_flush(dump_sink_t* sink){
+    if(sink->length > 0){
+        mqtt_publish(TRACE_DATA_TOPIC, sink->buffer, sink->length, 1, 0);
+        sink->length = 0;
+    }
+}
+
+static void sink_line(dump_sink_t* sink, const char* line){
+    if(!sink->to_mqtt){
+        printf("%s", line);
+        return;
+    }
+
+    int length = strlen(line);
+    if(sink->length + length > sizeof(sink->buffer)){
+        sink_flush(sink);
+    }
+    memcpy(sink->buffer + sink->length, line, length);
+    sink->length += length;
+}
+
+/**
+ * @brief   Stops recording and writes the ring out, oldest event first. Recording stays stopped afterwards;
+ *          send "start" to record again. 
+ * 
+ * @param to_mqtt Publish on TRACE_DATA_TOPIC in 1 KB chunks instead of printing to the console. 
+ */
+void trace_dump(bool to_mqtt){
+    static dump_sink_t sink;
+    char line[96];
+
+    trace_stop();
+    vTaskDelay(1); // let an event being written on the other core finish
+
+    uint32_t head = s_head;
+    uint32_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+    sink.to_mqtt = to_mqtt;
+    sink.length = 0;
+
+    snprintf(line, sizeof(line), "# smart_lock trace, %u events\n", head - first);
+    sink_line(&sink, line);
+
+    // Names come from the table, never from the handles, which may belong to deleted tasks by now.
+    uint32_t task_count = s_task_count < MAX_TRACE_TASKS ? s_task_count : MAX_TRACE_TASKS;
+    for(uint32_t t = 0; t < task_count; t++){
+        if(s_tasks[t].handle != NULL){
+            snprintf(line, sizeof(line), "T %u %s\n", t, s_tasks[t].name);
+            sink_line(&sink, line);
+        }
+    }
+    snprintf(line, sizeof(line), "T %u ?\n", MAX_TRACE_TASKS);
+    sink_line(&sink, line);
+
+    for(uint32_t i = first; i != head; i++){
+        const trace_record_t* record = &s_ring[i & TRACE_RING_MASK];
+
+        if(record->type == TRACE_TASK_SWITCH){
+            snprintf(line, sizeof(line), "E %u %u S %u\n", record->time_us, record->core, (uint32_t)(uintptr_t)record->arg);
+        }else{
+            snprintf(line, sizeof(line), "E %u %u %c %s\n", record->time_us, record->core, record->type,
+                     (const char*)record->arg);
+        }
+        sink_line(&sink, line);
+    }
+
+    if(to_mqtt){
+        sink_flush(&sink);
+    }
+
+    ESP_LOGI(TAG, "dumped %u events", head - first);
+}
+
+static void dump_task(void* arg){
+    trace_dump((bool)arg);
+
+    s_dumping = false;
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief   Handles a message on TRACE_TOPIC. Dumps run on a task of their own so that the MQTT task is not held
+ *          up, and so that publishing the dump does not deadlock against it. 
+ * 
+ * @param data The command. 
+ * @param len Length of the command. 
+ */
+void trace_command(const char* data, int len){
+    if(len == 5 && strncmp(data, "start", len) == 0){
+        trace_start();
+    }else if(len == 4 && strncmp(data, "stop", len) == 0){
+        trace_stop();
+    }else if(len >= 4 && strncmp(data, "dump", 4) == 0 && !s_dumping){
+        bool to_mqtt = len == 9 && strncmp(data, "dump mqtt", len) == 0;
+
+        s_dumping = true;
+        if(xTaskCreatePinnedToCore(dump_task, "trace_dump", 3072, (void*)to_mqtt, 1, NULL,
+                                   CONFIG_SMART_LOCK_NETWORK_CORE) != pdPASS){
+            s_dumping = false;
+        }
+    }else{
+        ESP_LOGW(TAG, "unknown trace command");
+    }
+}
+
+#endif
@@ -0,0 +1,71 @@
+/**
+ * @file trace.h
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief Opt-in execution trace: task switches, interrupts and named spans in a RAM ring.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+
+/* "start", "stop", "dump" (to the console) or "dump mqtt" (to TRACE_DATA_TOPIC). */
+#define TRACE_TOPIC "/mister_nolan/trace"
+#define TRACE_DATA_TOPIC "/mister_nolan/trace/data"
+
+typedef enum{
+    TRACE_TASK_SWITCH = 'S',    // arg is the index of the task now running on the core in the task table
+    TRACE_ISR_ENTER = 'I',      // arg is the interrupt's name
+    TRACE_SPAN_BEGIN = 'B',     // arg is the span's name
+    TRACE_SPAN_END = 'E'
+} trace_event_type_t;
+
+/* 12 bytes per event. Names must be string literals; only the pointer is stored. */
+typedef struct{
+    uint32_t time_us;
+    uint8_t type;
+    uint8_t core;
+    uint16_t reserved;
+    const void* arg;
+} trace_record_t;
+
+#if CONFIG_SMART_LOCK_TRACE
+
+void trace_init();
+void trace_start();
+void trace_stop();
+void trace_event(trace_event_type_t type, const void* arg);
+void trace_dump(bool to_mqtt);
+void trace_command(const char* data, int len);
+
+#define TRACE_BEGIN(name) trace_event(TRACE_SPAN_BEGIN, name)
+#define TRACE_END(name) trace_event(TRACE_SPAN_END, name)
+#define TRACE_ISR(name) trace_event(TRACE_ISR_ENTER, name)
+
+#else
+
+#define trace_init() do{ }while(0)
+#define trace_command(data, len) do{ (void)(data); (void)(len); }while(0)
+#define TRACE_BEGIN(name) do{ }while(0)
+#define TRACE_END(name) do{ }while(0)
+#define TRACE_ISR(name) do{ }while(0)
+
+#endif
@@ -0,0 +1,41 @@
+/**
+ * @file trace_hooks.h
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief FreeRTOS trace macros for trace.c. Force included into every C file of the build.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ *
+ *  The project CMakeLists.txt adds this header to every C compile so that the definitions are in place before
+ *  FreeRTOS.h supplies its empty defaults. Keep it free of anything but declarations.
+ */
+
+#pragma once
+
+#include "sdkconfig.h"
+
+#if CONFIG_SMART_LOCK_TRACE && !defined(__ASSEMBLER__)
+
+void trace_task_switched_in(const char* name);
+void trace_tick(void);
+
+/* Only expanded inside the kernel's tasks.c, where the TCB is visible. The name is copied at switch time, since
+ * the task may be deleted before the trace is dumped. */
+#define traceTASK_SWITCHED_IN() trace_task_switched_in(pxCurrentTCB[xPortGetCoreID()]->pcTaskName)
+#define traceTASK_INCREMENT_TICK(xTickCount) trace_tick()
+
+#endif
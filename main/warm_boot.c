@@ -0,0 +1,205 @@
+/**
+ * @file warm_boot.c
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief State snapshot in RTC memory, used to resume quickly after a reset that kept power.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ *
+ *  RTC slow memory keeps its contents through software resets, panics, watchdog resets and deep sleep, but not
+ *  through a power cycle. Whenever the lock, the LCD, the Wi-Fi association or the active broker changes, the
+ *  snapshot is updated and its CRC recomputed. At boot warm_boot_begin() decides whether the reset kept power
+ *  and the snapshot is intact; if so the rest of the boot restores from it instead of starting from scratch:
+ *
+ *  - the actuator takes over without moving the bolt (the servo PWM starts at the saved duty); a lock that was
+ *    open is then closed, since its relock timer did not survive the reset,
+ *  - the LCD keeps its contents and only the bus is set up again,
+ *  - Wi-Fi joins the saved BSSID on the saved channel without a scan and reuses the saved IP without DHCP,
+ *  - MQTT goes straight to the broker the session was on.
+ *
+ *  A snapshot that keeps leading to resets is dropped after CONFIG_SMART_LOCK_WARM_BOOT_MAX_RETRIES warm boots
+ *  that never reach the broker. The time to each milestone is logged and published once on the event topic.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "esp_attr.h"
+#include "esp_crc.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_ota_ops.h"
+#include "esp_log.h"
+
+#include "mqtt.h"
+#include "lock_config.h"
+#include "fast_log.h"
+#include "warm_boot.h"
+
+#define SNAPSHOT_MAGIC 0x534C5742 // "SLWB"
+
+static const char *TAG = "WARM_BOOT";
+
+RTC_NOINIT_ATTR static warm_boot_snapshot_t s_snapshot;
+
+static portMUX_TYPE s_snapshot_lock = portMUX_INITIALIZER_UNLOCKED;
+static warm_boot_snapshot_t s_restored;
+static bool s_warm = false;
+static int64_t s_milestone_us[WARM_BOOT_MILESTONE_COUNT];
+
+static uint32_t snapshot_crc(const warm_boot_snapshot_t* snapshot){
+    return esp_crc32_le(0, (const uint8_t*)snapshot, offsetof(warm_boot_snapshot_t, crc));
+}
+
+/* Call with s_snapshot_lock held, after changing s_snapshot. */
+static void seal(){
+    s_snapshot.crc = snapshot_crc(&s_snapshot);
+}
+
+static bool reset_kept_power(esp_reset_reason_t reason){
+    switch(reason){
+    case ESP_RST_SW:
+    case ESP_RST_PANIC:
+    case ESP_RST_INT_WDT:
+    case ESP_RST_TASK_WDT:
+    case ESP_RST_WDT:
+    case ESP_RST_DEEPSLEEP:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief   Checks the snapshot left by the previous run and starts a new one. Must be the first thing app_main()
+ *          does, before anything saves into the snapshot. 
+ * 
+ * @return true if this is a warm boot and warm_boot_restored() has the previous state. 
+ */
+bool warm_boot_begin(){
+    char app_sha[sizeof(s_snapshot.app_sha)];
+    esp_reset_reason_t reason = esp_reset_reason();
+
+    esp_ota_get_app_elf_sha256(app_sha, sizeof(app_sha));
+
+    s_warm = reset_kept_power(reason) &&
+             s_snapshot.magic == SNAPSHOT_MAGIC &&
+             s_snapshot.crc == snapshot_crc(&s_snapshot) &&
+             memcmp(s_snapshot.app_sha, app_sha, sizeof(app_sha)) == 0;
+
+    if(s_warm && s_snapshot.warm_boots >= CONFIG_SMART_LOCK_WARM_BOOT_MAX_RETRIES){
+        ESP_LOGW(TAG, "%u warm boots without reaching the broker, starting cold", s_snapshot.warm_boots);
+        s_warm = false;
+    }
+
+    if(s_warm){
+        s_restored = s_snapshot;
+        s_snapshot.warm_boots++;
+    }else{
+        memset(&s_snapshot, 0, sizeof(s_snapshot));
+        s_snapshot.magic = SNAPSHOT_MAGIC;
+        memcpy(s_snapshot.app_sha, app_sha, sizeof(app_sha));
+        s_snapshot.lock_state = CLOSED;
+        s_snapshot.broker_index = -1;
+    }
+    seal();
+
+    ESP_LOGI(TAG, "%s boot (reset reason %d)", s_warm ? "warm" : "cold", reason);
+
+    return s_warm;
+}
+
+/**
+ * @brief The state saved by the previous run. 
+ * 
+ * @return const warm_boot_snapshot_t* The snapshot, or NULL on a cold boot. 
+ */
+const warm_boot_snapshot_t* warm_boot_restored(){
+    return s_warm ? &s_restored : NULL;
+}
+
+void warm_boot_save_lock(lock_state_t state, float duty){
+    portENTER_CRITICAL(&s_snapshot_lock);
+    s_snapshot.lock_state = state;
+    s_snapshot.servo_duty = duty;
+    seal();
+    portEXIT_CRITICAL(&s_snapshot_lock);
+}
+
+void warm_boot_save_display(const char* line0, const char* line1){
+    portENTER_CRITICAL(&s_snapshot_lock);
+    strlcpy(s_snapshot.lcd_lines[0], line0, sizeof(s_snapshot.lcd_lines[0]));
+    strlcpy(s_snapshot.lcd_lines[1], line1, sizeof(s_snapshot.lcd_lines[1]));
+    seal();
+    portEXIT_CRITICAL(&s_snapshot_lock);
+}
+
+void warm_boot_save_wifi(const uint8_t bssid[6], uint8_t channel, uint8_t network,
+                         const esp_netif_ip_info_t* ip_info, const esp_ip4_addr_t* dns){
+    portENTER_CRITICAL(&s_snapshot_lock);
+    memcpy(s_snapshot.bssid, bssid, sizeof(s_snapshot.bssid));
+    s_snapshot.channel = channel;
+    s_snapshot.network = network;
+    s_snapshot.ip_info = *ip_info;
+    s_snapshot.dns = *dns;
+    seal();
+    portEXIT_CRITICAL(&s_snapshot_lock);
+}
+
+/**
+ * @brief Records the broker the MQTT session is on. Reaching a broker also proves the snapshot is good. 
+ * 
+ * @param index Index into the broker list. 
+ */
+void warm_boot_save_broker(int index){
+    portENTER_CRITICAL(&s_snapshot_lock);
+    s_snapshot.broker_index = index;
+    s_snapshot.warm_boots = 0;
+    seal();
+    portEXIT_CRITICAL(&s_snapshot_lock);
+}
+
+/**
+ * @brief   Records how long after reset a part of the system became ready. When MQTT is ready the timings are
+ *          logged and published once on the event topic, for comparing warm and cold boots. 
+ * 
+ * @param milestone The milestone. Only the first time each is reached counts. 
+ */
+void warm_boot_milestone(warm_boot_milestone_t milestone){
+    if(milestone >= WARM_BOOT_MILESTONE_COUNT || s_milestone_us[milestone] != 0){
+        return;
+    }
+    s_milestone_us[milestone] = esp_timer_get_time();
+
+    if(milestone != WARM_BOOT_MQTT_READY){
+        return;
+    }
+
+    char report[128];
+    snprintf(report, sizeof(report), "{\"boot\":\"%s\",\"lock_us\":%lld,\"wifi_ms\":%lld,\"mqtt_ms\":%lld}",
+             s_warm ? "warm" : "cold", s_milestone_us[WARM_BOOT_LOCK_READY],
+             s_milestone_us[WARM_BOOT_WIFI_READY] / 1000, s_milestone_us[WARM_BOOT_MQTT_READY] / 1000);
+
+    char event_topic[64];
+    LOCK_CONFIG_GET(event_topic, event_topic);
+
+    ESP_LOGI(TAG, "resume: %s", report);
+    mqtt_publish(event_topic, report, 0, 1, 0);
+}
@@ -0,0 +1,70 @@
+/**
+ * @file warm_boot.h
+ * @author Nolan Davenport (nolanrdavenport@gmail.com)
+ * @brief State snapshot in RTC memory, used to resume quickly after a reset that kept power.
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2022
+ *
+ *  This file is part of smart_lock.
+ *
+ *  smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+ *  GNU General Public License as published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  smart_lock is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ *  even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Foobar. If not,
+ *  see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_netif.h"
+#include "HD44780.h"
+#include "lock_actuation.h"
+
+typedef struct{
+    uint32_t magic;
+    char app_sha[9];            // first 8 hex digits of the firmware's ELF SHA-256; a snapshot only fits its own build
+    uint8_t warm_boots;         // consecutive warm boots without reaching the broker
+
+    uint8_t lock_state;         // lock_state_t
+    float servo_duty;           // PWM duty the servo actuator was left at; unused by the other actuators
+
+    char lcd_lines[2][LCD_LINE_LENGTH + 1];
+
+    uint8_t bssid[6];
+    uint8_t channel;            // 0 if Wi-Fi was never connected
+    uint8_t network;            // index into wifi_networks in lock_config_t
+    esp_netif_ip_info_t ip_info;
+    esp_ip4_addr_t dns;
+
+    int8_t broker_index;        // broker the MQTT session was on, -1 if none
+
+    uint32_t crc;               // must stay last, covers everything before it
+} warm_boot_snapshot_t;
+
+typedef enum{
+    WARM_BOOT_LOCK_READY,
+    WARM_BOOT_WIFI_READY,
+    WARM_BOOT_MQTT_READY,
+    WARM_BOOT_MILESTONE_COUNT
+} warm_boot_milestone_t;
+
+bool warm_boot_begin();
+const warm_boot_snapshot_t* warm_boot_restored();
+
+void warm_boot_save_lock(lock_state_t state, float duty);
+void warm_boot_save_display(const char* line0, const char* line1);
+void warm_boot_save_wifi(const uint8_t bssid[6], uint8_t channel, uint8_t network,
+                         const esp_netif_ip_info_t* ip_info, const esp_ip4_addr_t* dns);
+void warm_boot_save_broker(int index);
+
+void warm_boot_milestone(warm_boot_milestone_t milestone);
@@ -19,9 +19,25 @@
  *  
  *  You should have received a copy of the GNU General Public License along with Foobar. If not, 
  *  see <https://www.gnu.org/licenses/>. 
+ *
+ *  The lock may know several networks (wifi_networks in lock_config_t), each possibly served by several APs. One
+ *  scan is ranked into a list of candidates, best first: signal strength, plus a little for each time an AP has
+ *  worked and a lot less for each time it has refused us. Failed joins move down that cached list without
+ *  scanning again; only when it runs out does the station scan again. After a drop the AP that last worked is
+ *  tried first.
+ *
+ *  Once connected, the driver reports when the signal falls below CONFIG_SMART_LOCK_ROAM_RSSI. If the AP
+ *  supports 802.11v the station asks it where to go, and the supplicant follows its transition request, using
+ *  the 802.11k beacon reports the AP may have asked for. Otherwise, or if the AP does not answer, the station
+ *  scans in the background and moves to the best candidate if it is CONFIG_SMART_LOCK_ROAM_HYSTERESIS dB
+ *  stronger. Both keep the IP address, so MQTT rides out the handover instead of reconnecting.
+ *
+ *  Every connect and roam is reported on WIFI_TOPIC with the time to associate and the time to get an address.
  */
 
+#include <stdio.h>
 #include <string.h>
+#include <sys/param.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
@@ -29,14 +45,35 @@
 #include "esp_wifi.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
+#if CONFIG_WPA_11KV_SUPPORT
+#include "esp_wnm.h"
+#endif
 #include "wifi.h"
+#include "mqtt.h"
+#include "lock_config.h"
+#include "warm_boot.h"
+#include "timer_service.h"
+#include "status_display.h"
 
 #include "lwip/err.h"
 #include "lwip/sys.h"
 
+/* Attempts before connect_to_wifi() stops waiting. The station keeps trying in the background after that. */
 #define ESP_MAXIMUM_RETRY  10
 
+#define WIFI_MAX_SCAN_RECORDS 20
+#define WIFI_MAX_CANDIDATES 8
+#define WIFI_HISTORY_LENGTH 8
+#define WIFI_HISTORY_BONUS_DB 3         // per time an AP has worked, up to three
+#define WIFI_HISTORY_PENALTY_DB 10      // per time an AP has refused us, up to three
+#define WIFI_HIDDEN_SCORE -1000         // networks the scan did not see are tried last, by name
+#define WIFI_FRESH_SCAN_US (10 * 1000 * 1000LL)
+#define WIFI_RESCAN_DELAY_US (10 * 1000 * 1000ULL)
+#define WIFI_BTM_WAIT_US (2 * 1000 * 1000ULL)
+#define WIFI_ROAM_COOLDOWN_US (30 * 1000 * 1000ULL)
+
 /* FreeRTOS event group to signal when we are connected */
 static EventGroupHandle_t s_wifi_event_group;
 
@@ -46,10 +83,414 @@ static EventGroupHandle_t s_wifi_event_group;
 #define WIFI_CONNECTED_BIT BIT0
 #define WIFI_FAIL_BIT      BIT1
 
+/* Events of our own, so that timers hand their work to the event loop task along with everything else. */
+ESP_EVENT_DEFINE_BASE(WIFI_SELECT_EVENT);
+
+enum {
+    WIFI_SELECT_RESCAN,
+    WIFI_SELECT_ROAM_SCAN
+};
+
+typedef struct{
+    uint8_t bssid[6];
+    uint8_t channel;    // 0 to join by name alone, for a network the scan did not see
+    uint8_t network;    // index into s_networks
+    int8_t rssi;
+    int16_t score;
+} wifi_candidate_t;
+
+typedef struct{
+    uint8_t bssid[6];
+    uint8_t successes;
+    uint8_t failures;
+} wifi_history_t;
+
 static const char *TAG = "wifi station";
 
 static int s_retry_num = 0;
 
+static esp_netif_t* s_netif = NULL;
+static wifi_config_t s_wifi_config;
+static bool s_fast_connect = false;
+static bool s_static_ip = false;
+static volatile int64_t s_associated_us = 0;
+
+/* Only touched by the event loop task. */
+static lock_wifi_network_t s_networks[LOCK_CONFIG_MAX_NETWORKS];   // copied from the config on every scan
+static wifi_ap_record_t s_scan_records[WIFI_MAX_SCAN_RECORDS];
+static wifi_candidate_t s_candidates[WIFI_MAX_CANDIDATES];     // best first
+static int s_candidate_count = 0;
+static int s_next_candidate = 0;
+static int64_t s_scanned_us = 0;
+static wifi_history_t s_history[WIFI_HISTORY_LENGTH];
+static int s_history_next = 0;
+
+static wifi_candidate_t s_target;           // the AP being joined, or joined
+static bool s_target_associated = false;
+static wifi_candidate_t s_home;             // the AP that last gave us an address
+static bool s_retry_home = false;
+static bool s_scanning = false;
+static bool s_roam_scan = false;            // the scan in progress is looking for a better AP
+static bool s_roaming = false;              // handing over to another AP; the next address ends a roam
+static bool s_have_roam_target = false;
+static wifi_candidate_t s_roam_target;
+static bool s_btm_pending = false;          // a transition query is waiting on the AP
+static uint8_t s_btm_bssid[6];              // AP the query was sent to
+static int64_t s_attempt_us = 0;            // when the current connect or roam started, 0 if connected
+static uint32_t s_roams = 0;
+
+static soft_timer_t s_rescan_timer;
+static soft_timer_t s_roam_timer;
+static soft_timer_t s_rearm_timer;
+
+/**
+ * @brief Saves the association and address for the next warm boot. 
+ * 
+ * @param ip_info The address just obtained. 
+ */
+static void save_for_warm_boot(const esp_netif_ip_info_t* ip_info){
+    wifi_ap_record_t ap;
+    esp_netif_dns_info_t dns;
+
+    if(esp_wifi_sta_get_ap_info(&ap) != ESP_OK){
+        return;
+    }
+    if(esp_netif_get_dns_info(s_netif, ESP_NETIF_DNS_MAIN, &dns) != ESP_OK){
+        dns.ip.u_addr.ip4.addr = 0;
+    }
+
+    warm_boot_save_wifi(ap.bssid, ap.primary, s_target.network, ip_info, &dns.ip.u_addr.ip4);
+}
+
+/**
+ * @brief   Sets up a warm boot reconnect: join the saved BSSID on its channel, which skips the scan, and reuse the
+ *          saved address (CONFIG_SMART_LOCK_WARM_BOOT_REUSE_IP), which skips DHCP. 
+ * 
+ * @return true if there was something to restore. 
+ */
+static bool prepare_fast_connect(){
+    const warm_boot_snapshot_t* restored = warm_boot_restored();
+
+    LOCK_CONFIG_GET(s_networks, wifi_networks);
+
+    if(restored == NULL || restored->channel == 0 || restored->ip_info.ip.addr == 0 ||
+       restored->network >= LOCK_CONFIG_MAX_NETWORKS || s_networks[restored->network].ssid[0] == '\0'){
+        return false;
+    }
+
+    memcpy(s_target.bssid, restored->bssid, sizeof(s_target.bssid));
+    s_target.channel = restored->channel;
+    s_target.network = restored->network;
+
+#if CONFIG_SMART_LOCK_WARM_BOOT_REUSE_IP
+    esp_netif_dhcpc_stop(s_netif);
+    esp_netif_set_ip_info(s_netif, &restored->ip_info);
+    s_static_ip = true;
+
+    if(restored->dns.addr != 0){
+        esp_netif_dns_info_t dns = {
+            .ip.type = ESP_IPADDR_TYPE_V4,
+            .ip.u_addr.ip4 = restored->dns,
+        };
+        esp_netif_set_dns_info(s_netif, ESP_NETIF_DNS_MAIN, &dns);
+    }
+#endif
+
+    return true;
+}
+
+/**
+ * @brief The saved AP is gone or has moved. Go back to a normal scan and DHCP. 
+ * 
+ */
+static void abandon_fast_connect(){
+    ESP_LOGW(TAG, "saved AP not reachable, scanning");
+
+    s_fast_connect = false;
+}
+
+/**
+ * @brief Finds the history of an AP, making room for it if it has none.
+ *
+ * @param bssid The AP.
+ * @return wifi_history_t* Its history.
+ */
+static wifi_history_t* history_of(const uint8_t bssid[6]){
+    for (int i = 0; i < WIFI_HISTORY_LENGTH; i++) {
+        if (memcmp(s_history[i].bssid, bssid, 6) == 0) {
+            return &s_history[i];
+        }
+    }
+
+    // Replaces the entry made longest ago.
+    wifi_history_t* entry = &s_history[s_history_next];
+    s_history_next = (s_history_next + 1) % WIFI_HISTORY_LENGTH;
+    memset(entry, 0, sizeof(*entry));
+    memcpy(entry->bssid, bssid, 6);
+
+    return entry;
+}
+
+static int history_score(const uint8_t bssid[6]){
+    for (int i = 0; i < WIFI_HISTORY_LENGTH; i++) {
+        if (memcmp(s_history[i].bssid, bssid, 6) == 0) {
+            return WIFI_HISTORY_BONUS_DB * MIN(s_history[i].successes, 3) -
+                   WIFI_HISTORY_PENALTY_DB * MIN(s_history[i].failures, 3);
+        }
+    }
+    return 0;
+}
+
+static int network_index(const char* ssid){
+    for (int i = 0; i < LOCK_CONFIG_MAX_NETWORKS; i++) {
+        const char* known = s_networks[i].ssid;
+        if (known[0] != '\0' && strcmp(known, ssid) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Adds a candidate to the ranked list, dropping the worst one if the list is full.
+ *
+ * @param candidate The candidate.
+ */
+static void add_candidate(const wifi_candidate_t* candidate){
+    int i;
+
+    if (s_candidate_count < WIFI_MAX_CANDIDATES) {
+        i = s_candidate_count++;
+    } else if (s_candidates[WIFI_MAX_CANDIDATES - 1].score < candidate->score) {
+        // Full: the new one pushes out the worst.
+        i = WIFI_MAX_CANDIDATES - 1;
+    } else {
+        return;
+    }
+    while (i > 0 && s_candidates[i - 1].score < candidate->score) {
+        s_candidates[i] = s_candidates[i - 1];
+        i--;
+    }
+    s_candidates[i] = *candidate;
+}
+
+/**
+ * @brief Turns the results of a scan into the ranked list of candidates.
+ *
+ */
+static void rank_scan(){
+    uint16_t count = WIFI_MAX_SCAN_RECORDS;
+    bool seen[LOCK_CONFIG_MAX_NETWORKS] = {false};
+
+    if (esp_wifi_scan_get_ap_records(&count, s_scan_records) != ESP_OK) {
+        count = 0;
+    }
+
+    // Config changes take effect here; candidates index this copy.
+    LOCK_CONFIG_GET(s_networks, wifi_networks);
+
+    s_candidate_count = 0;
+    s_next_candidate = 0;
+    s_scanned_us = esp_timer_get_time();
+
+    for (int i = 0; i < count; i++) {
+        const wifi_ap_record_t* ap = &s_scan_records[i];
+        int network = network_index((const char*)ap->ssid);
+        if (network < 0) {
+            continue;
+        }
+        seen[network] = true;
+
+        wifi_candidate_t candidate = {
+            .channel = ap->primary,
+            .network = network,
+            .rssi = ap->rssi,
+            .score = ap->rssi + history_score(ap->bssid),
+        };
+        memcpy(candidate.bssid, ap->bssid, sizeof(candidate.bssid));
+        add_candidate(&candidate);
+    }
+
+    // A network the scan did not see may be hidden; it can still be joined by name.
+    for (int i = 0; i < LOCK_CONFIG_MAX_NETWORKS; i++) {
+        if (!seen[i] && s_networks[i].ssid[0] != '\0') {
+            wifi_candidate_t candidate = {
+                .network = i,
+                .rssi = INT8_MIN,
+                .score = WIFI_HIDDEN_SCORE,
+            };
+            add_candidate(&candidate);
+        }
+    }
+}
+
+static void start_scan(bool roam){
+    wifi_scan_config_t scan_config = {
+        .show_hidden = false,
+        .scan_type = WIFI_SCAN_TYPE_ACTIVE,
+        .scan_time.active.max = 120,
+    };
+
+    if (s_scanning) {
+        return;
+    }
+
+    if (esp_wifi_scan_start(&scan_config, false) == ESP_OK) {
+        s_scanning = true;
+        s_roam_scan = roam;
+    } else if (!roam) {
+        soft_timer_start_once(&s_rescan_timer, WIFI_RESCAN_DELAY_US);
+    }
+}
+
+/**
+ * @brief Starts joining a candidate. The outcome arrives as a connected or disconnected event.
+ *
+ * @param candidate The candidate.
+ */
+static void join(const wifi_candidate_t* candidate){
+    const lock_wifi_network_t* network = &s_networks[candidate->network];
+
+    s_target = *candidate;
+    s_target_associated = false;
+
+    strlcpy((char*)s_wifi_config.sta.ssid, network->ssid, sizeof(s_wifi_config.sta.ssid));
+    strlcpy((char*)s_wifi_config.sta.password, network->password, sizeof(s_wifi_config.sta.password));
+    s_wifi_config.sta.threshold.authmode = network->password[0] != '\0' ? WIFI_AUTH_WPA2_PSK : WIFI_AUTH_OPEN;
+    s_wifi_config.sta.bssid_set = candidate->channel != 0;
+    memcpy(s_wifi_config.sta.bssid, candidate->bssid, sizeof(s_wifi_config.sta.bssid));
+    s_wifi_config.sta.channel = candidate->channel;
+
+    esp_wifi_set_config(WIFI_IF_STA, &s_wifi_config);
+    esp_wifi_connect();
+}
+
+/**
+ * @brief   Joins the next candidate from the cached scan. Once every candidate has been tried, scans again: at once if
+ *          the scan is old, otherwise after a pause.
+ *
+ */
+static void join_next(){
+    if (s_next_candidate < s_candidate_count) {
+        join(&s_candidates[s_next_candidate++]);
+        return;
+    }
+
+    if (s_retry_num < ESP_MAXIMUM_RETRY) {
+        s_retry_num++;
+        ESP_LOGI(TAG, "retry to connect to the AP");
+    } else {
+        xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
+    }
+
+    if (esp_timer_get_time() - s_scanned_us > WIFI_FRESH_SCAN_US) {
+        start_scan(false);
+    } else {
+        soft_timer_start_once(&s_rescan_timer, WIFI_RESCAN_DELAY_US);
+    }
+}
+
+/**
+ * @brief   The signal has dropped below CONFIG_SMART_LOCK_ROAM_RSSI. Asks the AP for a transition if it supports
+ *          802.11v, and looks for a better AP ourselves otherwise.
+ *
+ * @param rssi The signal strength that triggered it.
+ */
+static void start_roam(int rssi){
+    wifi_ap_record_t ap;
+
+    if (!(xEventGroupGetBits(s_wifi_event_group) & WIFI_CONNECTED_BIT) || s_roaming ||
+        esp_wifi_sta_get_ap_info(&ap) != ESP_OK) {
+        return;
+    }
+
+    ESP_LOGI(TAG, "signal down to %d dBm, looking for a better AP", rssi);
+
+#if CONFIG_WPA_11KV_SUPPORT
+    if (esp_wnm_is_btm_supported_connection() &&
+        esp_wnm_send_bss_transition_mgmt_query(REASON_FRAME_LOSS, NULL, 0) == 0) {
+        // If the AP answers with a transition request, the supplicant moves and a roaming disconnect follows.
+        memcpy(s_btm_bssid, ap.bssid, sizeof(s_btm_bssid));
+        s_btm_pending = true;
+        soft_timer_start_once(&s_roam_timer, WIFI_BTM_WAIT_US);
+        return;
+    }
+#endif
+
+    start_scan(true);
+}
+
+/**
+ * @brief A background scan has finished. Moves to the best candidate if it is clearly stronger than the current AP.
+ *
+ */
+static void roam_if_better(){
+    wifi_ap_record_t current;
+
+    if (!(xEventGroupGetBits(s_wifi_event_group) & WIFI_CONNECTED_BIT) || esp_wifi_sta_get_ap_info(&current) != ESP_OK) {
+        return;
+    }
+
+    const wifi_candidate_t* best = s_candidate_count > 0 ? &s_candidates[0] : NULL;
+
+    if (best != NULL && best->channel != 0 && memcmp(best->bssid, current.bssid, 6) != 0 &&
+        best->rssi >= current.rssi + CONFIG_SMART_LOCK_ROAM_HYSTERESIS) {
+        ESP_LOGI(TAG, "roaming from " MACSTR " (%d dBm) to " MACSTR " (%d dBm)",
+                 MAC2STR(current.bssid), current.rssi, MAC2STR(best->bssid), best->rssi);
+
+        // The disconnect event joins the target; the address is kept, so the MQTT session survives.
+        s_roam_target = *best;
+        s_have_roam_target = true;
+        s_roaming = true;
+        s_attempt_us = esp_timer_get_time();
+        esp_wifi_disconnect();
+        return;
+    }
+
+    // Nothing better in range. Ask to be told again, after a pause, if the signal is still low then.
+    soft_timer_start_once(&s_rearm_timer, WIFI_ROAM_COOLDOWN_US);
+}
+
+/**
+ * @brief Reports a connect or roam on WIFI_TOPIC, once MQTT is up, and in the log.
+ *
+ * @param now_us When the station got its address.
+ */
+static void report_connection(int64_t now_us){
+    wifi_ap_record_t ap;
+    char payload[192];
+
+    int rssi = esp_wifi_sta_get_ap_info(&ap) == ESP_OK ? ap.rssi : 0;
+    int64_t associate_us = s_associated_us > s_attempt_us ? s_associated_us - s_attempt_us : 0;
+
+    snprintf(payload, sizeof(payload),
+             "{\"event\":\"%s\",\"network\":%u,\"bssid\":\"" MACSTR "\",\"channel\":%u,\"rssi\":%d,"
+             "\"associate_us\":%lld,\"ip_us\":%lld,\"roams\":%u}",
+             s_roaming ? "roam" : "connect", s_target.network, MAC2STR(s_target.bssid), s_target.channel, rssi,
+             associate_us, now_us - s_attempt_us, s_roams);
+    ESP_LOGI(TAG, "%s", payload);
+
+    // Queued rather than published, so the event loop never waits on the socket.
+    if (client != NULL) {
+        esp_mqtt_client_enqueue(client, WIFI_TOPIC, payload, 0, 1, 0, true);
+    }
+}
+
+static void post_event(int32_t event_id){
+    esp_event_post(WIFI_SELECT_EVENT, event_id, NULL, 0, 0);
+}
+
+static void rescan_timer_callback(void* arg){
+    post_event(WIFI_SELECT_RESCAN);
+}
+
+static void roam_timer_callback(void* arg){
+    post_event(WIFI_SELECT_ROAM_SCAN);
+}
+
+static void rearm_timer_callback(void* arg){
+    esp_wifi_set_rssi_threshold(CONFIG_SMART_LOCK_ROAM_RSSI);
+}
 
 /**
  * @brief Handles WiFi events.
@@ -63,21 +504,127 @@ static void event_handler(void* arg, esp_event_base_t event_base,
                                 int32_t event_id, void* event_data)
 {
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
-        esp_wifi_connect();
+        s_attempt_us = esp_timer_get_time();
+        if (s_fast_connect) {
+            join(&s_target);
+        } else {
+            start_scan(false);
+        }
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_SCAN_DONE) {
+        s_scanning = false;
+        rank_scan();
+        if (s_roam_scan) {
+            s_roam_scan = false;
+            roam_if_better();
+        } else {
+            join_next();
+        }
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+        wifi_event_sta_connected_t* event = (wifi_event_sta_connected_t*) event_data;
+        s_associated_us = esp_timer_get_time();
+        s_target_associated = true;
+        // An 802.11v transition picks its own AP.
+        memcpy(s_target.bssid, event->bssid, sizeof(s_target.bssid));
+        s_target.channel = event->channel;
+        esp_wifi_set_rssi_threshold(CONFIG_SMART_LOCK_ROAM_RSSI);
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_BSS_RSSI_LOW) {
+        start_roam(((wifi_event_bss_rssi_low_t*) event_data)->rssi);
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        if (s_retry_num < ESP_MAXIMUM_RETRY) {
-            esp_wifi_connect();
-            s_retry_num++;
-            ESP_LOGI(TAG, "retry to connect to the AP");
+        wifi_event_sta_disconnected_t* event = (wifi_event_sta_disconnected_t*) event_data;
+        xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+        status_display_set_network(NULL);
+        if (s_fast_connect) {
+            abandon_fast_connect();
+        }
+        if (s_static_ip) {
+            // The reused address only lasts for the association it was restored for.
+            esp_netif_dhcpc_start(s_netif);
+            s_static_ip = false;
+        }
+        if (s_btm_pending) {
+            // The AP answered the transition query and the supplicant is moving to the AP it named. If it is not
+            // back by the time the wait runs out, the roam scan timer rejoins on our own.
+            s_roaming = true;
+            s_target_associated = false;
+            s_attempt_us = esp_timer_get_time();
+            return;
+        }
+        if (!s_target_associated && s_target.channel != 0) {
+            wifi_history_t* history = history_of(s_target.bssid);
+            if (history->failures < UINT8_MAX) {
+                history->failures++;
+            }
+        }
+        s_target_associated = false;
+
+        if (s_have_roam_target) {
+            s_have_roam_target = false;
+            join(&s_roam_target);
+            return;
+        }
+
+        // A roam that did not get through is an ordinary reconnect from here on.
+        s_roaming = false;
+        if (s_attempt_us == 0) {
+            s_attempt_us = esp_timer_get_time();
+        }
+        ESP_LOGI(TAG, "connect to the AP fail, reason %d", event->reason);
+
+        if (s_scanning) {
+            // The scan finishing picks up from here, with fresh results.
+            s_roam_scan = false;
+        } else if (s_retry_home) {
+            s_retry_home = false;
+            join(&s_home);
         } else {
-            xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
+            join_next();
         }
-        ESP_LOGI(TAG,"connect to the AP fail");
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
+        int64_t now_us = esp_timer_get_time();
         ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
+        char address[16];
+        snprintf(address, sizeof(address), IPSTR, IP2STR(&event->ip_info.ip));
+        status_display_set_network(address);
         s_retry_num = 0;
+        s_fast_connect = false;
+
+        wifi_history_t* history = history_of(s_target.bssid);
+        if (history->successes < UINT8_MAX) {
+            history->successes++;
+        }
+        history->failures = 0;
+
+        if (s_roaming) {
+            s_roams++;
+        }
+        s_btm_pending = false;
+        report_connection(now_us);
+        s_roaming = false;
+        s_attempt_us = 0;
+
+        // After a drop, this AP is tried again first, then the cached list from the top.
+        s_home = s_target;
+        s_retry_home = true;
+        s_next_candidate = 0;
+
+        save_for_warm_boot(&event->ip_info);
+        warm_boot_milestone(WARM_BOOT_WIFI_READY);
         xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+    } else if (event_base == WIFI_SELECT_EVENT && event_id == WIFI_SELECT_RESCAN) {
+        if (!(xEventGroupGetBits(s_wifi_event_group) & WIFI_CONNECTED_BIT) && !s_target_associated) {
+            start_scan(false);
+        }
+    } else if (event_base == WIFI_SELECT_EVENT && event_id == WIFI_SELECT_ROAM_SCAN) {
+        wifi_ap_record_t ap;
+        s_btm_pending = false;
+        if (s_roaming && !s_target_associated) {
+            // The transition did not get through.
+            join(&s_home);
+        } else if (!s_roaming && esp_wifi_sta_get_ap_info(&ap) == ESP_OK && memcmp(ap.bssid, s_btm_bssid, 6) == 0) {
+            // The AP did not answer, or had nowhere better to send us.
+            start_scan(true);
+        }
     }
 }
 
@@ -89,16 +636,21 @@ void wifi_init_sta(void)
 {
     s_wifi_event_group = xEventGroupCreate();
 
+    soft_timer_init(&s_rescan_timer, rescan_timer_callback, NULL);
+    soft_timer_init(&s_roam_timer, roam_timer_callback, NULL);
+    soft_timer_init(&s_rearm_timer, rearm_timer_callback, NULL);
+
     ESP_ERROR_CHECK(esp_netif_init());
 
     ESP_ERROR_CHECK(esp_event_loop_create_default());
-    esp_netif_create_default_wifi_sta();
+    s_netif = esp_netif_create_default_wifi_sta();
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
 
     esp_event_handler_instance_t instance_any_id;
     esp_event_handler_instance_t instance_got_ip;
+    esp_event_handler_instance_t instance_select;
     ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
                                                         ESP_EVENT_ANY_ID,
                                                         &event_handler,
@@ -109,17 +661,25 @@ void wifi_init_sta(void)
                                                         &event_handler,
                                                         NULL,
                                                         &instance_got_ip));
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_SELECT_EVENT,
+                                                        ESP_EVENT_ANY_ID,
+                                                        &event_handler,
+                                                        NULL,
+                                                        &instance_select));
 
-    wifi_config_t wifi_config = {
-        .sta = {
-            .ssid = SSID,
-            .password = PW,
-	        .threshold.authmode = WIFI_AUTH_WPA2_PSK,
-        },
-    };
+    memset(&s_wifi_config, 0, sizeof(s_wifi_config));
+#if CONFIG_WPA_11KV_SUPPORT
+    // Lets the AP collect beacon reports from us (802.11k) and steer us to a better AP (802.11v).
+    s_wifi_config.sta.rm_enabled = 1;
+    s_wifi_config.sta.btm_enabled = 1;
+#endif
+
+    s_fast_connect = prepare_fast_connect();
+    if (s_fast_connect) {
+        ESP_LOGI(TAG, "warm boot, rejoining saved AP on channel %d", s_target.channel);
+    }
 
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA) );
-    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config) );
     ESP_ERROR_CHECK(esp_wifi_start());
 
     ESP_LOGI(TAG, "wifi_init_sta finished.");
@@ -135,30 +695,53 @@ void wifi_init_sta(void)
     /* xEventGroupWaitBits() returns the bits before the call returned, hence we can test which event actually
      * happened. */
     if (bits & WIFI_CONNECTED_BIT) {
-        ESP_LOGI(TAG, "connected to ap SSID:%s password:%s",
-                 SSID, PW);
+        lock_wifi_network_t network;
+        LOCK_CONFIG_GET(network, wifi_networks[s_target.network]);
+        ESP_LOGI(TAG, "connected to ap SSID:%s", network.ssid);
     } else if (bits & WIFI_FAIL_BIT) {
-        ESP_LOGI(TAG, "Failed to connect to SSID:%s, password:%s",
-                 SSID, PW);
+        ESP_LOGI(TAG, "Failed to connect to any configured network, still trying");
     } else {
         ESP_LOGE(TAG, "UNEXPECTED EVENT");
     }
 }
 
 /**
- * @brief Connect to WiFi based on the SSID and PW.
+ * @brief Connect to WiFi using the configured networks. NVS must already be initialized (lock_config_load()), and the timer service started.
  * 
  */
 void connect_to_wifi(){
-    
-    //Initialize NVS
-    esp_err_t ret = nvs_flash_init();
-    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-      ESP_ERROR_CHECK(nvs_flash_erase());
-      ret = nvs_flash_init();
-    }
-    ESP_ERROR_CHECK(ret);
-
     ESP_LOGI(TAG, "ESP_WIFI_MODE_STA");
     wifi_init_sta();
 }
+
+/**
+ * @brief   Drops the association and times how long the station takes to get back: to the AP, and then to an IP
+ *          address. The normal reconnect path does the work, so this measures what a real drop costs. MQTT
+ *          rides it out if the station is back before its keepalive runs out. Blocks the caller.
+ *
+ * @param associate_us Receives the time until the AP accepted the association.
+ * @param ip_us Receives the time until the station had an IP address.
+ * @param timeout_ms How long to wait for the IP address.
+ * @return true if the station got an IP address in time.
+ */
+bool wifi_measure_reconnect(uint32_t* associate_us, uint32_t* ip_us, uint32_t timeout_ms){
+    if (!(xEventGroupGetBits(s_wifi_event_group) & WIFI_CONNECTED_BIT)) {
+        return false;
+    }
+
+    int64_t start = esp_timer_get_time();
+    s_associated_us = 0;
+    s_retry_num = 0;
+    xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+    esp_wifi_disconnect();
+
+    EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group, WIFI_CONNECTED_BIT, pdFALSE, pdFALSE,
+                                           pdMS_TO_TICKS(timeout_ms));
+    if (!(bits & WIFI_CONNECTED_BIT)) {
+        return false;
+    }
+
+    *ip_us = esp_timer_get_time() - start;
+    *associate_us = s_associated_us > start ? s_associated_us - start : 0;
+    return true;
+}
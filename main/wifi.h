@@ -24,7 +24,11 @@
 
 #pragma once
 
-#define SSID "testspot"
-#define PW "1234567890"
+#include <stdbool.h>
+#include <stdint.h>
 
-void connect_to_wifi();
\ No newline at end of file
+/* Connect and roam reports, with their timing, see wifi.c. */
+#define WIFI_TOPIC "/mister_nolan/wifi"
+
+void connect_to_wifi();
+bool wifi_measure_reconnect(uint32_t* associate_us, uint32_t* ip_us, uint32_t timeout_ms);
\ No newline at end of file
@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+#
+# This file is part of smart_lock.
+#
+# smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+# GNU General Public License as published by the Free Software Foundation, either version 3 of
+# the License, or (at your option) any later version.
+#
+"""Decodes raw fast_log records (see main/fast_log.h) using the firmware ELF.
+
+Capture the records published by a CONFIG_SMART_LOCK_FAST_LOG_RAW_MQTT build, then decode:
+
+    mosquitto_sub -h test.mosquitto.org -t /mister_nolan/log -N > log.bin
+    decode_log.py build/smart_lock.elf log.bin
+
+Requires pyelftools (pip install pyelftools).
+"""
+
+import argparse
+import re
+import struct
+
+from elftools.elf.elffile import ELFFile
+
+RECORD = struct.Struct("<IIIBBBB4I")
+CONVERSION = re.compile(r"%([-+ #0]*\d*(?:\.\d+)?)(?:hh|h|ll|l|z|j|t)?([diouxXcsp%])")
+
+
+class Strings:
+    """Reads NUL terminated strings out of the allocated sections of an ELF."""
+
+    def __init__(self, elf_file):
+        self.sections = []
+        for section in ELFFile(elf_file).iter_sections():
+            if section["sh_flags"] & 0x2 and section["sh_type"] == "SHT_PROGBITS":
+                self.sections.append((section["sh_addr"], section.data()))
+
+    def get(self, address):
+        for start, data in self.sections:
+            if start <= address < start + len(data):
+                end = data.index(b"\0", address - start)
+                return data[address - start:end].decode("utf-8", "replace")
+        return "<0x%08x>" % address
+
+
+def format_record(strings, fmt, args):
+    args = list(args)
+
+    def convert(match):
+        flags, kind = match.groups()
+        if kind == "%":
+            return "%"
+        value = args.pop(0) if args else 0
+        if kind == "s":
+            return ("%" + flags + "s") % strings.get(value)
+        if kind == "c":
+            return chr(value & 0xFF)
+        if kind == "p":
+            return "0x%08x" % value
+        if kind in "di":
+            value = value - (1 << 32) if value & 0x80000000 else value
+            kind = "d"
+        elif kind == "u":
+            kind = "d"
+        return ("%" + flags + kind) % value
+
+    return CONVERSION.sub(convert, fmt)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("elf", help="firmware ELF the records came from")
+    parser.add_argument("records", help="file of concatenated raw records")
+    args = parser.parse_args()
+
+    with open(args.elf, "rb") as f:
+        strings = Strings(f)
+        with open(args.records, "rb") as records:
+            data = records.read()
+
+    records = []
+    for offset in range(0, len(data) - RECORD.size + 1, RECORD.size):
+        time_us, fmt, tag, level, nargs, core, time_hi, *values = RECORD.unpack_from(data, offset)
+        records.append((time_hi << 32 | time_us, fmt, tag, level, nargs, core, values))
+
+    # Each batch holds one core's ring after the other; both cores share the clock, so merge them by time.
+    records.sort(key=lambda record: record[0])
+
+    for time_us, fmt, tag, level, nargs, core, values in records:
+        message = format_record(strings, strings.get(fmt), values[:nargs])
+        print("%c (%u) [%d] %s: %s" % (level, time_us // 1000, core, strings.get(tag), message))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,176 @@
+#!/usr/bin/env python3
+#
+# This file is part of smart_lock.
+#
+# smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+# GNU General Public License as published by the Free Software Foundation, either version 3 of
+# the License, or (at your option) any later version.
+#
+"""Measures broker failover and switch back with two local mosquitto instances.
+
+Starts a preferred broker and a backup broker on this machine, then:
+
+  1. waits for the lock to publish its retained state on the preferred broker,
+  2. kills the preferred broker and times how long until the lock's state appears on the backup,
+  3. restarts the preferred broker and times how long until the lock moves back.
+
+The lock has to be configured with both brokers, most preferred first. --configure sends that configuration
+over the broker the lock is using now (--broker), signed with the lock's CONFIG_SMART_LOCK_COMMAND_KEY; reboot
+the lock afterwards for it to take effect. Signed messages are numbered per boot of the lock, so --seq can stay
+at 1 unless something else has sent it a signed message since it last booted.
+
+    failover_test.py --host 192.168.1.20 --configure --broker 192.168.1.5 --key s3cret     # then reboot the lock
+    failover_test.py --host 192.168.1.20
+
+Requires mosquitto on the PATH and paho-mqtt (pip install paho-mqtt).
+"""
+
+import argparse
+import hashlib
+import hmac
+import json
+import os
+import subprocess
+import tempfile
+import threading
+import time
+
+import paho.mqtt.client as mqtt
+
+STATE_TOPIC = "/mister_nolan/state"
+CONFIG_TOPIC = "/mister_nolan/config"
+
+
+def sign(key, message):
+    text = json.dumps(message, separators=(",", ":"))
+    mac = hmac.new(key.encode(), text.encode(), hashlib.sha256).hexdigest()
+    return (text + "\n" + mac).encode()
+
+
+class Broker:
+    def __init__(self, port, workdir):
+        self.port = port
+        self.config = os.path.join(workdir, "mosquitto-%d.conf" % port)
+        with open(self.config, "w") as f:
+            f.write("listener %d 0.0.0.0\nallow_anonymous true\n" % port)
+        self.process = None
+
+    def start(self):
+        self.process = subprocess.Popen(["mosquitto", "-c", self.config],
+                                        stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        time.sleep(0.5)
+
+    def stop(self):
+        if self.process is not None:
+            self.process.kill()
+            self.process.wait()
+            self.process = None
+
+
+class StateWatcher:
+    """Records when an online state message arrives on a broker."""
+
+    def __init__(self, host, port):
+        self.event = threading.Event()
+        self.boot = None
+        self.client = mqtt.Client()
+        self.client.on_connect = lambda client, userdata, flags, rc: client.subscribe(STATE_TOPIC, 1)
+        self.client.on_message = self.on_message
+        self.client.connect_async(host, port)
+        self.client.loop_start()
+
+    def on_message(self, client, userdata, message):
+        try:
+            state = json.loads(message.payload)
+        except ValueError:
+            return
+        if state.get("online"):
+            self.boot = state.get("boot")
+            self.event.set()
+
+    def wait(self, timeout):
+        start = time.monotonic()
+        found = self.event.wait(timeout)
+        return time.monotonic() - start if found else None
+
+    def close(self):
+        self.client.loop_stop()
+        self.client.disconnect()
+
+
+def parse_broker(text):
+    host, _, port = text.partition(":")
+    return host, int(port) if port else 1883
+
+
+def configure(args, uris):
+    host, port = parse_broker(args.broker)
+    print("waiting for the lock on %s:%d to send it the broker list" % (host, port))
+    watcher = StateWatcher(host, port)
+    if watcher.wait(args.timeout) is None:
+        print("the lock never connected")
+        return
+    watcher.close()
+    message = {"broker_uris": uris, "boot": watcher.boot, "seq": args.seq}
+    client = mqtt.Client()
+    client.connect(host, port)
+    client.publish(CONFIG_TOPIC, sign(args.key, message), qos=1).wait_for_publish()
+    client.disconnect()
+    print("sent %s; reboot the lock" % uris)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--host", required=True, help="address of this machine as seen from the lock")
+    parser.add_argument("--primary-port", type=int, default=1883)
+    parser.add_argument("--backup-port", type=int, default=1884)
+    parser.add_argument("--timeout", type=float, default=120, help="seconds to wait for each step")
+    parser.add_argument("--configure", action="store_true", help="send the broker list to the lock and exit")
+    parser.add_argument("--key", help="CONFIG_SMART_LOCK_COMMAND_KEY of the lock, for --configure")
+    parser.add_argument("--broker", help="host[:port] of the broker the lock is using now, for --configure")
+    parser.add_argument("--seq", type=int, default=1,
+                        help="sequence number for --configure, above any sent to the lock since it booted")
+    args = parser.parse_args()
+    if args.configure and not (args.key and args.broker):
+        parser.error("--configure needs --key and --broker")
+    if args.seq < 1:
+        parser.error("--seq must be at least 1")
+
+    uris = ["mqtt://%s:%d" % (args.host, port) for port in (args.primary_port, args.backup_port)]
+    if args.configure:
+        configure(args, uris)
+        return
+
+    with tempfile.TemporaryDirectory() as workdir:
+        primary = Broker(args.primary_port, workdir)
+        backup = Broker(args.backup_port, workdir)
+        primary.start()
+        backup.start()
+
+        try:
+            watcher = StateWatcher("127.0.0.1", args.primary_port)
+            if watcher.wait(args.timeout) is None:
+                print("the lock never connected to the primary broker")
+                return
+            watcher.close()
+            print("lock is on the primary broker")
+
+            # Both brokers run without persistence, so nothing retained from an earlier run can trigger these.
+            watcher = StateWatcher("127.0.0.1", args.backup_port)
+            primary.stop()
+            failover = watcher.wait(args.timeout)
+            watcher.close()
+            print("failover: %s" % ("%.2f s" % failover if failover is not None else "timed out"))
+
+            primary.start()
+            watcher = StateWatcher("127.0.0.1", args.primary_port)
+            switch_back = watcher.wait(args.timeout)
+            watcher.close()
+            print("switch back: %s" % ("%.2f s" % switch_back if switch_back is not None else "timed out"))
+        finally:
+            primary.stop()
+            backup.stop()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,246 @@
+#!/usr/bin/env python3
+#
+# This file is part of smart_lock.
+#
+# smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+# GNU General Public License as published by the Free Software Foundation, either version 3 of
+# the License, or (at your option) any later version.
+#
+"""Compares unlock latency over the LAN endpoint with the path through the MQTT broker.
+
+Sends the same signed unlock command (see main/command.c) alternately as a UDP datagram to the lock's LAN
+endpoint and as an MQTT message on its command topic, and reports ack and completion round trip percentiles for
+each path side by side. The lock must be built with CONFIG_SMART_LOCK_COMMAND_KEY set to the same key.
+
+    lan_bench.py --key s3cret                                # find the lock over mDNS, broker test.mosquitto.org
+    lan_bench.py --key s3cret --lan 192.168.1.40 --count 30
+    lan_bench.py --key s3cret --lan 192.168.1.40 --no-mqtt   # LAN only, works with the uplink down
+
+The boot nonce comes from the mDNS TXT record, --boot, or the lock's retained state on the broker, in that order.
+Commands are numbered from --seq up, which must be above any sequence number used since the lock booted.
+Every accepted command really unlocks the lock. Commands that arrive while it is open are coalesced, and the
+per-source rate limits still apply, so keep --interval above the MQTT and LAN refill periods.
+
+Requires paho-mqtt for the broker path and zeroconf for discovery (pip install paho-mqtt zeroconf).
+"""
+
+import argparse
+import hashlib
+import hmac
+import json
+import select
+import socket
+import threading
+import time
+import uuid
+
+SERVICE = "_smartlock._udp.local."
+STATE_TOPIC = "/mister_nolan/state"
+DEFAULT_TOPIC = "/mister_nolan/sub"
+
+
+def sign(key, command):
+    text = json.dumps(command, separators=(",", ":"))
+    mac = hmac.new(key.encode(), text.encode(), hashlib.sha256).hexdigest()
+    return (text + "\n" + mac).encode()
+
+
+def discover(timeout):
+    """Returns (address, port, boot nonce) of the first lock found over mDNS, or None."""
+    from zeroconf import ServiceBrowser, Zeroconf
+
+    found = []
+    event = threading.Event()
+
+    class Listener:
+        def add_service(self, zc, type_, name):
+            info = zc.get_service_info(type_, name)
+            if info and info.addresses:
+                boot = info.properties.get(b"boot", b"").decode()
+                found.append((socket.inet_ntoa(info.addresses[0]), info.port, boot))
+                event.set()
+
+        def remove_service(self, zc, type_, name):
+            pass
+
+        def update_service(self, zc, type_, name):
+            pass
+
+    zc = Zeroconf()
+    try:
+        ServiceBrowser(zc, SERVICE, Listener())
+        event.wait(timeout)
+    finally:
+        zc.close()
+    return found[0] if found else None
+
+
+class Result:
+    def __init__(self, path):
+        self.path = path
+        self.sent = time.monotonic()
+        self.ack = None
+        self.done = None
+        self.status = None
+        self.report = None
+
+    def record(self, reply, now):
+        if reply.get("phase") == "ack" and self.ack is None:
+            self.ack = now
+            self.status = reply.get("status")
+        elif reply.get("phase") == "done" and self.done is None:
+            self.done = now
+            self.report = reply
+
+
+class Bench:
+    def __init__(self, args, lan, boot):
+        self.args = args
+        self.lan = lan
+        self.boot = boot
+        self.seq = args.seq
+        self.results = {}
+        self.lock = threading.Lock()
+        self.udp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.udp.bind(("", 0))
+        self.mqtt = None
+        self.reply_topic = "/smart_lock/lan_bench/%s" % uuid.uuid4().hex[:12]
+
+    def connect_mqtt(self):
+        import paho.mqtt.client as mqtt
+
+        subscribed = threading.Event()
+        self.mqtt = mqtt.Client()
+        self.mqtt.on_connect = lambda client, userdata, flags, rc: client.subscribe(
+            [(self.reply_topic, 1), (STATE_TOPIC, 1)])
+        self.mqtt.on_subscribe = lambda client, userdata, mid, granted_qos: subscribed.set()
+        self.mqtt.on_message = self.on_mqtt_message
+        self.mqtt.connect(self.args.broker, self.args.broker_port)
+        self.mqtt.loop_start()
+        if not subscribed.wait(10):
+            raise SystemExit("could not subscribe on %s" % self.args.broker)
+
+    def on_mqtt_message(self, client, userdata, message):
+        now = time.monotonic()
+        try:
+            reply = json.loads(message.payload)
+        except ValueError:
+            return
+        if message.topic == STATE_TOPIC:
+            if self.boot is None and reply.get("boot"):
+                self.boot = reply["boot"]
+            return
+        self.record(reply, now)
+
+    def record(self, reply, now):
+        with self.lock:
+            result = self.results.get(reply.get("id"))
+            if result is not None:
+                result.record(reply, now)
+
+    def poll_udp(self, seconds):
+        deadline = time.monotonic() + seconds
+        while True:
+            remaining = deadline - time.monotonic()
+            if remaining <= 0:
+                return
+            readable, _, _ = select.select([self.udp], [], [], remaining)
+            if readable:
+                data, _ = self.udp.recvfrom(1024)
+                now = time.monotonic()
+                try:
+                    self.record(json.loads(data), now)
+                except ValueError:
+                    pass
+
+    def send(self, path):
+        command_id = uuid.uuid4().hex[:16]
+        command = {"cmd": "unlock", "id": command_id, "boot": self.boot, "seq": self.seq}
+        self.seq += 1
+        if path == "mqtt":
+            command["reply"] = self.reply_topic
+        with self.lock:
+            self.results[command_id] = Result(path)
+        if path == "lan":
+            self.udp.sendto(sign(self.args.key, command), self.lan)
+        else:
+            self.mqtt.publish(self.args.topic, sign(self.args.key, command), 0)
+
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(round(p / 100.0 * (len(values) - 1))))]
+
+
+def summary(name, values):
+    if not values:
+        return "%-16s no samples" % name
+    return "%-16s n=%-4d p50=%8.1f p90=%8.1f p99=%8.1f max=%8.1f" % (
+        name, len(values), percentile(values, 50), percentile(values, 90), percentile(values, 99), max(values))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--key", required=True, help="CONFIG_SMART_LOCK_COMMAND_KEY of the lock")
+    parser.add_argument("--lan", help="lock address; found over mDNS if not given")
+    parser.add_argument("--port", type=int, default=4210, help="LAN endpoint port, if --lan is given")
+    parser.add_argument("--boot", help="boot nonce, if neither mDNS nor the broker is available")
+    parser.add_argument("--broker", default="test.mosquitto.org")
+    parser.add_argument("--broker-port", type=int, default=1883)
+    parser.add_argument("--topic", default=DEFAULT_TOPIC, help="lock command topic")
+    parser.add_argument("--no-mqtt", action="store_true", help="only measure the LAN path")
+    parser.add_argument("--count", type=int, default=10, help="commands per path")
+    parser.add_argument("--interval", type=float, default=12.0, help="seconds between commands")
+    parser.add_argument("--seq", type=int, default=1, help="sequence number of the first command")
+    args = parser.parse_args()
+    if args.seq < 1:
+        parser.error("--seq must be at least 1")
+
+    boot = args.boot
+    if args.lan:
+        lan = (args.lan, args.port)
+    else:
+        found = discover(5)
+        if found is None:
+            raise SystemExit("no lock found over mDNS; pass --lan")
+        lan = (found[0], found[1])
+        boot = boot or found[2]
+        print("found lock at %s:%d" % lan)
+
+    bench = Bench(args, lan, boot)
+    if not args.no_mqtt:
+        bench.connect_mqtt()
+        for _ in range(50):
+            if bench.boot:
+                break
+            time.sleep(0.1)
+    if not bench.boot:
+        raise SystemExit("no boot nonce; pass --boot")
+
+    paths = ["lan"] if args.no_mqtt else ["lan", "mqtt"]
+    for round_number in range(args.count):
+        for path in paths:
+            bench.send(path)
+            bench.poll_udp(args.interval / len(paths))
+
+    bench.poll_udp(3)
+    if bench.mqtt is not None:
+        bench.mqtt.loop_stop()
+        bench.mqtt.disconnect()
+
+    with bench.lock:
+        results = list(bench.results.values())
+
+    for path in paths:
+        mine = [r for r in results if r.path == path]
+        statuses = {}
+        for r in mine:
+            statuses[r.status or "no_ack"] = statuses.get(r.status or "no_ack", 0) + 1
+        print("\n%s: %s" % (path, ", ".join("%s=%d" % item for item in sorted(statuses.items()))))
+        print("  " + summary("ack rtt ms", [(r.ack - r.sent) * 1000 for r in mine if r.ack is not None]))
+        print("  " + summary("done rtt ms", [(r.done - r.sent) * 1000 for r in mine
+                                             if r.done is not None and r.report.get("status") == "done"]))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,146 @@
+#!/usr/bin/env python3
+#
+# This file is part of smart_lock.
+#
+# smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+# GNU General Public License as published by the Free Software Foundation, either version 3 of
+# the License, or (at your option) any later version.
+#
+"""Builds a compressed delta between two smart_lock firmware images.
+
+The output is applied on the device by main/ota_update.c against the image it is currently
+running. See ota_update.h for the format.
+
+    make_delta.py old/smart_lock.bin build/smart_lock.bin smart_lock.delta
+
+It also prints the SHA-256 of the new image, which the signed OTA request must carry: the device
+only boots what it wrote if the hash matches. sign_message.py --image adds it for you.
+
+To measure an update, serve the file over HTTPS (the device refuses plain HTTP) and publish its
+URL, signed, on the OTA topic; the device logs the bytes downloaded and the time taken:
+
+    sign_message.py --key <key> --topic /mister_nolan/ota --image build/smart_lock.bin \
+        '{"url": "https://<host>/smart_lock.delta"}'
+"""
+
+import argparse
+import hashlib
+import struct
+import sys
+import zlib
+
+MAGIC = b"SLD1"
+OP_DIFF = 0x01
+OP_INSERT = 0x02
+
+KEY_LEN = 12        # bytes hashed to find match candidates
+INDEX_STEP = 4      # source offsets indexed (Xtensa code is mostly 3/4 byte aligned)
+WINDOW = 32         # approximate matches end when a window has too many mismatches
+MAX_MISMATCH = 8
+MIN_MATCH = 24
+
+
+def image_sha256(image):
+    """Returns the SHA-256 that esp_partition_get_sha256() reports for an app image."""
+    if len(image) < 24 + 32 or image[23] != 1:
+        sys.exit("image has no appended SHA-256; build it with the default ESP-IDF settings")
+    digest = image[-32:]
+    if hashlib.sha256(image[:-32]).digest() != digest:
+        sys.exit("image SHA-256 does not match its contents")
+    return digest
+
+
+def build_index(source):
+    index = {}
+    for s in range(0, len(source) - KEY_LEN, INDEX_STEP):
+        index.setdefault(source[s:s + KEY_LEN], s)
+    return index
+
+
+def extend(source, target, s, t):
+    """Extends a match forward, tolerating scattered byte changes (e.g. shifted addresses)."""
+    n = 0
+    mismatches = []
+    while s + n < len(source) and t + n < len(target):
+        if source[s + n] != target[t + n]:
+            mismatches.append(n)
+            while mismatches and mismatches[0] <= n - WINDOW:
+                mismatches.pop(0)
+            if len(mismatches) > MAX_MISMATCH:
+                break
+        n += 1
+    # Do not end on a run of mismatches.
+    while n > 0 and (s + n > len(source) or t + n > len(target) or source[s + n - 1] != target[t + n - 1]):
+        n -= 1
+    return n
+
+
+def make_delta(source, target):
+    index = build_index(source)
+    body = bytearray()
+    literal = bytearray()
+    t = 0
+    last_s = None
+
+    def flush_literal():
+        if literal:
+            body.extend(struct.pack("<BI", OP_INSERT, len(literal)))
+            body.extend(literal)
+            literal.clear()
+
+    while t < len(target):
+        candidates = []
+        if last_s is not None and last_s < len(source):
+            candidates.append(last_s)
+        s = index.get(bytes(target[t:t + KEY_LEN]))
+        if s is not None:
+            candidates.append(s)
+
+        best_s, best_n = None, 0
+        for c in candidates:
+            n = extend(source, target, c, t)
+            if n > best_n:
+                best_s, best_n = c, n
+
+        if best_n >= MIN_MATCH:
+            flush_literal()
+            diff = bytes((target[t + i] - source[best_s + i]) & 0xFF for i in range(best_n))
+            body.extend(struct.pack("<BII", OP_DIFF, best_s, best_n))
+            body.extend(diff)
+            t += best_n
+            last_s = best_s + best_n
+        else:
+            literal.append(target[t])
+            t += 1
+            if last_s is not None:
+                last_s += 1
+
+    flush_literal()
+    return bytes(body)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("source", help="image currently running on the devices")
+    parser.add_argument("target", help="new image")
+    parser.add_argument("output", help="delta file to write")
+    args = parser.parse_args()
+
+    with open(args.source, "rb") as f:
+        source = f.read()
+    with open(args.target, "rb") as f:
+        target = f.read()
+
+    header = MAGIC + struct.pack("<II", len(source), len(target)) + image_sha256(source)
+    delta = header + zlib.compress(make_delta(source, target), 9)
+
+    with open(args.output, "wb") as f:
+        f.write(delta)
+
+    print("%s: %d bytes (full image %d bytes, %.1f%%)" %
+          (args.output, len(delta), len(target), 100.0 * len(delta) / len(target)))
+    print("sha256: %s" % image_sha256(target).hex())
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,146 @@
+#!/usr/bin/env python3
+#
+# This file is part of smart_lock.
+#
+# smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+# GNU General Public License as published by the Free Software Foundation, either version 3 of
+# the License, or (at your option) any later version.
+#
+"""Measures command round trip times to one or more locks (see main/command.c).
+
+Sends unlock commands carrying a correlation id and a reply topic to each lock's command topic, and matches the
+ack and completion messages that come back. Reports round trip percentiles as seen from this host, along with the
+queueing and actuation times each lock reported for itself.
+
+    rtt_client.py --host test.mosquitto.org --count 20
+    rtt_client.py --host 192.168.1.20 --topic /door1/sub --topic /door2/sub --count 50 --interval 15
+
+Every command really unlocks the lock. Locks rate limit MQTT unlocks (CONFIG_SMART_LOCK_RATE_MQTT_*), so keep
+--interval above the refill period or expect rate_limited acks, which are counted separately.
+
+Requires paho-mqtt (pip install paho-mqtt).
+"""
+
+import argparse
+import json
+import threading
+import time
+import uuid
+
+import paho.mqtt.client as mqtt
+
+DEFAULT_TOPIC = "/mister_nolan/sub"
+
+
+class Pending:
+    def __init__(self, topic):
+        self.topic = topic
+        self.sent = time.monotonic()
+        self.ack = None
+        self.done = None
+        self.status = None
+        self.report = None
+
+
+class Client:
+    def __init__(self, host, port, qos):
+        self.qos = qos
+        self.reply_topic = "/smart_lock/rtt/%s" % uuid.uuid4().hex[:12]
+        self.pending = {}
+        self.lock = threading.Lock()
+        self.subscribed = threading.Event()
+        self.client = mqtt.Client()
+        self.client.on_connect = lambda client, userdata, flags, rc: client.subscribe(self.reply_topic, 1)
+        self.client.on_subscribe = lambda client, userdata, mid, granted_qos: self.subscribed.set()
+        self.client.on_message = self.on_message
+        self.client.connect(host, port)
+        self.client.loop_start()
+
+    def on_message(self, client, userdata, message):
+        now = time.monotonic()
+        try:
+            reply = json.loads(message.payload)
+        except ValueError:
+            return
+        with self.lock:
+            pending = self.pending.get(reply.get("id"))
+            if pending is None:
+                return
+            if reply.get("phase") == "ack" and pending.ack is None:
+                pending.ack = now
+                pending.status = reply.get("status")
+            elif reply.get("phase") == "done" and pending.done is None:
+                pending.done = now
+                pending.report = reply
+
+    def send(self, topic):
+        command_id = uuid.uuid4().hex[:16]
+        with self.lock:
+            self.pending[command_id] = Pending(topic)
+        payload = json.dumps({"cmd": "unlock", "id": command_id, "reply": self.reply_topic})
+        self.client.publish(topic, payload, self.qos)
+
+    def stop(self):
+        self.client.loop_stop()
+        self.client.disconnect()
+
+
+def percentile(values, p):
+    if not values:
+        return float("nan")
+    values = sorted(values)
+    return values[min(len(values) - 1, int(round(p / 100.0 * (len(values) - 1))))]
+
+
+def summary(name, values, unit_scale=1.0):
+    values = [v * unit_scale for v in values]
+    if not values:
+        return "%-14s no samples" % name
+    return "%-14s n=%-4d p50=%8.1f p90=%8.1f p99=%8.1f max=%8.1f" % (
+        name, len(values), percentile(values, 50), percentile(values, 90), percentile(values, 99), max(values))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--host", default="test.mosquitto.org")
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--topic", action="append", help="lock command topic; repeat for several locks")
+    parser.add_argument("--count", type=int, default=10, help="commands per lock")
+    parser.add_argument("--interval", type=float, default=12.0, help="seconds between rounds")
+    parser.add_argument("--timeout", type=float, default=5.0, help="seconds to wait for the last replies")
+    parser.add_argument("--qos", type=int, default=0, choices=(0, 1))
+    args = parser.parse_args()
+    topics = args.topic or [DEFAULT_TOPIC]
+
+    client = Client(args.host, args.port, args.qos)
+    if not client.subscribed.wait(10):
+        raise SystemExit("could not subscribe to %s" % client.reply_topic)
+
+    for round_number in range(args.count):
+        for topic in topics:
+            client.send(topic)
+        if round_number + 1 < args.count:
+            time.sleep(args.interval)
+    time.sleep(args.timeout)
+    client.stop()
+
+    with client.lock:
+        results = list(client.pending.values())
+
+    print("reply topic %s, %d commands to %d locks" % (client.reply_topic, len(results), len(topics)))
+    for topic in topics:
+        mine = [r for r in results if r.topic == topic]
+        statuses = {}
+        for r in mine:
+            statuses[r.status or "no_ack"] = statuses.get(r.status or "no_ack", 0) + 1
+        done = [r for r in mine if r.done is not None and r.report.get("status") == "done"]
+
+        print("\n%s: %s" % (topic, ", ".join("%s=%d" % item for item in sorted(statuses.items()))))
+        print("  " + summary("ack rtt ms", [r.ack - r.sent for r in mine if r.ack is not None], 1000.0))
+        print("  " + summary("done rtt ms", [r.done - r.sent for r in done], 1000.0))
+        print("  " + summary("queue us", [r.report["queue_us"] for r in done]))
+        print("  " + summary("actuation us", [r.report["actuation_us"] for r in done]))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+#
+# This file is part of smart_lock.
+#
+# smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+# GNU General Public License as published by the Free Software Foundation, either version 3 of
+# the License, or (at your option) any later version.
+#
+"""Signs a JSON message for the lock and publishes it (see command_authenticate() in main/command.c).
+
+OTA, config, schedule and audit query messages are only accepted when signed with CONFIG_SMART_LOCK_COMMAND_KEY
+and stamped with the lock's current boot nonce and a fresh sequence number. This adds "boot" and "seq" to the
+given JSON object, signs it, and publishes it on the topic:
+
+    sign_message.py --key s3cret --topic /mister_nolan/ota --image build/smart_lock.bin \
+        '{"url": "https://updates.example.com/smart_lock.delta"}'
+    sign_message.py --key s3cret --topic /mister_nolan/config '{"unlock_hold_ms": 6000}'
+    sign_message.py --key s3cret --topic /mister_nolan/schedule --file schedule.json
+
+The boot nonce comes from --boot or the lock's retained state on the broker. It changes on every boot, so
+messages are never retained: the lock would reject them after its next reboot anyway.
+
+Sequence numbers start again at 0 on every boot, and each message may only move the lock's sequence on by
+CONFIG_SMART_LOCK_COMMAND_SEQ_WINDOW. --seq defaults to 1, which does for the first message after a boot;
+pass one more than the last sequence number used since then for each further message.
+
+An OTA request must name the image it installs. --image adds the "sha256" of the new firmware image (the full
+image, also when the URL points at a delta of it), as printed by make_delta.py.
+
+A user's app can be given a key of its own, which only signs commands carrying that "user", so the lock can
+trust the user when picking the access schedule. The lock numbers each key's messages separately, so the app
+counts its own sequence from 1 after every boot:
+
+    sign_message.py --key s3cret --user-key 1042
+
+Requires paho-mqtt (pip install paho-mqtt).
+"""
+
+import argparse
+import hashlib
+import hmac
+import json
+import threading
+
+import paho.mqtt.client as mqtt
+
+from make_delta import image_sha256
+
+STATE_TOPIC = "/mister_nolan/state"
+
+
+def sign(key, message):
+    text = json.dumps(message, separators=(",", ":"))
+    mac = hmac.new(key.encode(), text.encode(), hashlib.sha256).hexdigest()
+    return (text + "\n" + mac).encode()
+
+
+def user_key(key, user):
+    """The key a user's commands are signed with (see signature_valid() in main/command.c), as hex. The
+    app signs with the 32 bytes it encodes, not with the hex text."""
+    return hmac.new(key.encode(), ("user:%d" % user).encode(), hashlib.sha256).hexdigest()
+
+
+def read_boot(client, timeout):
+    """Returns the boot nonce from the lock's retained state, or None."""
+    found = []
+    event = threading.Event()
+
+    def on_message(client, userdata, message):
+        try:
+            boot = json.loads(message.payload).get("boot")
+        except ValueError:
+            return
+        if boot:
+            found.append(boot)
+            event.set()
+
+    client.on_message = on_message
+    client.subscribe(STATE_TOPIC, 1)
+    event.wait(timeout)
+    client.unsubscribe(STATE_TOPIC)
+    return found[0] if found else None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--key", required=True, help="CONFIG_SMART_LOCK_COMMAND_KEY of the lock")
+    parser.add_argument("--topic")
+    parser.add_argument("--user-key", type=int, metavar="USER", help="print USER's own key and exit")
+    parser.add_argument("--boot", help="boot nonce, if the broker does not hold the lock's state")
+    parser.add_argument("--broker", default="test.mosquitto.org")
+    parser.add_argument("--broker-port", type=int, default=1883)
+    parser.add_argument("--file", help="read the JSON object from this file")
+    parser.add_argument("--image", help="add the SHA-256 of this firmware image as \"sha256\"")
+    parser.add_argument("--seq", type=int, default=1, help="sequence number, above any used since the lock booted")
+    parser.add_argument("message", nargs="?", help="the JSON object")
+    args = parser.parse_args()
+
+    if args.user_key is not None:
+        print(user_key(args.key, args.user_key))
+        return
+    if not args.topic:
+        raise SystemExit("--topic is required")
+    if args.seq < 1:
+        raise SystemExit("--seq must be at least 1")
+
+    if args.file:
+        with open(args.file) as f:
+            message = json.load(f)
+    elif args.message:
+        message = json.loads(args.message)
+    else:
+        raise SystemExit("pass a JSON object or --file")
+    if not isinstance(message, dict):
+        raise SystemExit("the message must be a JSON object")
+    if args.image:
+        with open(args.image, "rb") as f:
+            message["sha256"] = image_sha256(f.read()).hex()
+
+    client = mqtt.Client()
+    client.connect(args.broker, args.broker_port)
+    client.loop_start()
+
+    boot = args.boot or read_boot(client, 5)
+    if not boot:
+        raise SystemExit("no boot nonce; pass --boot")
+
+    message["boot"] = boot
+    message["seq"] = args.seq
+    client.publish(args.topic, sign(args.key, message), qos=1).wait_for_publish()
+
+    client.loop_stop()
+    client.disconnect()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+#
+# This file is part of smart_lock.
+#
+# smart_lock is free software: you can redistribute it and/or modify it under the terms of the
+# GNU General Public License as published by the Free Software Foundation, either version 3 of
+# the License, or (at your option) any later version.
+#
+"""Converts a trace dump (see main/trace.c) into a Chrome JSON trace for Perfetto or chrome://tracing.
+
+Capture a dump from the console or over MQTT, then convert it:
+
+    mosquitto_pub -h test.mosquitto.org -t /mister_nolan/trace -m "dump mqtt"
+    mosquitto_sub -h test.mosquitto.org -t /mister_nolan/trace/data -N > trace.txt
+    trace_to_perfetto.py trace.txt trace.json
+
+Open trace.json at https://ui.perfetto.dev. Each core gets a track showing which task ran when, with the
+interrupts as instants; each task gets a track with its spans.
+"""
+
+import argparse
+import json
+
+CORES_PID = 1
+TASKS_PID = 2
+
+
+def unwrap(events):
+    """Turns the 32 bit microsecond timestamps into a monotonic timeline starting at 0."""
+    offset = 0
+    last = None
+    for event in events:
+        if last is not None and event["time"] + offset < last - (1 << 31):
+            offset += 1 << 32
+        event["time"] += offset
+        last = event["time"]
+    start = events[0]["time"] if events else 0
+    for event in events:
+        event["time"] -= start
+
+
+def parse(lines):
+    tasks = {}
+    events = []
+    for line in lines:
+        fields = line.split()
+        if not fields or fields[0].startswith("#"):
+            continue
+        if fields[0] == "T" and len(fields) >= 2:
+            tasks[fields[1]] = " ".join(fields[2:]) or fields[1]
+        elif fields[0] == "E" and len(fields) >= 5:
+            events.append({"time": int(fields[1]), "core": int(fields[2]), "type": fields[3],
+                           "arg": " ".join(fields[4:])})
+    return tasks, events
+
+
+def convert(tasks, events):
+    unwrap(events)
+    trace = [
+        {"ph": "M", "pid": CORES_PID, "name": "process_name", "args": {"name": "CPU cores"}},
+        {"ph": "M", "pid": TASKS_PID, "name": "process_name", "args": {"name": "Tasks"}},
+    ]
+    task_ids = {}
+
+    def task_id(handle):
+        if handle not in task_ids:
+            task_ids[handle] = len(task_ids) + 1
+            trace.append({"ph": "M", "pid": TASKS_PID, "tid": task_ids[handle], "name": "thread_name",
+                          "args": {"name": tasks.get(handle, handle)}})
+        return task_ids[handle]
+
+    running = {}  # core -> (task handle, since)
+    for core in sorted({event["core"] for event in events}):
+        trace.append({"ph": "M", "pid": CORES_PID, "tid": core, "name": "thread_name",
+                      "args": {"name": "CPU %d" % core}})
+
+    for event in events:
+        core, time = event["core"], event["time"]
+        if event["type"] == "S":
+            if core in running:
+                handle, since = running[core]
+                trace.append({"ph": "X", "pid": CORES_PID, "tid": core, "ts": since, "dur": time - since,
+                              "name": tasks.get(handle, handle)})
+            running[core] = (event["arg"], time)
+        elif event["type"] == "I":
+            trace.append({"ph": "i", "s": "t", "pid": CORES_PID, "tid": core, "ts": time, "name": event["arg"]})
+        elif event["type"] in "BE":
+            # Spans belong to whichever task was running on that core.
+            handle = running.get(core, ("core%d" % core, 0))[0]
+            trace.append({"ph": event["type"], "pid": TASKS_PID, "tid": task_id(handle), "ts": time,
+                          "name": event["arg"]})
+
+    end = events[-1]["time"] if events else 0
+    for core, (handle, since) in running.items():
+        trace.append({"ph": "X", "pid": CORES_PID, "tid": core, "ts": since, "dur": end - since,
+                      "name": tasks.get(handle, handle)})
+
+    return {"traceEvents": trace, "displayTimeUnit": "ms"}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("dump", help="text dump from the console or /mister_nolan/trace/data")
+    parser.add_argument("output", help="Chrome JSON trace to write")
+    args = parser.parse_args()
+
+    with open(args.dump, errors="replace") as f:
+        tasks, events = parse(f)
+
+    with open(args.output, "w") as f:
+        json.dump(convert(tasks, events), f)
+
+    print("%d events, %d tasks" % (len(events), len(tasks)))
+
+
+if __name__ == "__main__":
+    main()